@@ -0,0 +1,150 @@
+// Benchmark of the compression of file content:
+//   codec  : lz_compress and lz_decompress alone, on 1 KB to 1 MB of text,
+//            log lines, random bytes and zeros
+//   volume : write_file and read_file of 10000 text files of 1 KB to 64 KB
+//            with compression off and on, and the blocks they take
+// Each line of the output is one configuration, as CSV:
+//   bench,data,size,compression,ratio,write_mb_s,read_mb_s,blocks
+// For the codec, write is compression and read decompression; ratio is
+// the size of the content over what is stored (blocks for a volume).
+// Build: make bench   (from van/)
+// Usage: bench_compress [output file, default standard output]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+FILE* out;
+int errors;
+
+const char* words[] = {
+    "the", "file", "system", "block", "volume", "write", "read", "of", "a",
+    "directory", "cache", "journal", "is", "to", "and", "extent", "free", "in",
+    "entry", "name", "path", "size", "with", "for", "on", "data", "index"
+};
+
+// Content of size bytes of one kind, the last one being a NUL
+char* make_content(const char* kind, int size, unsigned int seed) {
+    char* content = malloc(size + 64);
+    int length = 0;
+    while (length < size) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned int r = seed >> 8;
+        if (strcmp(kind, "text") == 0) {
+            length += sprintf(content + length, "%s%s", words[r % 27], r % 11 ? " " : ".\n");
+        } else if (strcmp(kind, "log") == 0) {
+            length += sprintf(content + length, "%08u %s %s=%u\n", r % 100000000,
+                              r % 5 ? "INFO" : "WARN", words[r % 27], r % 4096);
+        } else if (strcmp(kind, "random") == 0) {
+            content[length++] = (char)(r | 1);
+        } else {
+            content[length++] = '0';
+        }
+    }
+    content[size - 1] = '\0';
+    return content;
+}
+
+void bench_codec(const char* kind, int size) {
+    char* content = make_content(kind, size, 42);
+    char* packed = malloc(size);
+    char* unpacked = malloc(size);
+    int rounds = (64 << 20) / size;
+    size_t stored = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < rounds; i++) stored = lz_compress(content, size, packed, size);
+    double compress_ns = now_ns() - start;
+    if (stored == 0) {  // Did not compress: stored as it is
+        stored = size;
+        memcpy(packed, content, size);
+    }
+
+    double decompress_ns = 0;
+    if (stored < (size_t)size) {
+        start = now_ns();
+        for (int i = 0; i < rounds; i++) {
+            if (lz_decompress(packed, stored, unpacked, size) != 0) errors++;
+        }
+        decompress_ns = now_ns() - start;
+        if (memcmp(unpacked, content, size) != 0) {
+            fprintf(stderr, "Error: %s of %d bytes does not decompress\n", kind, size);
+            errors++;
+        }
+    }
+    double mb = (double)size * rounds / (1 << 20);
+    fprintf(out, "codec,%s,%d,on,%.2f,%.0f,%.0f,0\n", kind, size, (double)size / stored,
+            mb / (compress_ns / 1e9), decompress_ns ? mb / (decompress_ns / 1e9) : 0.0);
+    fflush(out);
+    free(content);
+    free(packed);
+    free(unpacked);
+}
+
+void bench_volume(int size, int compression) {
+    char name[MAX_PATH];
+    int files = 10000;
+    int blocks_per_file = (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+    if (fs.volume) free_filesystem();
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, files * blocks_per_file + 1024,
+                               DEFAULT_NUM_FILES, files + 16};
+    init_filesystem(&geometry);
+    fs.compression = compression;
+    char* contents[16];
+    for (int i = 0; i < 16; i++) contents[i] = make_content("text", size, i + 1);
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        create_file(name, 0);
+    }
+    int free_before = fs.free_block_count;
+
+    double start = now_ns();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        if (write_file(name, contents[i % 16]) != 0) errors++;
+    }
+    double write_ns = now_ns() - start;
+    drain_alloc_caches();
+    int blocks = free_before - fs.free_block_count;
+
+    start = now_ns();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        char* data = read_file(name);
+        if (!data || memcmp(data, contents[i % 16], size) != 0) errors++;
+        free(data);
+    }
+    double read_ns = now_ns() - start;
+
+    double mb = (double)size * files / (1 << 20);
+    fprintf(out, "volume,text,%d,%s,%.2f,%.0f,%.0f,%d\n", size, compression ? "on" : "off",
+            (double)size * files / ((double)blocks * DEFAULT_BLOCK_SIZE),
+            mb / (write_ns / 1e9), mb / (read_ns / 1e9), blocks);
+    fflush(out);
+    for (int i = 0; i < 16; i++) free(contents[i]);
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    // The messages of the file system are not part of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    fprintf(out, "bench,data,size,compression,ratio,write_mb_s,read_mb_s,blocks\n");
+    const char* kinds[] = {"text", "log", "random", "zeros"};
+    int sizes[] = {1024, 16384, 1 << 20};
+    for (int k = 0; k < 4; k++) {
+        for (int i = 0; i < 3; i++) bench_codec(kinds[k], sizes[i]);
+    }
+    int file_sizes[] = {1024, 4096, 65536};
+    for (int i = 0; i < 3; i++) {
+        bench_volume(file_sizes[i], 0);
+        bench_volume(file_sizes[i], 1);
+    }
+
+    free_filesystem();
+    fclose(out);
+    if (errors) fprintf(stderr, "Error: %d checks failed\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,326 @@
+// Microbenchmarks of the core file operations, called directly:
+//   files : create, find_file_in_dir, write_file, read_file, list_directory,
+//           delete_file and delete_directory_recursive on 1K to 100K files
+//   size  : write_file and read_file of 64 B to 1 MB files
+//   depth : create, write_file, read_file and delete_file by path, 1 to 64
+//           directories deep
+//   frag  : write_file, read_file and delete_file of 64 KB files when the
+//           free space is scattered in runs of 1 to 64 blocks, or contiguous
+// Each line of the output is one operation of one configuration, as CSV:
+//   bench,op,files,size,depth,free_run,count,ops_per_sec,p50_ns,p99_ns
+// free_run is 0 when the free space is contiguous. Runs of two builds can
+// be compared line by line, e.g. with join -t, on the first six columns.
+// Build: make bench   (from van/)
+// Usage: bench_core [output file, default standard output]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+#define MAX_SAMPLES 100000
+
+FILE* out;
+double samples[MAX_SAMPLES];
+int num_samples;
+double total_ns;
+
+// Time one call into the samples
+#define TIMED(call) do {                         \
+        double start_ = now_ns();                \
+        call;                                    \
+        double elapsed_ = now_ns() - start_;     \
+        total_ns += elapsed_;                    \
+        if (num_samples < MAX_SAMPLES) samples[num_samples++] = elapsed_; \
+    } while (0)
+
+int compare_samples(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void start_op() {
+    num_samples = 0;
+    total_ns = 0;
+}
+
+// Print the samples taken since start_op() as one line of results
+void report_op(const char* bench, const char* op, int files, int size, int depth,
+               int free_run) {
+    if (num_samples == 0) return;
+    qsort(samples, num_samples, sizeof(double), compare_samples);
+    fprintf(out, "%s,%s,%d,%d,%d,%d,%d,%.0f,%.0f,%.0f\n", bench, op, files, size,
+            depth, free_run, num_samples, num_samples / (total_ns / 1e9),
+            samples[num_samples / 2], samples[num_samples * 99 / 100]);
+    fflush(out);
+}
+
+int errors;
+
+void check(int ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "Error: %s failed\n", what);
+        errors++;
+    }
+}
+
+// Content of size bytes, the last one being the NUL of the string
+char* make_content(int size) {
+    char* content = malloc(size);
+    for (int i = 0; i < size - 1; i++) content[i] = 'a' + i % 26;
+    content[size - 1] = '\0';
+    return content;
+}
+
+int new_volume(int num_blocks, int max_files) {
+    if (fs.volume) free_filesystem();
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, num_blocks, DEFAULT_NUM_FILES, max_files};
+    return init_filesystem(&geometry);
+}
+
+void bench_files(int files) {
+    char name[MAX_PATH];
+    char* content = make_content(64);
+    new_volume(files * 2 + 1024, files * 2 + 16);
+    int dir = create_file("/flat", 1);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/flat/f%07d", i);
+        int index;
+        TIMED(index = create_file(name, 0));
+        check(index >= 0, "create_file");
+    }
+    report_op("files", "create", files, 0, 1, 0);
+
+    start_op();
+    srand(42);
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%07d", rand() % files);
+        int index;
+        TIMED(index = find_file_in_dir(name, dir));
+        check(index != -1, "find_file_in_dir");
+    }
+    report_op("files", "lookup", files, 0, 1, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/flat/f%07d", i);
+        int result;
+        TIMED(result = write_file(name, content));
+        check(result == 0, "write_file");
+    }
+    report_op("files", "write", files, 64, 1, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/flat/f%07d", i);
+        char* data;
+        TIMED(data = read_file(name));
+        check(data != NULL, "read_file");
+        free(data);
+    }
+    report_op("files", "read", files, 64, 1, 0);
+
+    start_op();
+    for (int i = 0; i < 10; i++) {
+        TIMED(list_directory(dir));
+    }
+    report_op("files", "list", files, 64, 1, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/flat/f%07d", i);
+        int result;
+        TIMED(result = delete_file(name));
+        check(result == 0, "delete_file");
+    }
+    report_op("files", "delete", files, 64, 1, 0);
+
+    // Whole trees: the files again, under ten subdirectories
+    start_op();
+    for (int round = 0; round < 5; round++) {
+        int top = create_file("/tree", 1);
+        for (int d = 0; d < 10; d++) {
+            snprintf(name, sizeof(name), "/tree/d%d", d);
+            create_file(name, 1);
+        }
+        for (int i = 0; i < files; i++) {
+            snprintf(name, sizeof(name), "/tree/d%d/f%07d", i % 10, i);
+            create_file(name, 0);
+            write_file(name, content);
+        }
+        int result;
+        TIMED(result = delete_directory_recursive(top));
+        check(result == 0, "delete_directory_recursive");
+    }
+    report_op("files", "delete_tree", files, 64, 2, 0);
+    free(content);
+}
+
+void bench_size(int size) {
+    char name[MAX_PATH];
+    int files = size >= (1 << 20) ? 100 : 1000;
+    char* content = make_content(size);
+    int blocks_per_file = (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+    new_volume(files * blocks_per_file + 1024, files + 16);
+
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        create_file(name, 0);
+    }
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        int result;
+        TIMED(result = write_file(name, content));
+        check(result == 0, "write_file");
+    }
+    report_op("size", "write", files, size, 1, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        char* data;
+        TIMED(data = read_file(name));
+        check(data != NULL && memcmp(data, content, size) == 0, "read_file");
+        free(data);
+    }
+    report_op("size", "read", files, size, 1, 0);
+    free(content);
+}
+
+void bench_depth(int depth) {
+    char dir[MAX_PATH] = "";
+    char name[MAX_PATH];
+    int files = 1000;
+    char* content = make_content(64);
+    new_volume(files + 1024, files + depth + 16);
+
+    int length = 0;
+    for (int d = 0; d < depth - 1; d++) {
+        length += snprintf(dir + length, sizeof(dir) - length, "/d");
+        create_file(dir, 1);
+    }
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "%s/f%d", dir, i);
+        int index;
+        TIMED(index = create_file(name, 0));
+        check(index >= 0, "create_file");
+    }
+    report_op("depth", "create", files, 0, depth, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "%s/f%d", dir, i);
+        int result;
+        TIMED(result = write_file(name, content));
+        check(result == 0, "write_file");
+    }
+    report_op("depth", "write", files, 64, depth, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "%s/f%d", dir, i);
+        char* data;
+        TIMED(data = read_file(name));
+        check(data != NULL, "read_file");
+        free(data);
+    }
+    report_op("depth", "read", files, 64, depth, 0);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "%s/f%d", dir, i);
+        int result;
+        TIMED(result = delete_file(name));
+        check(result == 0, "delete_file");
+    }
+    report_op("depth", "delete", files, 64, depth, 0);
+    free(content);
+}
+
+// Fill the volume with files of free_run blocks and delete every other
+// one, so half of it is free in runs of free_run blocks. 0 leaves the
+// free space in one run.
+void bench_frag(int free_run) {
+    char name[MAX_PATH];
+    int num_blocks = 1 << 16;
+    int size = 64 << 10;
+    int files = num_blocks / 2 / (size / DEFAULT_BLOCK_SIZE) / 2;
+    char* content = make_content(size);
+    new_volume(num_blocks, num_blocks + 16);
+
+    if (free_run > 0) {
+        char* filler = make_content(free_run * DEFAULT_BLOCK_SIZE);
+        int fillers = 0;
+        for (;; fillers++) {
+            snprintf(name, sizeof(name), "/fill%d", fillers);
+            if (fs.free_block_count < free_run) break;
+            create_file(name, 0);
+            if (write_file(name, filler) != 0) break;
+        }
+        for (int i = 0; i < fillers; i += 2) {
+            snprintf(name, sizeof(name), "/fill%d", i);
+            delete_file(name);
+        }
+        free(filler);
+    }
+
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        create_file(name, 0);
+    }
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        int result;
+        TIMED(result = write_file(name, content));
+        check(result == 0, "write_file");
+    }
+    report_op("frag", "write", files, size, 1, free_run);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        char* data;
+        TIMED(data = read_file(name));
+        check(data != NULL, "read_file");
+        free(data);
+    }
+    report_op("frag", "read", files, size, 1, free_run);
+
+    start_op();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        int result;
+        TIMED(result = delete_file(name));
+        check(result == 0, "delete_file");
+    }
+    report_op("frag", "delete", files, size, 1, free_run);
+    free(content);
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    // The listings and messages of the file system are not part of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    fprintf(out, "bench,op,files,size,depth,free_run,count,ops_per_sec,p50_ns,p99_ns\n");
+    int file_counts[] = {1000, 10000, 100000};
+    for (int i = 0; i < 3; i++) bench_files(file_counts[i]);
+    int sizes[] = {64, 4096, 65536, 1 << 20};
+    for (int i = 0; i < 4; i++) bench_size(sizes[i]);
+    int depths[] = {1, 4, 16, 64};
+    for (int i = 0; i < 4; i++) bench_depth(depths[i]);
+    int free_runs[] = {0, 64, 16, 4, 1};
+    for (int i = 0; i < 5; i++) bench_frag(free_runs[i]);
+
+    free_filesystem();
+    fclose(out);
+    return errors != 0;
+}
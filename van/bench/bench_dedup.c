@@ -0,0 +1,134 @@
+// Benchmark of block deduplication:
+//   hash   : hash_block on blocks of 1 KB, against memcpy of the same
+//   volume : write_file, read_file and delete_file of 10000 files of 4 KB
+//            and 64 KB with deduplication off and on, each file unique
+//            or one of 16 templates
+// Each line of the output is one configuration, as CSV:
+//   bench,content,dedup,size,write_mb_s,read_mb_s,delete_ops_s,blocks
+// blocks is what the files took; hash lines have the hash in write_mb_s
+// and memcpy in read_mb_s.
+// Build: make bench   (from van/)
+// Usage: bench_dedup [output file, default standard output]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+FILE* out;
+int errors;
+volatile unsigned long long sink;  // Keeps the hashes from being optimized away
+
+// Content of size bytes unique to seed, the last one being a NUL
+char* make_content(int size, unsigned int seed) {
+    char* content = malloc(size);
+    for (int i = 0; i < size - 1; i++) {
+        seed = seed * 1103515245u + 12345u;
+        content[i] = 'a' + (seed >> 16) % 26;
+    }
+    content[size - 1] = '\0';
+    return content;
+}
+
+void bench_hash() {
+    int size = 64 << 20;
+    char* data = make_content(size, 1);
+    char* copy = malloc(DEFAULT_BLOCK_SIZE);
+    unsigned long long sum = 0;
+    double start = now_ns();
+    for (int i = 0; i < size; i += DEFAULT_BLOCK_SIZE) {
+        sum += hash_block(data + i, DEFAULT_BLOCK_SIZE);
+    }
+    double hash_ns = now_ns() - start;
+    start = now_ns();
+    for (int i = 0; i < size; i += DEFAULT_BLOCK_SIZE) {
+        memcpy(copy, data + i, DEFAULT_BLOCK_SIZE);
+        sum += copy[i % DEFAULT_BLOCK_SIZE];
+    }
+    double copy_ns = now_ns() - start;
+    double mb = (double)size / (1 << 20);
+    sink = sum;
+    fprintf(out, "hash,random,on,%d,%.0f,%.0f,0,0\n", DEFAULT_BLOCK_SIZE,
+            mb / (hash_ns / 1e9), mb / (copy_ns / 1e9));
+    free(data);
+    free(copy);
+}
+
+void bench_volume(int size, int templates, int dedup) {
+    char name[MAX_PATH];
+    int files = 10000;
+    int blocks_per_file = (size + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+    if (fs.volume) free_filesystem();
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, files * (blocks_per_file + 1) + 1024,
+                               DEFAULT_NUM_FILES, files + 16};
+    init_filesystem(&geometry);
+    fs.dedup = dedup;
+    int kinds = templates ? 16 : files;
+    char** contents = malloc(kinds * sizeof(char*));
+    for (int i = 0; i < kinds; i++) contents[i] = make_content(size, i + 1);
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        create_file(name, 0);
+    }
+    int free_before = fs.free_block_count;
+
+    double start = now_ns();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        if (write_file(name, contents[i % kinds]) != 0) errors++;
+    }
+    double write_ns = now_ns() - start;
+    drain_alloc_caches();
+    int blocks = free_before - fs.free_block_count;
+
+    start = now_ns();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        char* data = read_file(name);
+        if (!data || memcmp(data, contents[i % kinds], size) != 0) errors++;
+        free(data);
+    }
+    double read_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        if (delete_file(name) != 0) errors++;
+    }
+    double delete_ns = now_ns() - start;
+    drain_alloc_caches();
+    if (fs.free_block_count != free_before) {  // Blocks left behind
+        fprintf(stderr, "Error: %d blocks not freed\n", free_before - fs.free_block_count);
+        errors++;
+    }
+
+    double mb = (double)size * files / (1 << 20);
+    fprintf(out, "volume,%s,%s,%d,%.0f,%.0f,%.0f,%d\n", templates ? "templates" : "unique",
+            dedup ? "on" : "off", size, mb / (write_ns / 1e9), mb / (read_ns / 1e9),
+            files / (delete_ns / 1e9), blocks);
+    fflush(out);
+    for (int i = 0; i < kinds; i++) free(contents[i]);
+    free(contents);
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    // The messages of the file system are not part of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    fprintf(out, "bench,content,dedup,size,write_mb_s,read_mb_s,delete_ops_s,blocks\n");
+    bench_hash();
+    int sizes[] = {4096, 65536};
+    for (int i = 0; i < 2; i++) {
+        for (int templates = 0; templates < 2; templates++) {
+            bench_volume(sizes[i], templates, 0);
+            bench_volume(sizes[i], templates, 1);
+        }
+    }
+
+    free_filesystem();
+    fclose(out);
+    if (errors) fprintf(stderr, "Error: %d checks failed\n", errors);
+    return errors != 0;
+}
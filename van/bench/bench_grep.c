@@ -0,0 +1,142 @@
+// Benchmark of grep:
+//   search : each version of find_pattern over 64 MB of random letters,
+//            against memchr of a byte that is not there
+//   volume : grep_tree over 1024 files of 128 KB, in memory and through a
+//            block cache holding them all, by 1, 2 and 4 threads
+// Each line of the output is one configuration, as CSV:
+//   bench,search,threads,mb_s,matches
+// Build: make bench   (from van/)
+// Usage: bench_grep [output file, default standard output]
+//                   [directory for the image, default /tmp]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+#define FILES 1024
+#define FILE_SIZE (128 << 10)
+#define PATTERN "qzxwv"  // Rare in random letters, so the search runs on
+
+FILE* out;
+int errors;
+char image[MAX_PATH];
+
+// Content of size bytes of random letters
+char* make_content(size_t size, unsigned int seed) {
+    char* content = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245u + 12345u;
+        content[i] = 'a' + (seed >> 16) % 26;
+    }
+    return content;
+}
+
+// Count the matches of PATTERN in data with one version of find_pattern
+long long count_matches(const char* (*find)(const char*, size_t, const char*, size_t),
+                        const char* data, size_t size) {
+    long long matches = 0;
+    size_t length = strlen(PATTERN);
+    const char* end = data + size;
+    for (const char* p = data; (p = find(p, end - p, PATTERN, length)) != NULL;
+         p += length) {
+        matches++;
+    }
+    return matches;
+}
+
+void bench_search(const char* name,
+                  const char* (*find)(const char*, size_t, const char*, size_t),
+                  const char* data, size_t size) {
+    double start = now_ns();
+    long long matches = count_matches(find, data, size);
+    double ns = now_ns() - start;
+    fprintf(out, "search,%s,1,%.0f,%lld\n", name, (double)size / (1 << 20) / (ns / 1e9),
+            matches);
+    fflush(out);
+}
+
+void bench_memchr(const char* data, size_t size) {
+    double start = now_ns();
+    if (memchr(data, '!', size)) errors++;
+    double ns = now_ns() - start;
+    fprintf(out, "search,memchr,1,%.0f,0\n", (double)size / (1 << 20) / (ns / 1e9));
+}
+
+// Write the files, each with a few copies of the pattern
+int fill_volume(const char* content) {
+    char name[MAX_PATH];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        if (create_file(name, 0) < 0 ||
+            write_file_data(name, content + (size_t)i * 97, FILE_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bench_volume(const char* search, long long expected) {
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        grep_tree(PATTERN, 0, threads);  // Warms the cache
+        double start = now_ns();
+        long long matches = grep_tree(PATTERN, 0, threads);
+        double ns = now_ns() - start;
+        if (matches != expected) errors++;
+        fprintf(out, "volume,%s,%d,%.0f,%lld\n", search, threads,
+                (double)FILES * FILE_SIZE / (1 << 20) / (ns / 1e9), matches);
+        fflush(out);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    snprintf(image, sizeof(image), "%s/bench_grep.img", argc > 2 ? argv[2] : "/tmp");
+    // The messages of the file system, and what grep prints, are not part
+    // of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    size_t size = 64 << 20;
+    char* data = make_content(size, 1);
+    for (size_t i = 0; i + 5 < size; i += 64 << 10) memcpy(data + i, PATTERN, 5);
+    fprintf(out, "bench,search,threads,mb_s,matches\n");
+    bench_memchr(data, size);
+    bench_search("scalar", find_pattern_scalar, data, size);
+#ifdef __SSE2__
+    bench_search("sse2", find_pattern_sse2, data, size);
+#endif
+#ifdef HAVE_AVX2_SCAN
+    if (__builtin_cpu_supports("avx2")) bench_search("avx2", find_pattern_avx2, data, size);
+#endif
+
+    // Files i and i + 1 share most of their content, as they start 97
+    // bytes apart in data
+    long long expected = 0;
+    for (int i = 0; i < FILES; i++) {
+        expected += count_matches(find_pattern_scalar, data + (size_t)i * 97, FILE_SIZE);
+    }
+    int blocks = FILES * (FILE_SIZE / DEFAULT_BLOCK_SIZE + 2) + 1024;
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, blocks, DEFAULT_NUM_FILES, FILES + 16};
+    if (init_filesystem(&geometry) != 0 || fill_volume(data) != 0) {
+        fprintf(stderr, "Error: Cannot fill the volume\n");
+        return 1;
+    }
+    bench_volume("memory", expected);
+    free_filesystem();
+
+    remove(image);
+    if (create_volume_image(image, &geometry, JOURNAL_OFF, 2LL * FILES * FILE_SIZE) != 0 ||
+        fill_volume(data) != 0) {
+        fprintf(stderr, "Error: Cannot create %s\n", image);
+        return 1;
+    }
+    bench_volume("cache", expected);
+    free_filesystem();
+
+    remove(image);
+    free(data);
+    fclose(out);
+    if (errors) fprintf(stderr, "Error: %d checks failed\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,110 @@
+// Benchmark of import: a host tree of 100 directories of 1000 files of
+// 100 to 1000 bytes, imported as a tree and as a tar archive (made by
+// export), into a volume in memory and a volume image with a strict journal
+// Each line of the output is one configuration, as CSV:
+//   bench,volume,files,files_s,mb_s
+// Build: make bench   (from van/)
+// Usage: bench_import [output file, default standard output]
+//                     [directory for the host tree and image, default /tmp]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+#define DIRS 100
+#define FILES_PER_DIR 1000
+#define FILES (DIRS * FILES_PER_DIR)
+
+FILE* out;
+int errors;
+char tree[MAX_PATH];
+char archive[MAX_PATH];
+char image[MAX_PATH];
+
+// Write the host tree, each file of random letters
+int make_tree() {
+    char path[MAX_PATH + 32];
+    char content[1000];
+    unsigned int seed = 1;
+    if (mkdir(tree, 0755) != 0) return -1;
+    for (int d = 0; d < DIRS; d++) {
+        snprintf(path, sizeof(path), "%s/d%03d", tree, d);
+        if (mkdir(path, 0755) != 0) return -1;
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            seed = seed * 1103515245u + 12345u;
+            size_t size = 100 + (seed >> 16) % 901;
+            for (size_t i = 0; i < size; i++) {
+                seed = seed * 1103515245u + 12345u;
+                content[i] = 'a' + (seed >> 16) % 26;
+            }
+            snprintf(path, sizeof(path), "%s/d%03d/f%04d", tree, d, f);
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) return -1;
+            ssize_t written = write(fd, content, size);
+            close(fd);
+            if (written != (ssize_t)size) return -1;
+        }
+    }
+    return 0;
+}
+
+void bench_import(const char* bench, const char* volume, const char* host_path) {
+    Transfer transfer;
+    double start = now_ns();
+    if (import_path(host_path, "/", &transfer) != 0 || transfer.files != FILES) errors++;
+    double ns = now_ns() - start;
+    fprintf(out, "%s,%s,%d,%.0f,%.0f\n", bench, volume, transfer.files,
+            transfer.files / (ns / 1e9), (double)transfer.bytes / (1 << 20) / (ns / 1e9));
+    fflush(out);
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    const char* dir = argc > 2 ? argv[2] : "/tmp";
+    snprintf(tree, sizeof(tree), "%s/bench_import", dir);
+    snprintf(archive, sizeof(archive), "%s/bench_import.tar", dir);
+    snprintf(image, sizeof(image), "%s/bench_import.img", dir);
+    // The messages of the file system are not part of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    char command[3 * MAX_PATH];
+    snprintf(command, sizeof(command), "rm -rf %s", tree);
+    if (system(command) != 0 || make_tree() != 0) {
+        fprintf(stderr, "Error: Cannot make %s\n", tree);
+        return 1;
+    }
+    fprintf(out, "bench,volume,files,files_s,mb_s\n");
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, FILES * 2 + 1024, DEFAULT_NUM_FILES,
+                               FILES + DIRS + 16};
+    const char* sources[] = {tree, archive};
+    const char* benches[] = {"tree", "tar"};
+    for (int s = 0; s < 2; s++) {
+        if (init_filesystem(&geometry) != 0) {
+            fprintf(stderr, "Error: Cannot make the volume\n");
+            return 1;
+        }
+        bench_import(benches[s], "memory", sources[s]);
+        Transfer transfer;
+        if (s == 0 && export_path("/", archive, &transfer) != 0) errors++;
+        free_filesystem();
+
+        remove(image);
+        if (create_volume_image(image, &geometry, JOURNAL_STRICT, 64 << 20) != 0) {
+            fprintf(stderr, "Error: Cannot create %s\n", image);
+            return 1;
+        }
+        bench_import(benches[s], "strict", sources[s]);
+        free_filesystem();
+    }
+
+    remove(image);
+    strcat(image, ".journal");
+    remove(image);
+    remove(archive);
+    if (system(command) != 0) errors++;
+    fclose(out);
+    if (errors) fprintf(stderr, "Error: %d checks failed\n", errors);
+    return errors != 0;
+}
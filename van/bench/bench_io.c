@@ -0,0 +1,167 @@
+// Benchmark of the I/O engines of the block cache, on a volume image of
+// 256 files of 256 KB stored in runs of 16 blocks (written in turns), for
+// each engine: sync (plain system calls, one request after the other),
+// threads and io_uring:
+//   read  : read_file of every file through a 4 MB cache with a cold page
+//           cache, by 1 and 4 threads
+//   flush : write_file of every file into a cache holding them all, then
+//           sync_volume writing them back
+// Each line of the output is one configuration, as CSV:
+//   bench,engine,threads,mb_s,batches,requests_per_batch
+// Build: make bench   (from van/)
+// Usage: bench_io [output file, default standard output]
+//                 [directory for the image, default /tmp]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+#define FILES 256
+#define FILE_SIZE (256 << 10)
+#define CHUNK (16 << 10)  // Bytes written to a file in each turn
+
+FILE* out;
+int errors;
+char image[MAX_PATH];
+char* contents[2];  // As the files are made, and as the flush bench writes them
+
+typedef struct {
+    int id;
+    int threads;
+} Reader;
+
+// Content of a file, the last byte being a NUL
+char* make_content(unsigned int seed) {
+    char* content = malloc(FILE_SIZE);
+    for (int i = 0; i < FILE_SIZE - 1; i++) {
+        seed = seed * 1103515245u + 12345u;
+        content[i] = 'a' + (seed >> 16) % 26;
+    }
+    content[FILE_SIZE - 1] = '\0';
+    return content;
+}
+
+// Drop the pages of a file from the page cache
+void evict_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Write the files a chunk at a time in turns, so that their runs alternate
+int make_image() {
+    char name[MAX_PATH];
+    int blocks = FILES * (FILE_SIZE / DEFAULT_BLOCK_SIZE + 2) + 1024;
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, blocks, DEFAULT_NUM_FILES, FILES + 16};
+    remove(image);
+    if (create_volume_image(image, &geometry, JOURNAL_OFF, 4 << 20) != 0) return -1;
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        create_file(name, 0);
+    }
+    for (int offset = 0; offset < FILE_SIZE; offset += CHUNK) {
+        for (int i = 0; i < FILES; i++) {
+            snprintf(name, sizeof(name), "/f%d", i);
+            if (pwrite_file(name, contents[0] + offset, CHUNK, offset) != 0) errors++;
+        }
+    }
+    free_filesystem();
+    return 0;
+}
+
+void* run_reader(void* arg) {
+    Reader* reader = arg;
+    char name[MAX_PATH];
+    for (int i = reader->id; i < FILES; i += reader->threads) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        char* data = read_file(name);
+        if (!data || memcmp(data, contents[0], FILE_SIZE) != 0) {
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+        }
+        free(data);
+    }
+    return NULL;
+}
+
+void report_run(const char* bench, int threads, double ns) {
+    double mb = (double)FILES * FILE_SIZE / (1 << 20);
+    fprintf(out, "%s,%s,%d,%.0f,%lld,%.1f\n", bench, io_engine_name(fs.io_engine), threads,
+            mb / (ns / 1e9), fs.io_batches,
+            fs.io_batches ? (double)fs.io_requests / fs.io_batches : 0.0);
+    fflush(out);
+}
+
+void bench_read(int engine, int threads) {
+    pthread_t ids[4];
+    Reader readers[4];
+    io_engine_choice = engine;
+    evict_file(image);
+    if (open_volume_image(image, JOURNAL_OFF, 4 << 20) != 0) {
+        errors++;
+        return;
+    }
+    double start = now_ns();
+    for (int t = 0; t < threads; t++) {
+        readers[t] = (Reader){t, threads};
+        pthread_create(&ids[t], NULL, run_reader, &readers[t]);
+    }
+    for (int t = 0; t < threads; t++) pthread_join(ids[t], NULL);
+    report_run("read", threads, now_ns() - start);
+    free_filesystem();
+}
+
+// Write every file with one of the contents and sync the volume
+double write_every(const char* content) {
+    char name[MAX_PATH];
+    double start = now_ns();
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        if (write_file(name, content) != 0) errors++;
+    }
+    if (sync_volume() != 0) errors++;
+    return now_ns() - start;
+}
+
+void bench_flush(int engine) {
+    io_engine_choice = engine;
+    if (open_volume_image(image, JOURNAL_OFF, 2LL * FILES * FILE_SIZE) != 0) {
+        errors++;
+        return;
+    }
+    report_run("flush", 1, write_every(contents[1]));
+    write_every(contents[0]);  // What the next reads expect
+    free_filesystem();
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    snprintf(image, sizeof(image), "%s/bench_io.img", argc > 2 ? argv[2] : "/tmp");
+    // The messages of the file system are not part of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    contents[0] = make_content(1);
+    contents[1] = make_content(2);
+    if (make_image() != 0) {
+        fprintf(stderr, "Error: Cannot create %s\n", image);
+        return 1;
+    }
+    fprintf(out, "bench,engine,threads,mb_s,batches,requests_per_batch\n");
+    int engines[] = {IO_SYNC, IO_THREADS, IO_URING};
+    for (int e = 0; e < 3; e++) {
+        bench_read(engines[e], 1);
+        bench_read(engines[e], 4);
+        bench_flush(engines[e]);
+    }
+
+    remove(image);
+    free(contents[0]);
+    free(contents[1]);
+    fclose(out);
+    if (errors) fprintf(stderr, "Error: %d checks failed\n", errors);
+    return errors != 0;
+}
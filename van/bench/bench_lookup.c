@@ -0,0 +1,92 @@
+// Benchmark of find_file_in_dir: name index lookup vs. the old linear scan,
+// and vs. linear scans of the file keys and of the name tags
+// Build: make bench   (from van/)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+// Lookup as it was done before the name index
+int find_file_linear(const char* filename, int dir_index) {
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.files[i].filename[0] != '\0' &&
+            fs.files[i].parent_dir == dir_index &&
+            strcmp(fs.files[i].filename, filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Linear scan that reads an entry only when its key matches
+int find_file_by_keys(const char* filename, int dir_index) {
+    unsigned int name_hash = hash_name(filename);
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.file_keys[i].in_use &&
+            fs.file_keys[i].name_hash == name_hash &&
+            fs.file_keys[i].parent_dir == dir_index &&
+            strcmp(fs.files[i].filename, filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Linear scan that reads an entry only when its name tag matches
+int find_file_by_tags(const char* filename, int dir_index) {
+    unsigned int tag = name_tag(hash_name(filename), strlen(filename));
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.name_tags[i] == tag && fs.file_keys[i].parent_dir == dir_index &&
+            strcmp(fs.files[i].filename, filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Average nanoseconds per lookup of random existing names
+double time_lookups(int (*find)(const char*, int), int num_entries, int lookups) {
+    char name[MAX_FILENAME];
+    int found = 0;
+    srand(42);
+    double start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        snprintf(name, sizeof(name), "f%07d", rand() % num_entries);
+        if (find(name, 0) != -1) found++;
+    }
+    double elapsed = now_ns() - start;
+    if (found != lookups) {
+        printf("Error: %d of %d lookups failed\n", lookups - found, lookups);
+    }
+    return elapsed / lookups;
+}
+
+int main() {
+    int sizes[] = {100, 10000, 1000000};
+    char name[MAX_FILENAME];
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS,
+                               DEFAULT_NUM_FILES, 1000001};
+
+    printf("entries | indexed ns/lookup | linear ns/lookup | key scan ns/lookup | "
+           "tag scan ns/lookup\n");
+    for (int s = 0; s < 3; s++) {
+        int num_entries = sizes[s];
+        if (init_filesystem(&geometry) != 0) return 1;
+        for (int i = 0; i < num_entries; i++) {
+            snprintf(name, sizeof(name), "f%07d", i);
+            if (create_file(name, 0) < 0) return 1;
+        }
+
+        double indexed = time_lookups(find_file_in_dir, num_entries, 1000000);
+        int linear_lookups = num_entries >= 1000000 ? 200 : 20000;
+        double linear = time_lookups(find_file_linear, num_entries, linear_lookups);
+        double keys = time_lookups(find_file_by_keys, num_entries, linear_lookups);
+        double tags = time_lookups(find_file_by_tags, num_entries, linear_lookups);
+        printf("%7d | %17.1f | %16.1f | %18.1f | %18.1f\n", num_entries, indexed, linear, keys,
+               tags);
+    }
+    return 0;
+}
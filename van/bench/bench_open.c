@@ -0,0 +1,59 @@
+// Benchmark of opening a volume image: time to open a 1 GB and a 10 GB image
+// with a cold page cache, and to reach the first file in it
+// Build: make bench   (from van/)
+// Usage: bench_open [directory for the images, default /tmp]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+// Drop the pages of a file from the page cache
+void evict_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = argc > 1 ? argv[1] : "/tmp";
+    long long sizes[] = {1LL << 30, 10LL << 30};
+    char path[MAX_PATH];
+    char name[MAX_FILENAME];
+
+    printf("image | create ms | cold open ms | first read ms\n");
+    for (int s = 0; s < 2; s++) {
+        VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, (int)(sizes[s] / DEFAULT_BLOCK_SIZE),
+                                   DEFAULT_NUM_FILES, (int)(sizes[s] / DEFAULT_BLOCK_SIZE)};
+        snprintf(path, sizeof(path), "%s/bench_open_%lldG.img", dir, sizes[s] >> 30);
+        remove(path);
+
+        double start = now_ns();
+        if (create_volume_image(path, &geometry, JOURNAL_BATCHED, 0) != 0) return 1;
+        for (int i = 0; i < 1000; i++) {
+            snprintf(name, sizeof(name), "f%04d", i);
+            create_file(name, 0);
+            write_file(name, "some content for the benchmark");
+        }
+        free_filesystem();
+        double created = now_ns() - start;
+
+        evict_file(path);
+        start = now_ns();
+        if (open_volume_image(path, JOURNAL_BATCHED, 0) != 0) return 1;
+        double opened = now_ns() - start;
+
+        start = now_ns();
+        char* content = read_file("f0999");
+        double first_read = now_ns() - start;
+        free(content);
+
+        printf("%3lldG | %9.1f | %12.3f | %13.3f\n", sizes[s] >> 30,
+               created / 1e6, opened / 1e6, first_read / 1e6);
+        free_filesystem();
+        remove(path);
+        strcat(path, ".journal");
+        remove(path);
+    }
+    return 0;
+}
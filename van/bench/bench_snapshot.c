@@ -0,0 +1,103 @@
+// Benchmark of snapshots, on volumes of 1000 to 100000 files of 4 KB:
+//   snapshot : take_snapshot and delete_snapshot of an unchanged volume,
+//              against copying the file table, as a full copy would
+//   write    : write_file of every file with no snapshot, then right after
+//              one (each file is stored anew), then again (in place)
+//   rollback : rollback_snapshot once every file was written
+// Each line of the output is one operation of one configuration, as CSV:
+//   bench,files,op,count,ops_per_sec,ns_per_op,blocks_held
+// Build: make bench   (from van/)
+// Usage: bench_snapshot [output file, default standard output]
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+FILE* out;
+int errors;
+
+void report_op(const char* bench, int files, const char* op, int count, double ns) {
+    long long held = 0;
+    for (int k = 0; k < fs.num_snapshots; k++) held += fs.snapshots[k].held_blocks;
+    fprintf(out, "%s,%d,%s,%d,%.0f,%.0f,%lld\n", bench, files, op, count, count / (ns / 1e9),
+            ns / count, held);
+    fflush(out);
+}
+
+// Write every file with content that depends on round
+double write_every(int files, char* content, int size, int round) {
+    char name[MAX_PATH];
+    double start = now_ns();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        memset(content, 'a' + (i + round) % 26, size - 1);
+        if (write_file(name, content) != 0) errors++;
+    }
+    return now_ns() - start;
+}
+
+void bench_volume(int files) {
+    char name[MAX_PATH];
+    int size = 4096;
+    int blocks_per_file = size / DEFAULT_BLOCK_SIZE;
+    if (fs.volume) free_filesystem();
+    // Room for the files twice, as a snapshot holds the old blocks
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, 2 * files * (blocks_per_file + 1) + 1024,
+                               DEFAULT_NUM_FILES, files + 16};
+    init_filesystem(&geometry);
+    char* content = malloc(size);
+    content[size - 1] = '\0';
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        create_file(name, 0);
+    }
+    write_every(files, content, size, 0);
+
+    int rounds = 1000;
+    double start = now_ns();
+    for (int i = 0; i < rounds; i++) {
+        if (take_snapshot("bench") != 0 || delete_snapshot("bench") != 0) errors++;
+    }
+    report_op("snapshot", files, "take_delete", rounds, now_ns() - start);
+    size_t table = (size_t)fs.num_slots * sizeof(FileMetadata);
+    char* copy = malloc(table);
+    start = now_ns();
+    for (int i = 0; i < rounds / 10; i++) {
+        memcpy(copy, fs.files, table);
+        errors += copy[table - 1] != ((char*)fs.files)[table - 1];
+    }
+    report_op("snapshot", files, "copy_table", rounds / 10, now_ns() - start);
+    free(copy);
+
+    report_op("write", files, "no_snapshot", files, write_every(files, content, size, 1));
+    if (take_snapshot("bench") != 0) errors++;
+    report_op("write", files, "first_after", files, write_every(files, content, size, 2));
+    report_op("write", files, "again", files, write_every(files, content, size, 3));
+
+    start = now_ns();
+    if (rollback_snapshot("bench") != 0) errors++;
+    report_op("rollback", files, "rollback", 1, now_ns() - start);
+    snprintf(name, sizeof(name), "/f%d", files - 1);
+    char* data = read_file(name);
+    memset(content, 'a' + (files - 1 + 1) % 26, size - 1);
+    if (!data || memcmp(data, content, size) != 0) errors++;
+    free(data);
+    free(content);
+}
+
+int main(int argc, char* argv[]) {
+    out = argc > 1 ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    // The messages of the file system are not part of the results
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    fprintf(out, "bench,files,op,count,ops_per_sec,ns_per_op,blocks_held\n");
+    int file_counts[] = {1000, 10000, 100000};
+    for (int i = 0; i < 3; i++) bench_volume(file_counts[i]);
+
+    free_filesystem();
+    fclose(out);
+    if (errors) fprintf(stderr, "Error: %d checks failed\n", errors);
+    return errors != 0;
+}
@@ -0,0 +1,138 @@
+// Multi-threaded stress and throughput benchmark of the file system core.
+// Each workload runs with 1, 2, 4 and 8 threads for a fixed time:
+//   private : each thread creates, writes, appends, reads and deletes files
+//             in a directory of its own
+//   shared  : the same, all threads in one directory
+//   readers : threads read random files from a set written beforehand
+// Every read is checked against what was written, and after each run the
+// volume must be back to its free space and file count. On one CPU the
+// threads only take turns, so the runs check the locking and show what it
+// costs, not whether readers scale; that takes a machine with more CPUs.
+// Build: make bench   (from van/)
+// Usage: bench_threads [seconds per run, default 1]
+#include <pthread.h>
+
+#define VAN_NO_MAIN
+#include "../main_with_filename.c"
+
+#define MAX_THREADS 8
+#define HOT_FILES 1000
+
+typedef struct {
+    int id;
+    int workload;
+    double deadline;
+    long long ops;
+    int errors;
+} Worker;
+
+const char* workloads[] = {"private", "shared", "readers"};
+
+// Content of file i as written by thread id
+int make_content(char* content, int id, int i) {
+    return snprintf(content, 256, "thread %d file %d %0*d", id, i, 32 + i % 64, i);
+}
+
+void* run_worker(void* arg) {
+    Worker* w = arg;
+    char path[MAX_PATH];
+    char content[256];
+    char expected[512];
+    char buffer[512];
+    unsigned int seed = (unsigned int)w->id * 7919u + 1;
+
+    for (int i = 0; now_ns() < w->deadline; i++) {
+        if (w->workload == 2) {
+            seed = seed * 1103515245u + 12345u;
+            int hot = (int)((seed >> 8) % HOT_FILES);
+            snprintf(path, sizeof(path), "/hot/f%d", hot);
+            int length = make_content(expected, 0, hot) + 1;
+            if (read_into(path, buffer, sizeof(buffer), 0) != length ||
+                memcmp(buffer, expected, length) != 0) {
+                w->errors++;
+            }
+            w->ops++;
+            continue;
+        }
+
+        // create, write, append, read, delete: five operations
+        if (w->workload == 0) {
+            snprintf(path, sizeof(path), "/t%d/f%d", w->id, i % 16);
+        } else {
+            snprintf(path, sizeof(path), "/shared/t%d_f%d", w->id, i % 16);
+        }
+        make_content(content, w->id, i);
+        if (create_file(path, 0) < 0 || write_file(path, content) != 0 ||
+            append_text(path, "+tail") != 0) {
+            w->errors++;
+        }
+        int length = snprintf(expected, sizeof(expected), "%s+tail", content) + 1;
+        if (read_into(path, buffer, sizeof(buffer), 0) != length ||
+            memcmp(buffer, expected, length) != 0) {
+            w->errors++;
+        }
+        if (delete_file(path) != 0) w->errors++;
+        w->ops += 5;
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    VolumeGeometry geometry = {DEFAULT_BLOCK_SIZE, 1 << 20, 4096, 1 << 20};
+    if (init_filesystem(&geometry) != 0) return 1;
+
+    char path[MAX_PATH];
+    char content[256];
+    create_file("/shared", 1);
+    create_file("/hot", 1);
+    for (int t = 0; t < MAX_THREADS; t++) {
+        snprintf(path, sizeof(path), "/t%d", t);
+        create_file(path, 1);
+    }
+    for (int i = 0; i < HOT_FILES; i++) {
+        snprintf(path, sizeof(path), "/hot/f%d", i);
+        make_content(content, 0, i);
+        create_file(path, 0);
+        write_file(path, content);
+    }
+    sync_volume();
+    drain_alloc_caches();
+    int files_before = fs.num_files;
+    int free_before = fs.free_block_count;
+
+    printf("workload | threads | ops/sec | errors\n");
+    int failed = 0;
+    for (int workload = 0; workload < 3; workload++) {
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            pthread_t ids[MAX_THREADS];
+            Worker workers[MAX_THREADS];
+            double start = now_ns();
+            for (int t = 0; t < threads; t++) {
+                workers[t] = (Worker){t, workload, start + seconds * 1e9, 0, 0};
+                pthread_create(&ids[t], NULL, run_worker, &workers[t]);
+            }
+            long long ops = 0;
+            int errors = 0;
+            for (int t = 0; t < threads; t++) {
+                pthread_join(ids[t], NULL);
+                ops += workers[t].ops;
+                errors += workers[t].errors;
+            }
+            double elapsed = now_ns() - start;
+
+            // Everything created was deleted: no entry or block may be left
+            drain_alloc_caches();
+            if (fs.num_files != files_before || fs.free_block_count != free_before) {
+                printf("Error: %d files and %d free blocks after the run, expected %d and %d\n",
+                       fs.num_files, fs.free_block_count, files_before, free_before);
+                errors++;
+            }
+            printf("%8s | %7d | %7.0f | %d\n", workloads[workload], threads,
+                   ops / (elapsed / 1e9), errors);
+            failed |= errors != 0;
+        }
+    }
+    free_filesystem();
+    return failed;
+}
@@ -18,6 +18,10 @@ typedef struct {
     int num_blocks;
     int is_directory;
     int parent_dir;
+    int first_child;   // Premier enfant d'un rpertoire, -1 si vide
+    int last_child;    // Dernier enfant, pour ajouter en fin de liste
+    int next_sibling;  // Enfant suivant du mme rpertoire
+    int prev_sibling;  // Enfant prcdent du mme rpertoire
 } FileMetadata;
 
 typedef struct {
@@ -30,6 +34,36 @@ typedef struct {
 
 FileSystem fs;
 
+// Ajoute un fichier  la fin des enfants de son rpertoire parent
+void link_child(int file_index) {
+    FileMetadata* file = &fs.files[file_index];
+    FileMetadata* dir = &fs.files[file->parent_dir];
+    file->prev_sibling = dir->last_child;
+    file->next_sibling = -1;
+    if (dir->last_child != -1) {
+        fs.files[dir->last_child].next_sibling = file_index;
+    } else {
+        dir->first_child = file_index;
+    }
+    dir->last_child = file_index;
+}
+
+// Retire un fichier des enfants de son rpertoire parent
+void unlink_child(int file_index) {
+    FileMetadata* file = &fs.files[file_index];
+    FileMetadata* dir = &fs.files[file->parent_dir];
+    if (file->prev_sibling != -1) {
+        fs.files[file->prev_sibling].next_sibling = file->next_sibling;
+    } else {
+        dir->first_child = file->next_sibling;
+    }
+    if (file->next_sibling != -1) {
+        fs.files[file->next_sibling].prev_sibling = file->prev_sibling;
+    } else {
+        dir->last_child = file->prev_sibling;
+    }
+}
+
 // Initialisation du systme de fichiers
 void init_filesystem() {
     memset(&fs, 0, sizeof(FileSystem));
@@ -43,6 +77,8 @@ void init_filesystem() {
     fs.files[0].created = time(NULL);
     fs.files[0].modified = time(NULL);
     fs.files[0].parent_dir = 0;
+    fs.files[0].first_child = -1;
+    fs.files[0].last_child = -1;
     fs.num_files = 1;
     fs.current_dir = 0;  // On commence dans le rpertoire racine
 }
@@ -83,13 +119,7 @@ int find_file_in_dir(const char* filename, int dir_index) {
 
 // Vrifie si un rpertoire est vide
 int is_directory_empty(int dir_index) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index) {
-            return 0;
-        }
-    }
-    return 1;
+    return fs.files[dir_index].first_child == -1;
 }
 
 // Supprime rcursivement un rpertoire et son contenu
@@ -100,23 +130,23 @@ int delete_directory_recursive(int dir_index) {
     }
 
     // Supprime d'abord tous les fichiers et sous-rpertoires
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index) {
-            if (fs.files[i].is_directory) {
-                delete_directory_recursive(i);
-            } else {
-                // Libre les blocs du fichier
-                for (int j = 0; j < fs.files[i].num_blocks; j++) {
-                    fs.free_blocks[fs.files[i].start_block + j] = 1;
-                }
-                memset(&fs.files[i], 0, sizeof(FileMetadata));
-                fs.num_files--;
+    while (fs.files[dir_index].first_child != -1) {
+        int i = fs.files[dir_index].first_child;
+        if (fs.files[i].is_directory) {
+            delete_directory_recursive(i);
+        } else {
+            // Libre les blocs du fichier
+            for (int j = 0; j < fs.files[i].num_blocks; j++) {
+                fs.free_blocks[fs.files[i].start_block + j] = 1;
             }
+            unlink_child(i);
+            memset(&fs.files[i], 0, sizeof(FileMetadata));
+            fs.num_files--;
         }
     }
 
     // Supprime le rpertoire lui-mme
+    unlink_child(dir_index);
     memset(&fs.files[dir_index], 0, sizeof(FileMetadata));
     fs.num_files--;
     return 0;
@@ -158,6 +188,9 @@ int create_file(const char* filename, int is_directory) {
     file->num_blocks = 0;
     file->is_directory = is_directory;
     file->parent_dir = fs.current_dir;
+    file->first_child = -1;
+    file->last_child = -1;
+    link_child(file_slot);
     fs.num_files++;
 
     return file_slot;
@@ -274,6 +307,7 @@ int delete_file(int file_index) {
     }
 
     // Effacer les mtadonnes
+    unlink_child(file_index);
     memset(&fs.files[file_index], 0, sizeof(FileMetadata));
     fs.num_files--;
 
@@ -288,21 +322,19 @@ void list_directory(int dir_index) {
     printf("Index | Nom | Taille | Type | Date modification\n");
     printf("----------------------------------------\n");
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index) {
-            char date_str[26];
-            // Utiliser ctime au lieu de ctime_r
-            strcpy(date_str, ctime(&fs.files[i].modified));
-            date_str[24] = '\0';  // Supprime le \n
-
-            printf("%d | %s | %llu | %s | %s\n",
-                   i,
-                   fs.files[i].filename,
-                   (unsigned long long)fs.files[i].size,
-                   fs.files[i].is_directory ? "DIR" : "FILE",
-                   date_str);
-        }
+    for (int i = fs.files[dir_index].first_child; i != -1;
+         i = fs.files[i].next_sibling) {
+        char date_str[26];
+        // Utiliser ctime au lieu de ctime_r
+        strcpy(date_str, ctime(&fs.files[i].modified));
+        date_str[24] = '\0';  // Supprime le \n
+
+        printf("%d | %s | %llu | %s | %s\n",
+               i,
+               fs.files[i].filename,
+               (unsigned long long)fs.files[i].size,
+               fs.files[i].is_directory ? "DIR" : "FILE",
+               date_str);
     }
 }
 // Interface utilisateur amliore
@@ -1,455 +1,6744 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#define BLOCK_SIZE 1024
-#define MAX_BLOCKS 1000
-#define MAX_FILES 100
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is built in any case and used if the CPU has it
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 1000
+#define DEFAULT_NUM_FILES 100
+#define MIN_CACHE_FRAMES 64   // Smallest block cache, in blocks
+#define CACHE_READ_AHEAD 32   // Blocks read or written back at once by the block cache
+#define FRAME_REFERENCED 1    // Flags of a block cache frame
+#define FRAME_DIRTY 2
+#define FRAME_LOADING 4       // Being read in by a thread, which pinned it
+#define IO_SYNC 0             // I/O engines of the block cache, see run_io()
+#define IO_THREADS 1
+#define IO_URING 2
+#define IO_BATCH 64           // Requests submitted at once
+#define IO_POOL_THREADS 8     // Threads of the IO_THREADS engine
+#define GREP_THREADS 8        // Most threads a grep splits its files among
+#define GREP_THREAD_BYTES (4 << 20)  // Content that makes another grep thread worth it
+#define TRANSFER_BUFFER (1 << 20)  // Bytes import and export move at a time
+#define HOST_PATH 4096             // Longest path of a host file
+#define TAR_BLOCK 512
+#define DEFAULT_STATS_INTERVAL 60  // Seconds between two dumps of the statistics
+#define MIN_BLOCK_SIZE 64
+#define FILE_CHUNK 1024          // Entries added when the file table is full
+#define EXTENT_NODE_CHUNK 4096   // Free extent nodes backed by memory at a time
+#define BLOCK_CHUNK_BYTES (1 << 20)  // Block store backed by memory at a time
+#define PAGE_SIZE 4096
+#define VOLUME_MAGIC "VANFS\0\0\0"
+#define VOLUME_VERSION 3
 #define MAX_FILENAME 32
 #define MAX_PATH 256
+#define MAX_LINE (64 << 10)  // Longest command line of the shell
+#define BY_START 0  // Free extent tree ordered by start block
+#define BY_SIZE 1   // Free extent tree ordered by (length, start)
+#define INLINE_EXTENTS 8  // Runs of a file kept in its FileMetadata
+#define INLINE_CONTENT ((int)sizeof(Extent) * INLINE_EXTENTS)  // Or bytes of content
+#define PATH_CACHE_SIZE 64  // Paths of recently shown entries, a power of two
+#define DENTRY_CACHE_SIZE 1024  // Recent name lookups, a power of two
+#define LOCK_STRIPES 256  // Locks shared out among entries, buckets, etc., a power of two
+#define ALLOC_CACHE_BLOCKS 64  // Blocks a thread sets aside at a time
+#define MAX_THREAD_SLOTS 64    // Threads that get their own allocation cache and statistics
+#define OP_CREATE 0      // Operations with statistics, see count_op()
+#define OP_WRITE 1
+#define OP_READ 2
+#define OP_DELETE 3
+#define OP_LOOKUP 4       // Path resolutions
+#define OP_ALLOC 5        // Allocations from the free extent trees
+#define OP_CACHE_ALLOC 6  // Allocations served by a thread's cache
+#define NUM_OPS 7
+#define LATENCY_BUCKETS 40  // Latency histogram: one bucket per power of two of ns
+#define STATS_SAMPLING 16   // One call in this many is timed, a power of two
+#define JOURNAL_OFF 0
+#define JOURNAL_BATCHED 1  // Records are committed in groups
+#define JOURNAL_STRICT 2   // Every record is committed before returning
+#define JOURNAL_GROUP_BYTES (64 << 10)  // Commit once this much is pending
+#define JOURNAL_GROUP_NS 5e6            // ... or once the oldest record is this old
+#define JOURNAL_CHECKPOINT_BYTES (16 << 20)  // Checkpoint once the journal is this big
+#define JOURNAL_CREATE 1       // Record types
+#define JOURNAL_WRITE 2
+#define JOURNAL_DELETE 3
+#define JOURNAL_DELETE_TREE 4
+#define JOURNAL_TABLES 5       // Copy of the tables written by a checkpoint
+#define FILE_COMPRESSED 1  // Flags of a file: its blocks hold lz_compress() output
+#define FILE_DEDUP 2       // Its blocks are counted in the dedup index and may be shared
+#define FILE_INLINE 4      // Its content is in its entry, which has no blocks
+#define DEDUP_MIN_ENTRIES 1024  // Smallest dedup index, a power of two
+#define MAX_SNAPSHOTS 64
+#define SAVED_CHUNK 1024  // Saved entries added when the pool is full
+#define LZ_MIN_MATCH 4     // Shortest match the codec encodes
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12    // Entries of the match finder's table, as a power of two
+
+typedef struct {
+    int start;   // First block of the run
+    int length;  // Number of blocks
+} Extent;
+
+// Runs past INLINE_EXTENTS live in a chain of indirect blocks, each holding
+// the next indirect block (-1 if last) followed by an array of Extent
+#define INDIRECT_HEADER ((int)sizeof(int))
+#define INDIRECT_EXTENTS ((fs.block_size - INDIRECT_HEADER) / (int)sizeof(Extent))
 
 typedef struct {
     char filename[MAX_FILENAME];
     size_t size;
     time_t created;
     time_t modified;
-    int start_block;
+    union {
+        Extent extents[INLINE_EXTENTS];  // First runs of the file's blocks
+        char content[INLINE_CONTENT];    // Content of a FILE_INLINE file
+    };
+    int num_extents;      // Number of runs, inline and indirect
+    int indirect_block;   // First indirect block, -1 if none
     int num_blocks;
     int is_directory;
     int parent_dir;
+    unsigned int name_hash;  // Hash of filename, see hash_name()
+    int first_child;   // First entry of a directory, -1 if empty
+    int last_child;    // Last entry, so new entries are appended
+    int next_sibling;  // Next entry of the same directory
+    int prev_sibling;  // Previous entry of the same directory
+    int flags;         // FILE_COMPRESSED (size is then the size once
+                       // decompressed), FILE_DEDUP, FILE_INLINE
 } FileMetadata;
 
-typedef struct {
-    FileMetadata files[MAX_FILES];
-    char blocks[MAX_BLOCKS][BLOCK_SIZE];
-    int free_blocks[MAX_BLOCKS];
-    int num_files;
-    int current_dir;  // Index of the current directory
-} FileSystem;
+// What lookups and scans of the file table test, kept apart from the rest of
+// each entry so that four entries share a cache line. An entry's key is set
+// while the entry is in the name index.
+typedef struct {
+    unsigned int name_hash;  // Copies of the entry's fields
+    int parent_dir;
+    int hash_next;           // Next entry in the same name index bucket
+    int in_use;              // 1 if the slot holds a file, 0 if free
+} FileKey;
+
+typedef struct {
+    int start;
+    int length;
+    int left[2];   // Children in the BY_START and BY_SIZE trees, -1 if none
+    int right[2];
+} FreeExtent;
+
+typedef struct {
+    const FileMetadata* file;
+    int n;      // Index of the next run
+    int block;  // Indirect block holding run n once past the inline ones
+} ExtentIter;
+
+typedef struct {
+    ExtentIter it;
+    Extent run;   // Part of the current run not returned yet
+    size_t left;  // Bytes of content not returned yet
+    int frame;    // Block cache frame pinned for the caller, -1 if none
+    char* unpacked;  // Content of a compressed or inline file, NULL if none
+    FileMetadata entry;  // Copy of the entry of a snapshot's file
+} FileView;
+
+// One file searched by a grep
+typedef struct {
+    int file_index;
+    size_t* offsets;  // Where the pattern starts in its content, in order
+    int num_offsets;
+    int capacity;
+    int error;        // 1 if it could not be read
+} GrepFile;
+
+// The files of a grep, which its threads take in turns
+typedef struct {
+    const char* pattern;
+    size_t pattern_length;
+    GrepFile* files;
+    int num_files;
+    int capacity;
+    int next_file;    // Next file for a thread to take
+} GrepJob;
+
+// What an import or export has moved so far
+typedef struct {
+    int files;
+    int directories;
+    long long bytes;
+    int errors;        // Entries that could not be moved
+    char* buffer;      // TRANSFER_BUFFER bytes
+    size_t buffered;   // Bytes of output gathered in buffer
+    int out_fd;        // Where output goes
+} Transfer;
+
+// Header of an entry of a tar archive (ustar), followed by its content
+// in TAR_BLOCK blocks. Numbers are in octal text.
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;         // '0' file, '5' directory
+    char linkname[100];
+    char magic[6];     // "ustar"
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];  // Start of a path too long for name
+    char pad[12];
+} TarHeader;
+
+// A block of the deduplicated files, see dedup_share()
+typedef struct {
+    unsigned long long hash;  // Of its content, see hash_block()
+    int block;
+    int refs;        // Blocks of files that are this one
+    int hash_next;   // Next entry in the same bucket by hash, -1 if last;
+                     // next unused entry if unused
+    int block_next;  // Next entry in the same bucket by block, -1 if last
+} DedupEntry;
+
+// An entry as it was when a snapshot was taken, kept once it changed
+typedef struct {
+    FileMetadata entry;
+    int slot;            // Index of the entry in the file table
+    unsigned int epoch;  // Epoch of the snapshot it belongs to
+    int next;            // Copy of the same slot for an older snapshot, -1
+                         // if none; next unused copy if unused
+    int snap_next;       // Next copy of the same snapshot, -1 if last
+} SavedEntry;
+
+// The volume as it was at some point. Nothing is copied when it is taken:
+// entries are saved before they first change after it (see save_entry),
+// and the blocks it uses are neither written (see file_is_frozen) nor
+// freed (see retire_blocks). It sees slot i as the oldest copy of i saved
+// for it or a later snapshot, else as the live entry.
+typedef struct {
+    char name[MAX_FILENAME];
+    unsigned int epoch;  // fs.epoch when it was taken
+    time_t created;
+    int first_saved;     // Copies saved for it, -1 if none
+    int num_saved;
+    Extent* held;        // Blocks freed since that it still uses, under
+                         // alloc_lock
+    int num_held;
+    int held_capacity;
+    long long held_blocks;
+} Snapshot;
+
+// A path built by get_full_path(), valid while generation is current
+typedef struct {
+    int file_index;
+    unsigned int generation;  // fs.path_generation when it was built
+    int length;               // 0 if the entry is unused
+    char path[MAX_PATH];
+} PathCacheEntry;
+
+// A name looked up in a directory, found or not
+typedef struct {
+    int parent_dir;
+    int file_index;          // -1 if the name does not exist
+    unsigned int name_hash;
+    char filename[MAX_FILENAME];  // Empty if the entry is unused
+} DentryCacheEntry;
+
+#ifdef _WIN32
+typedef SRWLOCK RwLock;
+
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+typedef pthread_rwlock_t RwLock;
+#endif
+
+// One read or write of neighbouring blocks of the image, each to or from
+// a buffer of its own (a frame of the block cache)
+typedef struct {
+    int write;
+    int count;  // Buffers used in iov
+    struct iovec iov[CACHE_READ_AHEAD];
+    unsigned long long offset;
+    int result;  // 0 once done, -1 if it failed
+} IoRequest;
+
+#ifdef HAVE_IO_URING
+// io_uring of one thread, reached by system calls and the rings they map
+typedef struct {
+    int ready;  // 1 once set up, -1 if it can't be
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} IoRing;
+#endif
+
+#ifndef _WIN32
+// Request queued for the threads of the IO_THREADS engine
+typedef struct IoItem {
+    IoRequest* request;
+    int* pending;  // Requests of its batch not done yet
+    struct IoItem* next;
+} IoItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // Signalled when items are queued or to stop
+    pthread_cond_t done;  // Broadcast when a batch is done
+    IoItem* head;         // Queued items, first in first out
+    IoItem* tail;
+    pthread_t threads[IO_POOL_THREADS];
+    int num_threads;
+    int stop;
+} IoPool;
+#endif
+
+// Free blocks set aside for one thread, so that it can allocate small
+// runs without taking the allocator lock
+typedef struct {
+    int start;
+    int length;  // 0 if empty
+} AllocCache;
+
+// Statistics of one operation, kept per thread (see count_op)
+typedef struct {
+    long long count;
+    long long failures;
+    long long bytes;
+    long long timed;    // Calls that were timed
+    long long time_ns;  // Their total time
+    long long max_ns;
+    long long latency[LATENCY_BUCKETS];  // Timed calls by log2 of their ns
+} OpStats;
+
+// Volume layout chosen at startup
+typedef struct {
+    int block_size;     // Bytes per block
+    int num_blocks;     // Volume size in blocks
+    int num_files;      // Initial entries of the file table
+    int max_files;      // Entries the file table may grow to
+} VolumeGeometry;
+
+// First page of a volume: what is needed to find and use the tables.
+// A volume image is this superblock followed by the tables of FileSystem,
+// each starting on a new page (see layout_volume).
+typedef struct {
+    char magic[8];
+    int version;
+    int metadata_size;     // sizeof(FileMetadata) of the program that made it
+    int block_size;
+    int num_blocks;
+    int max_files;
+    int num_slots;
+    int name_buckets;
+    int extent_root[2];
+    int free_extent_node;
+    int extent_nodes_used;
+    int num_free_extents;
+    int free_block_count;
+    int num_files;
+    int next_free_slot;
+    int clean;             // 0 while the image is open
+    int compression;       // 1 if write_file() compresses what it stores
+    int dedup;             // 1 if write_file() shares identical blocks
+} Superblock;
+
+// Each journal record is this header followed by length bytes of payload
+typedef struct {
+    unsigned int type;
+    unsigned int length;
+    unsigned int checksum;  // Of the payload, see journal_checksum()
+} JournalRecord;
+
+typedef struct {
+    int slot;
+    int parent_dir;
+    int is_directory;
+    long long time;
+    char filename[MAX_FILENAME];
+} CreateRecord;
+
+// Followed by num_extents Extent and num_indirect block numbers, or by
+// the content of a FILE_INLINE file
+typedef struct {
+    int slot;
+    int num_extents;
+    int num_indirect;
+    long long size;
+    long long time;
+    int flags;
+} WriteRecord;
+
+// Offsets of the tables in a volume
+typedef struct {
+    size_t files;
+    size_t file_keys;
+    size_t name_tags;
+    size_t name_index;
+    size_t block_bitmap;
+    size_t free_extents;
+    size_t blocks;
+} VolumeLayout;
+
+// The tables below live in one range of address space sized for the whole
+// volume. In memory it is backed by memory as the tables grow; a volume
+// image maps its file there instead. Either way the tables never move, so
+// indices and pointers into them stay valid.
+//
+// Several threads may use the file system at once. Each operation holds
+// table_lock shared; growing the file table, deleting a tree and copying
+// the tables hold it exclusive. Below it, the lock of a directory (from
+// inode_locks) is taken to read or change its entries, and the lock of a
+// file to read or change its content; when both are needed they are taken
+// in stripe order (see lock_pair). The other locks guard one structure
+// each and are taken last, in the order slot, dentry, bucket, then
+// dedup, alloc, journal, path or snapshot, then cache.
+typedef struct {
+    char* volume;              // Superblock, then the tables
+    size_t volume_size;
+    int mapped;                // 1 if volume maps an image file
+#ifdef _WIN32
+    HANDLE image_file;
+    HANDLE image_mapping;
+#else
+    int image_fd;
+    int journal_fd;
+    pthread_t journal_flusher; // Commits groups that are due, see run_journal_flusher
+#endif
+    int journal_mode;          // JOURNAL_OFF, JOURNAL_BATCHED or JOURNAL_STRICT
+    int journal_flusher_running;
+    int journal_flusher_stop;
+    char* journal_buffer;      // Records not yet committed
+    size_t journal_length;
+    size_t journal_capacity;
+    size_t journal_size;       // Bytes committed since the last checkpoint
+    int journal_data_dirty;    // Blocks were written since the last commit
+    double journal_oldest_ns;  // When the first pending record was added
+    long long journal_records;
+    long long journal_commits;
+    long long journal_checkpoints;
+    FileMetadata* files;       // File table, num_slots entries usable
+    FileKey* file_keys;        // Key of each entry of the file table
+    unsigned int* name_tags;   // Tag of each entry's name, 0 if free, see name_tag()
+    char* blocks;              // Block store, blocks_committed blocks usable;
+                               // NULL with a block cache
+    unsigned long long* block_bitmap;  // 1 = in use
+    FreeExtent* free_extents;  // Node pool of the free extent trees
+    int* name_index;           // First entry of each bucket, -1 if empty
+    int block_size;
+    int num_blocks;
+    int blocks_committed;
+    int cache_frames;          // Blocks the block cache holds, 0 if none
+    char* cache_data;          // Content of the frames
+    int* frame_block;          // Block held by each frame, -1 if none
+    int* frame_next;           // Next frame in the same bucket, -1 if last
+    int* frame_pins;           // Views using each frame, which must stay
+    unsigned char* frame_flags;  // FRAME_REFERENCED, FRAME_DIRTY, FRAME_LOADING
+    int* cache_buckets;        // First frame of each bucket, by block
+    int cache_bucket_mask;
+    int clock_hand;            // Next frame to consider for eviction
+    size_t blocks_offset;      // Where block 0 starts in the image
+    long long cache_hits;
+    long long cache_misses;
+    long long cache_read_ahead;  // Blocks read before they were asked for
+    long long cache_evictions;
+    long long cache_writebacks;  // Blocks written back to the image
+    int io_engine;             // IO_SYNC, IO_THREADS or IO_URING
+#ifdef HAVE_IO_URING
+    IoRing io_rings[MAX_THREAD_SLOTS];  // By thread slot, set up on first use
+#endif
+#ifndef _WIN32
+    IoPool io_pool;
+#endif
+    long long io_batches;      // Calls of run_io()
+    long long io_requests;
+    int num_slots;             // Entries of the file table, used or free
+    int max_files;
+    int name_buckets;          // Buckets of the name index, a power of two
+    int extent_nodes_committed;
+    int extent_root[2];        // Roots of the BY_START and BY_SIZE trees
+    int free_extent_node;      // Unused extent nodes, chained through left[0]
+    int extent_nodes_used;     // Extent nodes handed out so far
+    int num_free_extents;
+    int free_block_count;
+    int compression;           // 1 if write_file() compresses what it stores
+    int dedup;                 // 1 if write_file() shares identical blocks
+    DedupEntry* dedup_entries;  // Dedup index, see dedup_share()
+    int* dedup_by_hash;        // First entry of each bucket, -1 if empty
+    int* dedup_by_block;
+    int dedup_bucket_mask;     // Buckets of each table - 1
+    int dedup_capacity;        // Entries, as many as buckets
+    int dedup_used;            // Entries handed out so far
+    int dedup_free;            // Unused entries, chained through hash_next
+    int dedup_blocks;          // Entries in use
+    long long dedup_refs;      // References to them; the blocks saved are
+                               // the difference
+    Snapshot snapshots[MAX_SNAPSHOTS];  // Oldest first
+    int num_snapshots;
+    unsigned int epoch;        // Bumped by each snapshot
+    int* saved_head;           // By slot: newest copy + 1, 0 if none
+    unsigned int* block_birth;  // By block: fs.epoch when it was allocated
+    SavedEntry* saved;         // Pool of copies
+    int saved_capacity;
+    int saved_used;            // Copies handed out so far
+    int saved_free;            // Unused copies, chained through next
+    long long alloc_scan_steps;  // Free extent nodes visited by alloc_blocks()
+    long long alloc_scan_max;    // Most visited by one call
+    PathCacheEntry path_cache[PATH_CACHE_SIZE];  // By file index
+    unsigned int path_generation;  // Bumped when an entry is removed
+    DentryCacheEntry dentry_cache[DENTRY_CACHE_SIZE];  // By (parent, name)
+    long long dentry_hits;
+    long long dentry_misses;
+    int num_files;
+    int current_dir;  // Index of the current directory
+    int next_free_slot;  // Where create_file starts looking for a free slot
+    int locks_ready;
+    unsigned int serial;  // Tells the volumes apart, see thread_alloc_cache()
+    RwLock table_lock;
+    RwLock inode_locks[LOCK_STRIPES];   // Directories and files, by index
+    RwLock bucket_locks[LOCK_STRIPES];  // Name index chains, by bucket
+    RwLock dentry_locks[LOCK_STRIPES];  // Dentry cache entries, by slot
+    RwLock slot_lock;     // num_files and next_free_slot
+    RwLock dedup_lock;    // Dedup index
+    RwLock alloc_lock;    // Free space manager
+    RwLock journal_lock;  // Journal buffer and file
+    RwLock path_lock;     // Path cache
+    RwLock snap_lock;     // Saved entries of the snapshots
+    RwLock cache_lock;    // Block cache
+    AllocCache alloc_caches[MAX_THREAD_SLOTS];  // By thread slot
+    int thread_slots_used;  // May pass MAX_THREAD_SLOTS, see thread_slot()
+    OpStats op_stats[MAX_THREAD_SLOTS + 1][NUM_OPS];  // By thread slot; the
+                                                      // last is shared by the
+                                                      // threads without one
+    int checkpoint_due;   // The journal is due a checkpoint, see end_op()
+} FileSystem;
+
+FileSystem fs;
+unsigned int volumes_opened;
+
+void init_lock(RwLock* lock) {
+#ifdef _WIN32
+    InitializeSRWLock(lock);
+#else
+    pthread_rwlock_init(lock, NULL);
+#endif
+}
+
+void destroy_lock(RwLock* lock) {
+#ifdef _WIN32
+    (void)lock;
+#else
+    pthread_rwlock_destroy(lock);
+#endif
+}
+
+void read_lock(RwLock* lock) {
+#ifdef _WIN32
+    AcquireSRWLockShared(lock);
+#else
+    pthread_rwlock_rdlock(lock);
+#endif
+}
+
+void read_unlock(RwLock* lock) {
+#ifdef _WIN32
+    ReleaseSRWLockShared(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void write_lock(RwLock* lock) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(lock);
+#else
+    pthread_rwlock_wrlock(lock);
+#endif
+}
+
+void write_unlock(RwLock* lock) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+// Set up the locks of a new or just opened volume
+void init_locks() {
+    init_lock(&fs.table_lock);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        init_lock(&fs.inode_locks[i]);
+        init_lock(&fs.bucket_locks[i]);
+        init_lock(&fs.dentry_locks[i]);
+    }
+    init_lock(&fs.slot_lock);
+    init_lock(&fs.dedup_lock);
+    init_lock(&fs.alloc_lock);
+    init_lock(&fs.journal_lock);
+    init_lock(&fs.path_lock);
+    init_lock(&fs.snap_lock);
+    init_lock(&fs.cache_lock);
+    fs.locks_ready = 1;
+    fs.serial = ++volumes_opened;
+}
+
+void destroy_locks() {
+    if (!fs.locks_ready) return;
+    destroy_lock(&fs.table_lock);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        destroy_lock(&fs.inode_locks[i]);
+        destroy_lock(&fs.bucket_locks[i]);
+        destroy_lock(&fs.dentry_locks[i]);
+    }
+    destroy_lock(&fs.slot_lock);
+    destroy_lock(&fs.dedup_lock);
+    destroy_lock(&fs.alloc_lock);
+    destroy_lock(&fs.journal_lock);
+    destroy_lock(&fs.path_lock);
+    destroy_lock(&fs.snap_lock);
+    destroy_lock(&fs.cache_lock);
+    fs.locks_ready = 0;
+}
+
+// Add to a counter that threads update without a common lock
+void add_counter(long long* counter, long long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+RwLock* inode_lock(int file_index) {
+    return &fs.inode_locks[file_index & (LOCK_STRIPES - 1)];
+}
+
+void lock_inode(int file_index, int write) {
+    if (write) {
+        write_lock(inode_lock(file_index));
+    } else {
+        read_lock(inode_lock(file_index));
+    }
+}
+
+void unlock_inode(int file_index, int write) {
+    if (write) {
+        write_unlock(inode_lock(file_index));
+    } else {
+        read_unlock(inode_lock(file_index));
+    }
+}
+
+// Lock a directory and one of its entries. Entries share stripes, so the
+// lower stripe is always taken first; when both fall on the same stripe it
+// is taken once, for writing if either asks for it.
+void lock_pair(int dir_index, int dir_write, int file_index, int write) {
+    RwLock* dir_lock = inode_lock(dir_index);
+    RwLock* file_lock = inode_lock(file_index);
+    if (dir_lock == file_lock) {
+        lock_inode(file_index, dir_write || write);
+    } else if (dir_lock < file_lock) {
+        lock_inode(dir_index, dir_write);
+        lock_inode(file_index, write);
+    } else {
+        lock_inode(file_index, write);
+        lock_inode(dir_index, dir_write);
+    }
+}
+
+void unlock_pair(int dir_index, int dir_write, int file_index, int write) {
+    if (inode_lock(dir_index) == inode_lock(file_index)) {
+        unlock_inode(file_index, dir_write || write);
+    } else {
+        unlock_inode(file_index, write);
+        unlock_inode(dir_index, dir_write);
+    }
+}
+
+// Reserve address space for size bytes, backed by no memory yet
+void* reserve_memory(size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void* memory = mmap(NULL, size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+#endif
+}
+
+// Back the first size bytes of a reservation with zeroed memory.
+// Returns 0, or -1 if the system is out of memory.
+int commit_memory(void* memory, size_t size) {
+    if (size == 0 || fs.mapped) return 0;  // An image is backed by its file
+#ifdef _WIN32
+    return VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) ? 0 : -1;
+#else
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char* start = (char*)((uintptr_t)memory / page * page);
+    size_t length = (char*)memory + size - start;
+    return mprotect(start, (length + page - 1) / page * page, PROT_READ | PROT_WRITE);
+#endif
+}
+
+void release_memory(void* memory, size_t size) {
+    if (!memory) return;
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+}
+
+// Start of a block in the block store
+char* block_data(int block) {
+    return fs.blocks + (size_t)block * fs.block_size;
+}
+
+// Back the block store with memory up to (not including) block end.
+// Returns 0, or -1 if the system is out of memory.
+int grow_blocks(int end) {
+    if (end <= fs.blocks_committed) return 0;
+    int chunk = BLOCK_CHUNK_BYTES / fs.block_size;
+    if (chunk < 1) chunk = 1;
+    int committed = (end + chunk - 1) / chunk * chunk;
+    if (committed > fs.num_blocks) committed = fs.num_blocks;
+    if (commit_memory(fs.blocks, (size_t)committed * fs.block_size) != 0) {
+        return -1;
+    }
+    fs.blocks_committed = committed;
+    return 0;
+}
+
+// Block cache. A volume image larger than memory can keep its blocks out
+// of the address space: they are then read and written with file I/O
+// through a fixed number of frames. Frames are found by block in a hash
+// table and recycled with the CLOCK algorithm: a frame used since the hand
+// last passed gets a second chance. A miss reads the blocks that follow
+// in the same run along with the one asked for, and dirty frames are
+// written back in runs of neighbouring blocks, on eviction and on sync.
+// Reads and writes go through an I/O engine in batches (see run_io()).
+
+// Read length bytes of the image at offset. Returns 0, or -1 on failure.
+int read_image(char* buffer, size_t length, unsigned long long offset) {
+#ifdef _WIN32
+    OVERLAPPED at;
+    DWORD got;
+    memset(&at, 0, sizeof(at));
+    at.Offset = (DWORD)offset;
+    at.OffsetHigh = (DWORD)(offset >> 32);
+    return (ReadFile(fs.image_file, buffer, (DWORD)length, &got, &at) && got == length) ? 0 : -1;
+#else
+    while (length > 0) {
+        ssize_t got = pread(fs.image_fd, buffer, length, (off_t)offset);
+        if (got <= 0) return -1;
+        buffer += got;
+        length -= got;
+        offset += got;
+    }
+    return 0;
+#endif
+}
+
+// Write length bytes to the image at offset. Returns 0, or -1 on failure.
+int write_image(const char* data, size_t length, unsigned long long offset) {
+#ifdef _WIN32
+    OVERLAPPED at;
+    DWORD written;
+    memset(&at, 0, sizeof(at));
+    at.Offset = (DWORD)offset;
+    at.OffsetHigh = (DWORD)(offset >> 32);
+    return (WriteFile(fs.image_file, data, (DWORD)length, &written, &at) &&
+            written == length) ? 0 : -1;
+#else
+    while (length > 0) {
+        ssize_t written = pwrite(fs.image_fd, data, length, (off_t)offset);
+        if (written <= 0) return -1;
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+#endif
+}
+
+// I/O engines. The cache reads and writes the image in batches of
+// requests (see IoRequest), which run_io() hands to the engine of the
+// volume and waits for: IO_URING submits a batch to an io_uring of the
+// calling thread in one system call, IO_THREADS queues it to a pool of
+// threads doing the requests at the same time, and IO_SYNC does them one
+// after the other. An engine that can't be set up falls back to the next.
+
+int io_engine_choice = IO_URING;  // Engine of the volume images opened next
+
+int thread_slot();
+
+// Do a request with plain system calls. Returns 0, or -1 on failure.
+int do_io(IoRequest* request) {
+#ifdef _WIN32
+    unsigned long long offset = request->offset;
+    for (int i = 0; i < request->count; i++) {
+        struct iovec* buffer = &request->iov[i];
+        int result = request->write ?
+            write_image(buffer->iov_base, buffer->iov_len, offset) :
+            read_image(buffer->iov_base, buffer->iov_len, offset);
+        if (result != 0) return -1;
+        offset += buffer->iov_len;
+    }
+    return 0;
+#else
+    struct iovec iov[CACHE_READ_AHEAD];
+    memcpy(iov, request->iov, request->count * sizeof(struct iovec));
+    struct iovec* next = iov;
+    int left = request->count;
+    off_t offset = (off_t)request->offset;
+    while (left > 0) {
+        ssize_t done = request->write ? pwritev(fs.image_fd, next, left, offset) :
+                                        preadv(fs.image_fd, next, left, offset);
+        if (done <= 0) return -1;
+        offset += done;
+        while (left > 0 && (size_t)done >= next->iov_len) {
+            done -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {  // Short transfer: go on from where it stopped
+            next->iov_base = (char*)next->iov_base + done;
+            next->iov_len -= done;
+        }
+    }
+    return 0;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+void close_ring(IoRing* ring) {
+    if (ring->ready != 1) return;
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->ready = 0;
+}
+
+// Set up an io_uring of IO_BATCH entries. Returns 0, or -1 if the system
+// has none to give.
+int open_ring(IoRing* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ready = -1;
+    ring->fd = (int)syscall(__NR_io_uring_setup, IO_BATCH, &params);
+    if (ring->fd < 0) return -1;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return -1;
+    }
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->ready = 1;
+    return 0;
+}
+
+// Take the completions queued on a ring, doing again with do_io() a
+// request that came back short or failed. Returns the number taken, and
+// sets *result to -1 if one failed.
+int reap_ring(IoRing* ring, IoRequest* requests, int* result) {
+    int taken = 0;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        IoRequest* request = &requests[cqe->user_data];
+        size_t length = 0;
+        for (int i = 0; i < request->count; i++) length += request->iov[i].iov_len;
+        request->result = (cqe->res >= 0 && (size_t)cqe->res == length) ? 0 : do_io(request);
+        if (request->result != 0) *result = -1;
+        head++;
+        taken++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return taken;
+}
+
+// Run up to IO_BATCH requests on a ring: one system call submits them all
+// and waits for the first to complete. A request that comes back short or
+// failed is done again with do_io(), as are those the ring never took if
+// it breaks down. Returns 0, or -1 if one failed.
+int ring_io(IoRing* ring, IoRequest* requests, int n) {
+    unsigned tail = *ring->sq_tail;
+    for (int i = 0; i < n; i++) {
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = requests[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fs.image_fd;
+        sqe->addr = (unsigned long long)(uintptr_t)requests[i].iov;
+        sqe->len = requests[i].count;
+        sqe->off = requests[i].offset;
+        sqe->user_data = i;
+        ring->sq_array[index] = index;
+        requests[i].result = 1;  // In flight
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int result = 0;
+    int unsubmitted = n;
+    int completed = 0;
+    while (completed < n) {
+        int submitted = (int)syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1,
+                                     IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno != EINTR) break;
+        if (submitted > 0) unsubmitted -= submitted;
+        completed += reap_ring(ring, requests, &result);
+    }
+    if (completed == n) return result;
+
+    // The ring is unusable. The kernel takes entries in order, so the
+    // first n - unsubmitted requests are in flight: wait for them, as
+    // their buffers are still being read or written. Then do the rest with
+    // plain system calls, and let the calling thread do so from now on.
+    int taken = n - unsubmitted;
+    while (completed < taken) {
+        int waited = (int)syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                                  NULL, 0);
+        if (waited < 0 && errno != EINTR) break;
+        completed += reap_ring(ring, requests, &result);
+    }
+    for (int i = 0; i < n; i++) {
+        if (requests[i].result != 1) continue;
+        // One the ring took but never completed is failed, not redone
+        requests[i].result = i < taken ? -1 : do_io(&requests[i]);
+        if (requests[i].result != 0) result = -1;
+    }
+    close_ring(ring);
+    ring->ready = -1;
+    return result;
+}
+#endif
+
+#ifndef _WIN32
+void* run_io_thread(void* arg) {
+    IoPool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stop) pthread_cond_wait(&pool->work, &pool->lock);
+        IoItem* item = pool->head;
+        if (!item) break;  // Stopped with nothing queued
+        pool->head = item->next;
+        if (!pool->head) pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+        item->request->result = do_io(item->request);
+        pthread_mutex_lock(&pool->lock);
+        if (--*item->pending == 0) pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Start the threads of the IO_THREADS engine. Returns 0, or -1 if none
+// could be started.
+int start_io_pool() {
+    IoPool* pool = &fs.io_pool;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->head = pool->tail = NULL;
+    pool->stop = 0;
+    pool->num_threads = 0;
+    while (pool->num_threads < IO_POOL_THREADS &&
+           pthread_create(&pool->threads[pool->num_threads], NULL, run_io_thread, pool) == 0) {
+        pool->num_threads++;
+    }
+    if (pool->num_threads > 0) return 0;
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    return -1;
+}
+
+void stop_io_pool() {
+    IoPool* pool = &fs.io_pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    pool->num_threads = 0;
+}
+
+// Queue up to IO_BATCH requests to the pool and wait for all of them.
+// Returns 0, or -1 if one failed.
+int pool_io(IoRequest* requests, int n) {
+    IoPool* pool = &fs.io_pool;
+    IoItem items[IO_BATCH];
+    int pending = n;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < n; i++) {
+        items[i] = (IoItem){&requests[i], &pending, NULL};
+        if (pool->tail) {
+            pool->tail->next = &items[i];
+        } else {
+            pool->head = &items[i];
+        }
+        pool->tail = &items[i];
+    }
+    pthread_cond_broadcast(&pool->work);
+    while (pending > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < n; i++) {
+        if (requests[i].result != 0) return -1;
+    }
+    return 0;
+}
+#endif
+
+// Run up to IO_BATCH requests and wait for them, setting the result of
+// each. Returns 0, or -1 if one failed.
+int run_io(IoRequest* requests, int n) {
+    if (n == 0) return 0;
+    add_counter(&fs.io_batches, 1);
+    add_counter(&fs.io_requests, n);
+#ifdef HAVE_IO_URING
+    if (fs.io_engine == IO_URING) {
+        // A thread past MAX_THREAD_SLOTS has no ring and does without
+        int slot = thread_slot();
+        IoRing* ring = slot == -1 ? NULL : &fs.io_rings[slot];
+        if (ring && ring->ready == 0) open_ring(ring);
+        if (ring && ring->ready == 1) return ring_io(ring, requests, n);
+    }
+#endif
+#ifndef _WIN32
+    if (fs.io_engine == IO_THREADS) return pool_io(requests, n);
+#endif
+    int result = 0;
+    for (int i = 0; i < n; i++) {
+        requests[i].result = do_io(&requests[i]);
+        if (requests[i].result != 0) result = -1;
+    }
+    return result;
+}
+
+// Start the I/O engine io_engine_choice asks for, or the next one that
+// can run here
+void start_io_engine() {
+    int engine = io_engine_choice;
+    fs.io_engine = IO_SYNC;
+#ifdef HAVE_IO_URING
+    if (engine == IO_URING) {
+        int slot = thread_slot();
+        if (slot != -1 && open_ring(&fs.io_rings[slot]) == 0) {
+            fs.io_engine = IO_URING;
+            return;
+        }
+        engine = IO_THREADS;
+    }
+#endif
+#ifndef _WIN32
+    if (engine != IO_SYNC && start_io_pool() == 0) fs.io_engine = IO_THREADS;
+#else
+    (void)engine;
+#endif
+}
+
+void stop_io_engine() {
+#ifdef HAVE_IO_URING
+    for (int i = 0; i < MAX_THREAD_SLOTS; i++) close_ring(&fs.io_rings[i]);
+#endif
+#ifndef _WIN32
+    if (fs.io_engine == IO_THREADS) stop_io_pool();
+#endif
+    fs.io_engine = IO_SYNC;
+}
+
+const char* io_engine_name(int engine) {
+    return engine == IO_URING ? "io_uring" : engine == IO_THREADS ? "threads" : "sync";
+}
+
+// Set up a block cache of the given number of frames.
+// Returns 0, or -1 if the system is out of memory.
+int init_block_cache(int frames) {
+    if (frames < MIN_CACHE_FRAMES) frames = MIN_CACHE_FRAMES;
+    if (frames > fs.num_blocks) frames = fs.num_blocks;
+    int buckets = 1;
+    while (buckets < frames) buckets *= 2;
+    fs.cache_frames = frames;
+    fs.cache_bucket_mask = buckets - 1;
+    fs.cache_data = malloc((size_t)frames * fs.block_size);
+    fs.frame_block = malloc(frames * sizeof(int));
+    fs.frame_next = malloc(frames * sizeof(int));
+    fs.frame_pins = calloc(frames, sizeof(int));
+    fs.frame_flags = calloc(frames, 1);
+    fs.cache_buckets = malloc(buckets * sizeof(int));
+    if (!fs.cache_data || !fs.frame_block || !fs.frame_next || !fs.frame_pins ||
+        !fs.frame_flags || !fs.cache_buckets) {
+        return -1;
+    }
+    for (int i = 0; i < frames; i++) {
+        fs.frame_block[i] = -1;
+        fs.frame_next[i] = -1;
+    }
+    for (int i = 0; i < buckets; i++) {
+        fs.cache_buckets[i] = -1;
+    }
+    start_io_engine();
+    return 0;
+}
+
+void free_block_cache() {
+    stop_io_engine();
+    free(fs.cache_data);
+    free(fs.frame_block);
+    free(fs.frame_next);
+    free(fs.frame_pins);
+    free(fs.frame_flags);
+    free(fs.cache_buckets);
+}
+
+char* frame_data(int frame) {
+    return fs.cache_data + (size_t)frame * fs.block_size;
+}
+
+int* cache_bucket(int block) {
+    return &fs.cache_buckets[((unsigned int)block * 2654435761u) & fs.cache_bucket_mask];
+}
+
+// Frame holding a block, -1 if it is not cached
+int find_frame(int block) {
+    int frame = *cache_bucket(block);
+    while (frame != -1 && fs.frame_block[frame] != block) {
+        frame = fs.frame_next[frame];
+    }
+    return frame;
+}
+
+int frame_dirty(int frame) {
+    return frame != -1 && (fs.frame_flags[frame] & FRAME_DIRTY);
+}
+
+// Frame whose content a request buffer is
+int buffer_frame(const struct iovec* buffer) {
+    return (int)(((char*)buffer->iov_base - fs.cache_data) / fs.block_size);
+}
+
+// Make a write request of a dirty frame and the dirty frames of the blocks
+// around it, which are clean from then on
+void dirty_run(int frame, IoRequest* request) {
+    int start = fs.frame_block[frame];
+    int count = 1;
+    while (count < CACHE_READ_AHEAD && start > 0 && frame_dirty(find_frame(start - 1))) {
+        start--;
+        count++;
+    }
+    while (count < CACHE_READ_AHEAD && start + count < fs.num_blocks &&
+           frame_dirty(find_frame(start + count))) {
+        count++;
+    }
+    request->write = 1;
+    request->count = count;
+    request->offset = fs.blocks_offset + (unsigned long long)start * fs.block_size;
+    for (int i = 0; i < count; i++) {
+        int f = find_frame(start + i);
+        request->iov[i].iov_base = frame_data(f);
+        request->iov[i].iov_len = fs.block_size;
+        fs.frame_flags[f] &= ~FRAME_DIRTY;
+    }
+}
+
+// Write a batch of requests of dirty_run() back to the image, the frames
+// of those that fail becoming dirty again. The caller holds cache_lock.
+// Returns 0, or -1 if the image can't be written.
+int write_runs(IoRequest* requests, int n) {
+    int result = run_io(requests, n);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < requests[i].count; j++) {
+            if (requests[i].result != 0) {
+                fs.frame_flags[buffer_frame(&requests[i].iov[j])] |= FRAME_DIRTY;
+            }
+        }
+        if (requests[i].result == 0) fs.cache_writebacks += requests[i].count;
+    }
+    if (result != 0) printf("Error: Cannot write the volume image\n");
+    return result;
+}
+
+// Write a dirty frame back to the image, along with the dirty frames of
+// the blocks around it. Returns 0, or -1 if the image can't be written.
+int write_back(int frame) {
+    IoRequest request;
+    dirty_run(frame, &request);
+    return write_runs(&request, 1);
+}
+
+// Take a frame out of the hash table
+void unlink_frame(int frame) {
+    int* link = cache_bucket(fs.frame_block[frame]);
+    while (*link != frame) link = &fs.frame_next[*link];
+    *link = fs.frame_next[frame];
+    fs.frame_block[frame] = -1;
+    fs.frame_flags[frame] = 0;
+}
+
+// Give a frame to a block, evicting the block it held. The caller holds
+// cache_lock. Returns the frame, or -1 if every frame is pinned or the
+// evicted block can't be written back.
+int take_frame(int block) {
+    int frame = -1;
+    for (int scanned = 0; scanned < 2 * fs.cache_frames && frame == -1; scanned++) {
+        int f = fs.clock_hand;
+        fs.clock_hand = (f + 1) % fs.cache_frames;
+        if (fs.frame_pins[f] > 0) continue;
+        if (fs.frame_flags[f] & FRAME_REFERENCED) {
+            fs.frame_flags[f] &= ~FRAME_REFERENCED;  // Second chance
+            continue;
+        }
+        frame = f;
+    }
+    if (frame == -1) {
+        printf("Error: Every frame of the block cache is in use\n");
+        return -1;
+    }
+
+    if (fs.frame_block[frame] != -1) {
+        if (frame_dirty(frame) && write_back(frame) != 0) return -1;
+        unlink_frame(frame);
+        fs.cache_evictions++;
+    }
+    fs.frame_block[frame] = block;
+    fs.frame_flags[frame] = 0;
+    int* bucket = cache_bucket(block);
+    fs.frame_next[frame] = *bucket;
+    *bucket = frame;
+    return frame;
+}
+
+// Read in the blocks of runs that are not cached, up to a quarter of the
+// cache, as one batch of requests. The frames are pinned and FRAME_LOADING
+// meanwhile, and cache_lock, which the caller holds, is let go during the
+// I/O, so that other threads go on using the cache and have reads of
+// their own in flight. Returns the number of blocks read in, or -1 if a
+// read failed (those blocks are left out of the cache).
+int load_frames(const Extent* runs, int n) {
+    IoRequest requests[IO_BATCH];
+    int num_requests = 0;
+    int budget = fs.cache_frames / 4;
+    int loaded = 0;
+    for (int r = 0; r < n && loaded < budget; r++) {
+        IoRequest* request = NULL;
+        for (int block = runs[r].start; block < runs[r].start + runs[r].length; block++) {
+            if (loaded == budget) break;
+            if (find_frame(block) != -1) {
+                request = NULL;
+                continue;
+            }
+            if (request && request->count == CACHE_READ_AHEAD) request = NULL;
+            if (!request) {
+                if (num_requests == IO_BATCH) break;
+                request = &requests[num_requests++];
+                request->write = 0;
+                request->count = 0;
+                request->offset = fs.blocks_offset + (unsigned long long)block * fs.block_size;
+            }
+            int frame = take_frame(block);
+            if (frame == -1) {
+                if (request->count == 0) num_requests--;
+                r = n;  // Read in what was gathered so far
+                break;
+            }
+            fs.frame_flags[frame] = FRAME_LOADING;
+            fs.frame_pins[frame]++;
+            request->iov[request->count].iov_base = frame_data(frame);
+            request->iov[request->count].iov_len = fs.block_size;
+            request->count++;
+            loaded++;
+        }
+    }
+    if (loaded == 0) return 0;
+
+    write_unlock(&fs.cache_lock);
+    int result = run_io(requests, num_requests);
+    write_lock(&fs.cache_lock);
+    for (int i = 0; i < num_requests; i++) {
+        for (int j = 0; j < requests[i].count; j++) {
+            int frame = buffer_frame(&requests[i].iov[j]);
+            fs.frame_flags[frame] &= ~FRAME_LOADING;
+            fs.frame_pins[frame]--;
+            if (requests[i].result != 0) unlink_frame(frame);
+        }
+    }
+    if (result != 0) {
+        printf("Error: Cannot read the volume image\n");
+        return -1;
+    }
+    return loaded;
+}
+
+// Frame holding a block, loaded on a miss unless it is about to be
+// overwritten whole. run is the number of blocks from this one to the end
+// of its run, which a miss reads ahead (up to CACHE_READ_AHEAD). The
+// caller holds cache_lock. Returns the frame, or -1 on failure.
+int cache_frame(int block, int run, int overwrite) {
+    int frame = find_frame(block);
+    while (frame != -1 && (fs.frame_flags[frame] & FRAME_LOADING)) {
+        // Another thread is reading it in: wait for it outside the lock
+        write_unlock(&fs.cache_lock);
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+        write_lock(&fs.cache_lock);
+        frame = find_frame(block);
+    }
+    if (frame != -1) {
+        fs.cache_hits++;
+        fs.frame_flags[frame] |= FRAME_REFERENCED;
+        return frame;
+    }
+    fs.cache_misses++;
+    if (overwrite) {
+        frame = take_frame(block);
+        if (frame != -1) fs.frame_flags[frame] |= FRAME_REFERENCED;
+        return frame;
+    }
+
+    // Read the block and the uncached ones after it in one go; the ones
+    // read ahead are left unreferenced, so evicted first if unused
+    Extent ahead = {block, 1};
+    if (run > CACHE_READ_AHEAD) run = CACHE_READ_AHEAD;
+    while (ahead.length < run && find_frame(block + ahead.length) == -1) ahead.length++;
+    int loaded = load_frames(&ahead, 1);
+    if (loaded <= 0) return -1;
+    fs.cache_read_ahead += loaded - 1;
+    // Unpinned by load_frames() under the lock, so still there
+    frame = find_frame(block);
+    fs.frame_flags[frame] |= FRAME_REFERENCED;
+    return frame;
+}
+
+// Copy length bytes at offset into a run of blocks starting at block
+// (run blocks long) into a buffer. Returns 0, or -1 if a block could not
+// be read (zeros are copied from there on).
+int load_blocks(int block, int run, size_t offset, void* buffer, size_t length) {
+    if (fs.cache_frames == 0) {
+        memcpy(buffer, block_data(block) + offset, length);
+        return 0;
+    }
+    char* out = buffer;
+    block += (int)(offset / fs.block_size);
+    run -= (int)(offset / fs.block_size);
+    offset %= fs.block_size;
+    int budget = fs.cache_frames / 4;
+    int result = 0;
+    write_lock(&fs.cache_lock);
+    while (length > 0) {
+        // Read the uncached blocks of the next stretch in one batch, then
+        // copy them
+        int stretch = (int)((offset + length + fs.block_size - 1) / fs.block_size);
+        if (stretch > budget) stretch = budget;
+        if (stretch > 1) {
+            Extent ahead = {block, stretch + CACHE_READ_AHEAD - 1};
+            if (ahead.length > run) ahead.length = run;
+            int loaded = load_frames(&ahead, 1);
+            if (loaded > 0) fs.cache_read_ahead += loaded;
+        }
+        for (int i = 0; i < stretch && length > 0; i++) {
+            size_t n = fs.block_size - offset;
+            if (n > length) n = length;
+            int frame = cache_frame(block, run, 0);
+            if (frame == -1) {
+                memset(out, 0, length);
+                result = -1;
+                length = 0;
+                break;
+            }
+            memcpy(out, frame_data(frame) + offset, n);
+            block++;
+            run--;
+            out += n;
+            length -= n;
+            offset = 0;
+        }
+    }
+    write_unlock(&fs.cache_lock);
+    return result;
+}
+
+// Copy length bytes of data, or zeros if data is NULL, at offset into the
+// blocks starting at block
+void store_blocks(int block, size_t offset, const void* data, size_t length) {
+    if (fs.cache_frames == 0) {
+        if (data) {
+            memcpy(block_data(block) + offset, data, length);
+        } else {
+            memset(block_data(block) + offset, 0, length);
+        }
+        return;
+    }
+    const char* in = data;
+    block += (int)(offset / fs.block_size);
+    offset %= fs.block_size;
+    write_lock(&fs.cache_lock);
+    while (length > 0) {
+        size_t n = fs.block_size - offset;
+        if (n > length) n = length;
+        int frame = cache_frame(block, 1, n == (size_t)fs.block_size);
+        if (frame != -1) {
+            if (in) {
+                memcpy(frame_data(frame) + offset, in, n);
+            } else {
+                memset(frame_data(frame) + offset, 0, n);
+            }
+            fs.frame_flags[frame] |= FRAME_DIRTY;
+        }
+        if (in) in += n;
+        block++;
+        length -= n;
+        offset = 0;
+    }
+    write_unlock(&fs.cache_lock);
+}
+
+// Pin the frame of a block, see load_blocks() for run.
+// Returns the frame, or -1 on failure.
+int pin_block(int block, int run) {
+    write_lock(&fs.cache_lock);
+    int frame = cache_frame(block, run, 0);
+    if (frame != -1) fs.frame_pins[frame]++;
+    write_unlock(&fs.cache_lock);
+    return frame;
+}
+
+void unpin_frame(int frame) {
+    write_lock(&fs.cache_lock);
+    fs.frame_pins[frame]--;
+    write_unlock(&fs.cache_lock);
+}
+
+// Write every dirty frame back to the image, the runs of IO_BATCH of them
+// at a time. Returns 0, or -1 on failure.
+int flush_block_cache() {
+    IoRequest requests[IO_BATCH];
+    int result = 0;
+    write_lock(&fs.cache_lock);
+    int frame = 0;
+    while (frame < fs.cache_frames) {
+        int n = 0;
+        for (; frame < fs.cache_frames && n < IO_BATCH; frame++) {
+            if (frame_dirty(frame)) dirty_run(frame, &requests[n++]);
+        }
+        if (write_runs(requests, n) != 0) result = -1;
+    }
+    write_unlock(&fs.cache_lock);
+    return result;
+}
+
+// Hash a filename (FNV-1a)
+unsigned int hash_name(const char* filename) {
+    unsigned int hash = 2166136261u;
+    while (*filename) {
+        hash ^= (unsigned char)*filename++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Short form of a name kept for each entry: the hash with the length in
+// its low bits. It is never 0, which marks free slots.
+unsigned int name_tag(unsigned int name_hash, size_t length) {
+    return (name_hash & ~(unsigned int)(MAX_FILENAME - 1)) | (unsigned int)length;
+}
+
+// Bucket of the name index holding (dir_index, name_hash)
+int name_bucket(int dir_index, unsigned int name_hash) {
+    unsigned int key = name_hash ^ ((unsigned int)dir_index * 2654435761u);
+    return (int)(key & (unsigned int)(fs.name_buckets - 1));
+}
+
+RwLock* bucket_lock(int bucket) {
+    return &fs.bucket_locks[bucket & (LOCK_STRIPES - 1)];
+}
+
+// Keep a copy of an entry for the newest snapshot before the entry first
+// changes after it. Every change to the file table comes after this.
+void save_entry(int file_index) {
+    if (fs.num_snapshots == 0) return;
+    Snapshot* snap = &fs.snapshots[fs.num_snapshots - 1];
+    write_lock(&fs.snap_lock);
+    int head = fs.saved_head[file_index] - 1;
+    if (head == -1 || fs.saved[head].epoch != snap->epoch) {
+        if (fs.saved_free == -1 && fs.saved_used == fs.saved_capacity) {
+            int capacity = fs.saved_capacity + SAVED_CHUNK;
+            SavedEntry* saved = realloc(fs.saved, capacity * sizeof(SavedEntry));
+            if (!saved) {
+                printf("Error: Out of memory for the snapshots\n");
+                exit(1);
+            }
+            fs.saved = saved;
+            fs.saved_capacity = capacity;
+        }
+        int copy = fs.saved_free;
+        if (copy != -1) {
+            fs.saved_free = fs.saved[copy].next;
+        } else {
+            copy = fs.saved_used++;
+        }
+        SavedEntry* saved = &fs.saved[copy];
+        saved->entry = fs.files[file_index];
+        saved->slot = file_index;
+        saved->epoch = snap->epoch;
+        saved->next = head;
+        saved->snap_next = snap->first_saved;
+        fs.saved_head[file_index] = copy + 1;
+        snap->first_saved = copy;
+        snap->num_saved++;
+    }
+    write_unlock(&fs.snap_lock);
+}
+
+// Add a file to the name index, setting its key
+void index_file(int file_index) {
+    FileMetadata* file = &fs.files[file_index];
+    FileKey* key = &fs.file_keys[file_index];
+    int bucket = name_bucket(file->parent_dir, file->name_hash);
+    write_lock(bucket_lock(bucket));
+    key->name_hash = file->name_hash;
+    key->parent_dir = file->parent_dir;
+    key->in_use = 1;
+    fs.name_tags[file_index] = name_tag(file->name_hash, strlen(file->filename));
+    key->hash_next = fs.name_index[bucket];
+    fs.name_index[bucket] = file_index;
+    write_unlock(bucket_lock(bucket));
+}
+
+// Remove a file from the name index, clearing its key
+void unindex_file(int file_index) {
+    FileKey* key = &fs.file_keys[file_index];
+    int bucket = name_bucket(key->parent_dir, key->name_hash);
+    write_lock(bucket_lock(bucket));
+    int* link = &fs.name_index[bucket];
+    while (*link != -1) {
+        if (*link == file_index) {
+            *link = key->hash_next;
+            break;
+        }
+        link = &fs.file_keys[*link].hash_next;
+    }
+    memset(key, 0, sizeof(FileKey));
+    fs.name_tags[file_index] = 0;
+    write_unlock(bucket_lock(bucket));
+}
+
+// Double the name index until it has at least two buckets per file slot
+// Returns 0, or -1 if the system is out of memory.
+int grow_name_index() {
+    int buckets = fs.name_buckets;
+    while (buckets < 2 * fs.num_slots) buckets *= 2;
+    if (buckets == fs.name_buckets) return 0;
+    if (commit_memory(fs.name_index, buckets * sizeof(int)) != 0) return -1;
+    fs.name_buckets = buckets;
+    for (int i = 0; i < buckets; i++) {
+        fs.name_index[i] = -1;
+    }
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.file_keys[i].in_use) {
+            index_file(i);
+        }
+    }
+    return 0;
+}
+
+// Add FILE_CHUNK entries to the file table, up to max_files.
+// Returns 0, or -1 if the table can't grow.
+int grow_file_table() {
+    int slots = fs.num_slots + FILE_CHUNK;
+    if (slots > fs.max_files) slots = fs.max_files;
+    if (slots == fs.num_slots ||
+        commit_memory(fs.files, slots * sizeof(FileMetadata)) != 0 ||
+        commit_memory(fs.file_keys, slots * sizeof(FileKey)) != 0 ||
+        commit_memory(fs.name_tags, slots * sizeof(unsigned int)) != 0) {
+        return -1;
+    }
+    fs.num_slots = slots;
+    return grow_name_index();
+}
+
+// Append a file to the children of its parent directory
+void link_child(int file_index) {
+    FileMetadata* file = &fs.files[file_index];
+    FileMetadata* dir = &fs.files[file->parent_dir];
+    save_entry(file_index);
+    save_entry(file->parent_dir);
+    if (dir->last_child != -1) save_entry(dir->last_child);
+    file->prev_sibling = dir->last_child;
+    file->next_sibling = -1;
+    if (dir->last_child != -1) {
+        fs.files[dir->last_child].next_sibling = file_index;
+    } else {
+        dir->first_child = file_index;
+    }
+    dir->last_child = file_index;
+}
+
+// Remove a file from the children of its parent directory
+void unlink_child(int file_index) {
+    FileMetadata* file = &fs.files[file_index];
+    FileMetadata* dir = &fs.files[file->parent_dir];
+    save_entry(file->parent_dir);
+    if (file->prev_sibling != -1) save_entry(file->prev_sibling);
+    if (file->next_sibling != -1) save_entry(file->next_sibling);
+    if (file->prev_sibling != -1) {
+        fs.files[file->prev_sibling].next_sibling = file->next_sibling;
+    } else {
+        dir->first_child = file->next_sibling;
+    }
+    if (file->next_sibling != -1) {
+        fs.files[file->next_sibling].prev_sibling = file->prev_sibling;
+    } else {
+        dir->last_child = file->prev_sibling;
+    }
+}
+
+// Nanoseconds on a steady clock, for timing. Counted from boot, so a
+// double keeps them exact.
+double now_ns() {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return counter.QuadPart * (1e9 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+// Operation statistics. Each thread counts into a slot of its own, so
+// counting takes no lock and shares no cache line; only the threads past
+// MAX_THREAD_SLOTS share the last slot, with atomic adds. One call of each
+// operation in STATS_SAMPLING is timed into the latency histogram.
+
+_Thread_local int thread_slot_index = -1;
+_Thread_local unsigned int thread_slot_serial;  // fs.serial it belongs to
+_Thread_local unsigned int stats_ticks[NUM_OPS];
+
+// Slot of the calling thread in the per-thread tables, -1 once all are taken
+int thread_slot() {
+    if (thread_slot_serial != fs.serial) {
+        int slot = __atomic_fetch_add(&fs.thread_slots_used, 1, __ATOMIC_RELAXED);
+        thread_slot_index = (slot < MAX_THREAD_SLOTS) ? slot : -1;
+        thread_slot_serial = fs.serial;
+    }
+    return thread_slot_index;
+}
+
+// Number of thread slots handed out
+int thread_slots() {
+    int used = __atomic_load_n(&fs.thread_slots_used, __ATOMIC_RELAXED);
+    return used < MAX_THREAD_SLOTS ? used : MAX_THREAD_SLOTS;
+}
+
+// Add to a counter only the calling thread writes; others may read it
+void add_own_counter(long long* counter, long long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+// Start a call of an operation. Returns the time to pass to count_op(),
+// 0 if this call is not timed.
+double start_timing(int op) {
+    return (stats_ticks[op]++ & (STATS_SAMPLING - 1)) == 0 ? now_ns() : 0;
+}
+
+// Count a call of an operation, with the bytes it moved
+void count_op(int op, double start, long long bytes, int failed) {
+    int slot = thread_slot();
+    OpStats* stats = &fs.op_stats[slot == -1 ? MAX_THREAD_SLOTS : slot][op];
+    void (*add)(long long*, long long) = (slot == -1) ? add_counter : add_own_counter;
+    add(&stats->count, 1);
+    if (bytes > 0) add(&stats->bytes, bytes);
+    if (failed) add(&stats->failures, 1);
+    if (start == 0) return;
+
+    long long elapsed = (long long)(now_ns() - start);
+    if (elapsed < 1) elapsed = 1;
+    int bucket = 63 - __builtin_clzll((unsigned long long)elapsed);
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    add(&stats->timed, 1);
+    add(&stats->time_ns, elapsed);
+    add(&stats->latency[bucket], 1);
+    long long max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&stats->max_ns, &max, elapsed, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// Add up the statistics of an operation over all threads
+void sum_op_stats(int op, OpStats* total) {
+    memset(total, 0, sizeof(OpStats));
+    for (int slot = 0; slot <= MAX_THREAD_SLOTS; slot++) {
+        long long* from = (long long*)&fs.op_stats[slot][op];
+        long long* to = (long long*)total;
+        for (size_t i = 0; i < sizeof(OpStats) / sizeof(long long); i++) {
+            long long value = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+            if (&to[i] == &total->max_ns) {
+                if (value > to[i]) to[i] = value;
+            } else {
+                to[i] += value;
+            }
+        }
+    }
+}
+
+// Upper bound of the latency under which a fraction of the timed calls fall
+long long latency_percentile(const OpStats* stats, double fraction) {
+    long long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += stats->latency[bucket];
+        if (seen > 0 && seen >= fraction * stats->timed) {
+            long long bound = 2LL << bucket;
+            return bound < stats->max_ns ? bound : stats->max_ns;
+        }
+    }
+    return 0;
+}
+
+// Free-space manager: a bitmap of used blocks plus the free extents kept in
+// two treaps, one ordered by start block (to merge neighbours on free) and
+// one by (length, start) for best-fit allocation.
+
+// Mark a range of blocks used or free, a 64-bit word at a time
+void set_block_bits(int start, int count, int used) {
+    int end = start + count;
+    while (start < end) {
+        int bit = start % 64;
+        int n = (end - start < 64 - bit) ? end - start : 64 - bit;
+        unsigned long long mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+        if (used) {
+            fs.block_bitmap[start / 64] |= mask;
+            if (fs.block_birth) {
+                for (int i = 0; i < n; i++) fs.block_birth[start + i] = fs.epoch;
+            }
+        } else {
+            fs.block_bitmap[start / 64] &= ~mask;
+        }
+        start += n;
+    }
+}
+
+// Treap priority of an extent node (derived from its index)
+unsigned int extent_priority(int node) {
+    unsigned int x = (unsigned int)node + 1;
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Does node sort before the key (start, length) in the given tree?
+int extent_before(int tree, int node, int start, int length) {
+    FreeExtent* e = &fs.free_extents[node];
+    if (tree == BY_SIZE && e->length != length) {
+        return e->length < length;
+    }
+    return e->start < start;
+}
+
+// Split a tree into the nodes before (start, length) and the others
+void extent_split(int tree, int t, int start, int length, int* left, int* right) {
+    if (t == -1) {
+        *left = *right = -1;
+        return;
+    }
+    if (extent_before(tree, t, start, length)) {
+        extent_split(tree, fs.free_extents[t].right[tree], start, length,
+                     &fs.free_extents[t].right[tree], right);
+        *left = t;
+    } else {
+        extent_split(tree, fs.free_extents[t].left[tree], start, length,
+                     left, &fs.free_extents[t].left[tree]);
+        *right = t;
+    }
+}
+
+// Join two trees where every node of a sorts before every node of b
+int extent_merge(int tree, int a, int b) {
+    if (a == -1) return b;
+    if (b == -1) return a;
+    if (extent_priority(a) > extent_priority(b)) {
+        fs.free_extents[a].right[tree] = extent_merge(tree, fs.free_extents[a].right[tree], b);
+        return a;
+    }
+    fs.free_extents[b].left[tree] = extent_merge(tree, a, fs.free_extents[b].left[tree]);
+    return b;
+}
+
+void extent_insert(int tree, int node) {
+    int left, right;
+    fs.free_extents[node].left[tree] = fs.free_extents[node].right[tree] = -1;
+    extent_split(tree, fs.extent_root[tree], fs.free_extents[node].start,
+                 fs.free_extents[node].length, &left, &right);
+    fs.extent_root[tree] = extent_merge(tree, extent_merge(tree, left, node), right);
+}
+
+void extent_remove(int tree, int node) {
+    int left, middle, right;
+    int start = fs.free_extents[node].start;
+    int length = fs.free_extents[node].length;
+    extent_split(tree, fs.extent_root[tree], start, length, &left, &right);
+    extent_split(tree, right, start + 1, length, &middle, &right);
+    fs.extent_root[tree] = extent_merge(tree, left, right);
+}
+
+int new_extent_node(int start, int length) {
+    int node = fs.free_extent_node;
+    if (node != -1) {
+        fs.free_extent_node = fs.free_extents[node].left[BY_START];
+    } else {
+        if (fs.extent_nodes_used == fs.extent_nodes_committed) {
+            int committed = fs.extent_nodes_committed + EXTENT_NODE_CHUNK;
+            int max_nodes = fs.num_blocks / 2 + 1;  // Free extents can't touch
+            if (committed > max_nodes) committed = max_nodes;
+            if (commit_memory(fs.free_extents, committed * sizeof(FreeExtent)) != 0) {
+                printf("Error: Out of memory for the free space map\n");
+                exit(1);
+            }
+            fs.extent_nodes_committed = committed;
+        }
+        node = fs.extent_nodes_used++;
+    }
+    fs.free_extents[node].start = start;
+    fs.free_extents[node].length = length;
+    extent_insert(BY_START, node);
+    extent_insert(BY_SIZE, node);
+    fs.num_free_extents++;
+    return node;
+}
+
+void delete_extent_node(int node) {
+    extent_remove(BY_START, node);
+    extent_remove(BY_SIZE, node);
+    fs.free_extents[node].left[BY_START] = fs.free_extent_node;
+    fs.free_extent_node = node;
+    fs.num_free_extents--;
+}
+
+// Change the range of a free extent whose place in start order is unchanged
+void resize_extent_node(int node, int start, int length) {
+    extent_remove(BY_SIZE, node);
+    fs.free_extents[node].start = start;
+    fs.free_extents[node].length = length;
+    extent_insert(BY_SIZE, node);
+}
+
+// Last free extent starting at or before block, -1 if none
+int extent_at_or_before(int block) {
+    int found = -1;
+    int t = fs.extent_root[BY_START];
+    while (t != -1) {
+        if (fs.free_extents[t].start <= block) {
+            found = t;
+            t = fs.free_extents[t].right[BY_START];
+        } else {
+            t = fs.free_extents[t].left[BY_START];
+        }
+    }
+    return found;
+}
+
+// Allocate the smallest free run of at least count blocks.
+// Returns its first block, or -1 if no run is long enough.
+int alloc_blocks(int count) {
+    double start_time = start_timing(OP_ALLOC);
+    int best = -1;
+    int steps = 0;
+    int t = fs.extent_root[BY_SIZE];
+    while (t != -1) {
+        steps++;
+        if (fs.free_extents[t].length >= count) {
+            best = t;
+            t = fs.free_extents[t].left[BY_SIZE];
+        } else {
+            t = fs.free_extents[t].right[BY_SIZE];
+        }
+    }
+
+    int start = -1;
+    if (best != -1 && grow_blocks(fs.free_extents[best].start + count) != 0) {
+        best = -1;
+    }
+    if (best != -1) {
+        start = fs.free_extents[best].start;
+        if (fs.free_extents[best].length == count) {
+            delete_extent_node(best);
+        } else {
+            resize_extent_node(best, start + count, fs.free_extents[best].length - count);
+        }
+        set_block_bits(start, count, 1);
+        fs.free_block_count -= count;
+    }
+
+    fs.alloc_scan_steps += steps;
+    if (steps > fs.alloc_scan_max) fs.alloc_scan_max = steps;
+    count_op(OP_ALLOC, start_time, (long long)count * fs.block_size, start == -1);
+    return start;
+}
+
+// Allocate a given free range, e.g. to restore blocks just released.
+// Returns 0, or -1 if part of the range is in use.
+int claim_blocks(int start, int count) {
+    int node = extent_at_or_before(start);
+    if (node == -1) return -1;
+    int ext_start = fs.free_extents[node].start;
+    int ext_end = ext_start + fs.free_extents[node].length;
+    if (start + count > ext_end) return -1;
+
+    if (ext_start == start && ext_end == start + count) {
+        delete_extent_node(node);
+    } else if (ext_start == start) {
+        resize_extent_node(node, start + count, ext_end - start - count);
+    } else {
+        resize_extent_node(node, ext_start, start - ext_start);
+        if (start + count < ext_end) {
+            new_extent_node(start + count, ext_end - start - count);
+        }
+    }
+    set_block_bits(start, count, 1);
+    fs.free_block_count -= count;
+    return 0;
+}
+
+// Length of the free run starting at block, 0 if the block is in use
+int free_run_at(int block) {
+    int node = extent_at_or_before(block);
+    if (node == -1) return 0;
+    int end = fs.free_extents[node].start + fs.free_extents[node].length;
+    return end > block ? end - block : 0;
+}
+
+// Return a range of blocks to the free space, merging it with its neighbours
+void free_blocks(int start, int count) {
+    if (count <= 0) return;
+    set_block_bits(start, count, 0);
+    fs.free_block_count += count;
+
+    int before = extent_at_or_before(start - 1);
+    if (before != -1 &&
+        fs.free_extents[before].start + fs.free_extents[before].length != start) {
+        before = -1;
+    }
+    int after = extent_at_or_before(start + count);
+    if (after != -1 && fs.free_extents[after].start != start + count) {
+        after = -1;
+    }
+
+    if (before != -1 && after != -1) {
+        int length = fs.free_extents[before].length + count + fs.free_extents[after].length;
+        delete_extent_node(after);
+        resize_extent_node(before, fs.free_extents[before].start, length);
+    } else if (before != -1) {
+        resize_extent_node(before, fs.free_extents[before].start,
+                           fs.free_extents[before].length + count);
+    } else if (after != -1) {
+        resize_extent_node(after, start, fs.free_extents[after].length + count);
+    } else {
+        new_extent_node(start, count);
+    }
+}
+
+// Keep a range of blocks for a snapshot, merged with the last range it
+// holds if they touch. alloc_lock is held.
+void hold_blocks(Snapshot* snap, int start, int count) {
+    Extent* last = snap->num_held ? &snap->held[snap->num_held - 1] : NULL;
+    snap->held_blocks += count;
+    if (last && last->start + last->length == start) {
+        last->length += count;
+        return;
+    }
+    if (snap->num_held == snap->held_capacity) {
+        int capacity = snap->held_capacity ? 2 * snap->held_capacity : 16;
+        Extent* held = realloc(snap->held, capacity * sizeof(Extent));
+        if (!held) {
+            printf("Error: Out of memory for the snapshots\n");
+            exit(1);
+        }
+        snap->held = held;
+        snap->held_capacity = capacity;
+    }
+    snap->held[snap->num_held].start = start;
+    snap->held[snap->num_held].length = count;
+    snap->num_held++;
+}
+
+// Free a range of blocks, but hold for a snapshot those allocated before
+// it was taken. alloc_lock is held.
+void hold_or_free(Snapshot* snap, int start, int count) {
+    int end = start + count;
+    while (start < end) {
+        int frozen = fs.block_birth[start] <= snap->epoch;
+        int run = 1;
+        while (start + run < end && (fs.block_birth[start + run] <= snap->epoch) == frozen) {
+            run++;
+        }
+        if (frozen) {
+            hold_blocks(snap, start, run);
+        } else {
+            free_blocks(start, run);
+        }
+        start += run;
+    }
+}
+
+// Free a range of blocks no file uses any more, but those the newest
+// snapshot may use, which are held for it. alloc_lock is held.
+void retire_blocks(int start, int count) {
+    if (fs.num_snapshots == 0) {
+        free_blocks(start, count);
+    } else {
+        hold_or_free(&fs.snapshots[fs.num_snapshots - 1], start, count);
+    }
+}
+
+// Length of the largest free run
+int largest_free_run() {
+    int t = fs.extent_root[BY_SIZE];
+    if (t == -1) return 0;
+    while (fs.free_extents[t].right[BY_SIZE] != -1) {
+        t = fs.free_extents[t].right[BY_SIZE];
+    }
+    return fs.free_extents[t].length;
+}
+
+// Allocation cache of the calling thread, NULL once all caches are taken
+AllocCache* thread_alloc_cache() {
+    int slot = thread_slot();
+    return slot == -1 ? NULL : &fs.alloc_caches[slot];
+}
+
+// Allocate count blocks from the calling thread's cache, refilling it with
+// a new run when it is short. Caches are only filled while the volume has
+// plenty of free space, so they never hold the last free blocks.
+// Returns the first block, or -1 if the cache can't serve the request.
+int cache_alloc(int count) {
+    AllocCache* cache = thread_alloc_cache();
+    if (!cache || count > ALLOC_CACHE_BLOCKS) return -1;
+    if (cache->length < count) {
+        write_lock(&fs.alloc_lock);
+        if (cache->length > 0) {
+            free_blocks(cache->start, cache->length);
+            cache->length = 0;
+        }
+        if (fs.free_block_count >= ALLOC_CACHE_BLOCKS * MAX_THREAD_SLOTS) {
+            cache->start = alloc_blocks(ALLOC_CACHE_BLOCKS);
+            cache->length = (cache->start == -1) ? 0 : ALLOC_CACHE_BLOCKS;
+        }
+        write_unlock(&fs.alloc_lock);
+        if (cache->length < count) return -1;
+    }
+    int start = cache->start;
+    cache->start += count;
+    cache->length -= count;
+    count_op(OP_CACHE_ALLOC, 0, (long long)count * fs.block_size, 0);
+    return start;
+}
+
+// Allocate one block, from the thread's cache if it can. Returns it, or
+// -1 if the volume is full.
+int alloc_block() {
+    int block = cache_alloc(1);
+    if (block == -1) {
+        write_lock(&fs.alloc_lock);
+        block = alloc_blocks(1);
+        write_unlock(&fs.alloc_lock);
+    }
+    return block;
+}
+
+// Allocate up to count blocks from the calling thread's cache if they
+// start at block, so a run can grow in place. Returns how many it got.
+int cache_extend(int block, int count) {
+    AllocCache* cache = thread_alloc_cache();
+    if (!cache || cache->length == 0 || cache->start != block) return 0;
+    if (count > cache->length) count = cache->length;
+    cache->start += count;
+    cache->length -= count;
+    return count;
+}
+
+// Give the blocks of every allocation cache back to the free space. No
+// operation may be running, e.g. table_lock is held exclusive.
+void drain_alloc_caches() {
+    for (int i = 0; i < thread_slots(); i++) {
+        if (fs.alloc_caches[i].length > 0) {
+            free_blocks(fs.alloc_caches[i].start, fs.alloc_caches[i].length);
+            fs.alloc_caches[i].length = 0;
+        }
+    }
+}
+
+// Print free space and fragmentation metrics
+void print_free_space() {
+    write_lock(&fs.alloc_lock);
+    int largest = largest_free_run();
+    int cached = 0;
+    for (int i = 0; i < thread_slots(); i++) {
+        cached += fs.alloc_caches[i].length;
+    }
+    if (fs.cache_frames > 0) {
+        printf("\nBlocks: %d total, %d free (%d bytes each), %d cached in memory\n",
+               fs.num_blocks, fs.free_block_count, fs.block_size, fs.cache_frames);
+    } else {
+        printf("\nBlocks: %d total, %d free (%d bytes each), %d backed by memory\n",
+               fs.num_blocks, fs.free_block_count, fs.block_size, fs.blocks_committed);
+    }
+    printf("Files: %d used, %d slots, %d max\n",
+           fs.num_files, fs.num_slots, fs.max_files);
+    printf("Free extents: %d, largest free run: %d blocks\n",
+           fs.num_free_extents, largest);
+    printf("Fragmentation: %.1f%%\n", fs.free_block_count == 0 ? 0.0 :
+           100.0 * (1.0 - (double)largest / fs.free_block_count));
+    OpStats allocs;
+    sum_op_stats(OP_ALLOC, &allocs);
+    printf("Allocations: %lld, failed: %lld, avg latency: %.0f ns, max: %lld ns\n",
+           allocs.count, allocs.failures,
+           allocs.timed ? (double)allocs.time_ns / allocs.timed : 0.0, allocs.max_ns);
+    if (cached > 0) {
+        printf("Thread caches: %d, %d blocks set aside\n", thread_slots(), cached);
+    }
+    write_unlock(&fs.alloc_lock);
+}
+
+// Iterate over the runs of a file
+void start_extents(ExtentIter* it, const FileMetadata* file) {
+    it->file = file;
+    it->n = 0;
+    it->block = file->indirect_block;
+}
+
+// Get the next run of a file, returns 0 once all runs were visited
+int next_extent(ExtentIter* it, Extent* extent) {
+    if (it->n >= it->file->num_extents) return 0;
+    if (it->n < INLINE_EXTENTS) {
+        *extent = it->file->extents[it->n];
+    } else {
+        int slot = (it->n - INLINE_EXTENTS) % INDIRECT_EXTENTS;
+        if (slot == 0 && it->n > INLINE_EXTENTS) {
+            load_blocks(it->block, 1, 0, &it->block, sizeof(int));
+        }
+        load_blocks(it->block, 1, INDIRECT_HEADER + slot * sizeof(Extent), extent,
+                    sizeof(Extent));
+    }
+    it->n++;
+    return 1;
+}
+
+// Hash of one block's content for deduplication, in the manner of XXH3:
+// eight 64-bit lanes each take 8 of every 64 bytes, mixed with a key by
+// 32x32-bit multiplies, which SSE2 does for two lanes at once
+const unsigned long long hash_key[8] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull,
+    0x1f67b3b7a4a44072ull, 0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull,
+    0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull
+};
+
+#ifdef __SSE2__
+void hash_stripes(unsigned long long* acc, const char* data, size_t stripes) {
+    __m128i lanes[4];
+    __m128i keys[4];
+    for (int i = 0; i < 4; i++) {
+        lanes[i] = _mm_loadu_si128((const __m128i*)acc + i);
+        keys[i] = _mm_loadu_si128((const __m128i*)hash_key + i);
+    }
+    for (size_t s = 0; s < stripes; s++, data += 64) {
+        for (int i = 0; i < 4; i++) {
+            __m128i d = _mm_loadu_si128((const __m128i*)data + i);
+            __m128i dk = _mm_xor_si128(d, keys[i]);
+            __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+            __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*)acc + i, lanes[i]);
+    }
+}
+#else
+void hash_stripes(unsigned long long* acc, const char* data, size_t stripes) {
+    for (size_t s = 0; s < stripes; s++, data += 64) {
+        for (int i = 0; i < 8; i++) {
+            unsigned long long d;
+            memcpy(&d, data + 8 * i, sizeof(d));
+            unsigned long long dk = d ^ hash_key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (dk & 0xffffffffull) * (dk >> 32);
+        }
+    }
+}
+#endif
+
+unsigned long long hash_block(const char* data, size_t length) {
+    unsigned long long acc[8] = {
+        0xc2b2ae3d, 0x9e3779b185ebca87ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull,
+        0x85ebca77c2b2ae63ull, 0x85ebca77, 0x27d4eb2f165667c5ull, 0x9e3779b1
+    };
+    size_t stripes = length / 64;
+    hash_stripes(acc, data, stripes);
+    if (length % 64 != 0) {
+        char tail[64] = {0};
+        memcpy(tail, data + stripes * 64, length % 64);
+        hash_stripes(acc, tail, 1);
+    }
+    unsigned long long h = length * 0x9e3779b185ebca87ull;
+    for (int i = 0; i < 8; i++) {
+        h ^= acc[i] * 0xc2b2ae3d27d4eb4full;
+        h = (h << 31 | h >> 33) * 0x9e3779b185ebca87ull;
+    }
+    h ^= h >> 29;
+    h *= 0x165667b19e3779f9ull;
+    return h ^ (h >> 32);
+}
+
+// The dedup index holds the blocks of the deduplicated files (those with
+// FILE_DEDUP), found by content hash or by block number, with the number
+// of references to each. It lives in memory only: build_dedup_index()
+// makes it again from the file table when a volume is opened. Its
+// functions are called with dedup_lock held, or while opening.
+int dedup_block_bucket(int block) {
+    return (int)(((unsigned int)block * 2654435761u) & (unsigned int)fs.dedup_bucket_mask);
+}
+
+int dedup_hash_bucket(unsigned long long hash) {
+    return (int)(hash & (unsigned long long)fs.dedup_bucket_mask);
+}
+
+void free_dedup_index() {
+    free(fs.dedup_entries);
+    free(fs.dedup_by_hash);
+    free(fs.dedup_by_block);
+    fs.dedup_entries = NULL;
+    fs.dedup_by_hash = NULL;
+    fs.dedup_by_block = NULL;
+    fs.dedup_capacity = 0;
+    fs.dedup_used = 0;
+    fs.dedup_blocks = 0;
+    fs.dedup_refs = 0;
+}
+
+// Double the entries and buckets of the index once all entries are used.
+// Returns 0, or -1 if out of memory.
+int grow_dedup_index() {
+    int capacity = fs.dedup_capacity ? fs.dedup_capacity * 2 : DEDUP_MIN_ENTRIES;
+    DedupEntry* entries = realloc(fs.dedup_entries, capacity * sizeof(DedupEntry));
+    if (entries) fs.dedup_entries = entries;
+    int* by_hash = malloc(capacity * sizeof(int));
+    int* by_block = malloc(capacity * sizeof(int));
+    if (!entries || !by_hash || !by_block) {
+        free(by_hash);
+        free(by_block);
+        return -1;
+    }
+    if (fs.dedup_capacity == 0) fs.dedup_free = -1;
+    free(fs.dedup_by_hash);
+    free(fs.dedup_by_block);
+    fs.dedup_by_hash = by_hash;
+    fs.dedup_by_block = by_block;
+    fs.dedup_capacity = capacity;
+    fs.dedup_bucket_mask = capacity - 1;
+    for (int i = 0; i < capacity; i++) {
+        by_hash[i] = by_block[i] = -1;
+    }
+    for (int i = 0; i < fs.dedup_used; i++) {  // All in use, see dedup_add()
+        DedupEntry* entry = &entries[i];
+        int h = dedup_hash_bucket(entry->hash);
+        int b = dedup_block_bucket(entry->block);
+        entry->hash_next = by_hash[h];
+        entry->block_next = by_block[b];
+        by_hash[h] = by_block[b] = i;
+    }
+    return 0;
+}
+
+// Entry of a block, -1 if it is not in the index
+int dedup_find_block(int block) {
+    if (fs.dedup_capacity == 0) return -1;
+    int i = fs.dedup_by_block[dedup_block_bucket(block)];
+    while (i != -1 && fs.dedup_entries[i].block != block) {
+        i = fs.dedup_entries[i].block_next;
+    }
+    return i;
+}
+
+// 1 if a block holds block_size bytes of data; scratch has room for one
+int block_holds(int block, const char* data, char* scratch) {
+    if (fs.cache_frames == 0) return memcmp(block_data(block), data, fs.block_size) == 0;
+    if (load_blocks(block, 1, 0, scratch, fs.block_size) != 0) return 0;
+    return memcmp(scratch, data, fs.block_size) == 0;
+}
+
+// Take one more reference to a block of the index holding data, which
+// hashes to hash. Returns the block, or -1 if there is none.
+int dedup_share(unsigned long long hash, const char* data, char* scratch) {
+    if (fs.dedup_capacity == 0) return -1;
+    for (int i = fs.dedup_by_hash[dedup_hash_bucket(hash)]; i != -1;
+         i = fs.dedup_entries[i].hash_next) {
+        DedupEntry* entry = &fs.dedup_entries[i];
+        if (entry->hash == hash && block_holds(entry->block, data, scratch)) {
+            entry->refs++;
+            fs.dedup_refs++;
+            return entry->block;
+        }
+    }
+    return -1;
+}
+
+// Add a block to the index with one reference. Returns 0, or -1 if out of
+// memory; the block is then private to its file, as if not deduplicated.
+int dedup_add(unsigned long long hash, int block) {
+    if ((fs.dedup_capacity == 0 ||
+         (fs.dedup_free == -1 && fs.dedup_used == fs.dedup_capacity)) &&
+        grow_dedup_index() != 0) {
+        return -1;
+    }
+    int i = fs.dedup_free;
+    if (i != -1) {
+        fs.dedup_free = fs.dedup_entries[i].hash_next;
+    } else {
+        i = fs.dedup_used++;
+    }
+    DedupEntry* entry = &fs.dedup_entries[i];
+    int h = dedup_hash_bucket(hash);
+    int b = dedup_block_bucket(block);
+    entry->hash = hash;
+    entry->block = block;
+    entry->refs = 1;
+    entry->hash_next = fs.dedup_by_hash[h];
+    entry->block_next = fs.dedup_by_block[b];
+    fs.dedup_by_hash[h] = fs.dedup_by_block[b] = i;
+    fs.dedup_blocks++;
+    fs.dedup_refs++;
+    return 0;
+}
+
+// Drop one reference to a block. Returns 1 if it was the last, so the
+// block is to be freed; its entry is then removed.
+int dedup_release(int block) {
+    if (fs.dedup_capacity == 0) return 1;
+    int* link = &fs.dedup_by_block[dedup_block_bucket(block)];
+    while (*link != -1 && fs.dedup_entries[*link].block != block) {
+        link = &fs.dedup_entries[*link].block_next;
+    }
+    if (*link == -1) return 1;  // Not in the index: private to its file
+    int i = *link;
+    DedupEntry* entry = &fs.dedup_entries[i];
+    fs.dedup_refs--;
+    if (--entry->refs > 0) return 0;
+
+    *link = entry->block_next;
+    link = &fs.dedup_by_hash[dedup_hash_bucket(entry->hash)];
+    while (*link != i) {
+        link = &fs.dedup_entries[*link].hash_next;
+    }
+    *link = entry->hash_next;
+    entry->hash_next = fs.dedup_free;
+    fs.dedup_free = i;
+    fs.dedup_blocks--;
+    return 1;
+}
+
+// Drop one reference to each block of a run, freeing together those
+// that had their last. alloc_lock is held too.
+void release_shared_run(int start, int length) {
+    int first = -1;  // First of the blocks to free, -1 if none yet
+    for (int block = start; block <= start + length; block++) {
+        int last = block < start + length && dedup_release(block);
+        if (last && first == -1) first = block;
+        if (!last && first != -1) {
+            retire_blocks(first, block - first);
+            first = -1;
+        }
+    }
+}
+
+// Count one more reference to a block of a deduplicated file, adding it
+// to the index if it is not there. Returns 1 if it was added.
+int index_block(int block, char* scratch) {
+    int i = dedup_find_block(block);
+    if (i != -1) {
+        fs.dedup_entries[i].refs++;
+        fs.dedup_refs++;
+        return 0;
+    }
+    load_blocks(block, 1, 0, scratch, fs.block_size);
+    dedup_add(hash_block(scratch, fs.block_size), block);
+    return 1;
+}
+
+// Make the index from the blocks of the deduplicated files
+void build_dedup_index() {
+    free_dedup_index();
+    char* scratch = malloc(fs.block_size);
+    if (!scratch) return;
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (!fs.file_keys[i].in_use || !(fs.files[i].flags & FILE_DEDUP)) continue;
+        ExtentIter it;
+        Extent extent;
+        start_extents(&it, &fs.files[i]);
+        while (next_extent(&it, &extent)) {
+            for (int block = extent.start; block < extent.start + extent.length; block++) {
+                index_block(block, scratch);
+            }
+        }
+    }
+    free(scratch);
+}
+
+// Free every block of a file, its runs and its indirect blocks. Those of
+// a deduplicated file are only freed with their last reference, and those
+// a snapshot uses are held for it (see retire_blocks).
+void release_file_blocks(const FileMetadata* file) {
+    ExtentIter it;
+    Extent extent;
+    int shared = (file->flags & FILE_DEDUP) != 0;
+    if (shared) write_lock(&fs.dedup_lock);
+    write_lock(&fs.alloc_lock);
+    start_extents(&it, file);
+    while (next_extent(&it, &extent)) {
+        if (shared) {
+            release_shared_run(extent.start, extent.length);
+        } else {
+            retire_blocks(extent.start, extent.length);
+        }
+    }
+    int block = file->indirect_block;
+    while (block != -1) {
+        int next;
+        load_blocks(block, 1, 0, &next, sizeof(int));
+        retire_blocks(block, 1);
+        block = next;
+    }
+    write_unlock(&fs.alloc_lock);
+    if (shared) write_unlock(&fs.dedup_lock);
+}
+
+// Allocate again the blocks of a file released by release_file_blocks()
+void claim_file_blocks(const FileMetadata* file) {
+    ExtentIter it;
+    Extent extent;
+    start_extents(&it, file);
+    while (next_extent(&it, &extent)) {
+        claim_blocks(extent.start, extent.length);
+    }
+    int block = file->indirect_block;
+    while (block != -1) {
+        claim_blocks(block, 1);
+        load_blocks(block, 1, 0, &block, sizeof(int));
+    }
+}
+
+// Make the bitmap and free extents again from the blocks the files use
+// and the snapshots hold, e.g. to reclaim blocks left used by a crash.
+// No operation may be running.
+void rebuild_free_space() {
+    unsigned int* births = fs.block_birth;  // Marking blocks used keeps them
+    fs.block_birth = NULL;
+    memset(fs.block_bitmap, 0, (size_t)(fs.num_blocks + 63) / 64 * sizeof(unsigned long long));
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (!fs.file_keys[i].in_use) continue;
+        ExtentIter it;
+        Extent extent;
+        start_extents(&it, &fs.files[i]);
+        while (next_extent(&it, &extent)) {
+            set_block_bits(extent.start, extent.length, 1);
+        }
+        for (int block = fs.files[i].indirect_block; block != -1; ) {
+            set_block_bits(block, 1, 1);
+            load_blocks(block, 1, 0, &block, sizeof(int));
+        }
+    }
+    for (int k = 0; k < fs.num_snapshots; k++) {
+        for (int i = 0; i < fs.snapshots[k].num_held; i++) {
+            set_block_bits(fs.snapshots[k].held[i].start, fs.snapshots[k].held[i].length, 1);
+        }
+    }
+    fs.block_birth = births;
+
+    fs.extent_root[BY_START] = fs.extent_root[BY_SIZE] = -1;
+    fs.free_extent_node = -1;
+    fs.extent_nodes_used = 0;
+    fs.num_free_extents = 0;
+    fs.free_block_count = 0;
+    for (int block = 0; block < fs.num_blocks; ) {
+        int start = block;
+        while (block < fs.num_blocks && !(fs.block_bitmap[block / 64] >> (block % 64) & 1)) {
+            block++;
+        }
+        if (block > start) {
+            free_blocks(start, block - start);
+        } else {
+            block++;
+        }
+    }
+}
+
+// Delete every snapshot, freeing the blocks they hold
+void drop_snapshots() {
+    for (int k = 0; k < fs.num_snapshots; k++) {
+        for (int i = 0; i < fs.snapshots[k].num_held; i++) {
+            free_blocks(fs.snapshots[k].held[i].start, fs.snapshots[k].held[i].length);
+        }
+        free(fs.snapshots[k].held);
+    }
+    fs.num_snapshots = 0;
+    free(fs.saved);
+    free(fs.saved_head);
+    free(fs.block_birth);
+    fs.saved = NULL;
+    fs.saved_head = NULL;
+    fs.block_birth = NULL;
+    fs.saved_capacity = fs.saved_used = 0;
+}
+
+// Allocate count blocks in as few runs as possible: the best fitting run if
+// one is long enough, otherwise the largest free runs first.
+// Returns the number of runs stored in extents, or -1 if the volume is full.
+int alloc_extents(int count, Extent* extents) {
+    if (count > fs.free_block_count) {
+        count_op(OP_ALLOC, 0, 0, 1);
+        return -1;
+    }
+    int n = 0;
+    while (count > 0) {
+        int largest = largest_free_run();
+        int length = count < largest ? count : largest;
+        extents[n].start = alloc_blocks(length);
+        if (extents[n].start == -1) {
+            // The reserved range could not grow: give back the runs taken
+            for (int k = 0; k < n; k++) free_blocks(extents[k].start, extents[k].length);
+            return -1;
+        }
+        extents[n].length = length;
+        count -= length;
+        n++;
+    }
+    return n;
+}
+
+// Number of indirect blocks needed to list n runs
+int indirect_blocks_for(int n) {
+    if (n <= INLINE_EXTENTS) return 0;
+    return (n - INLINE_EXTENTS + INDIRECT_EXTENTS - 1) / INDIRECT_EXTENTS;
+}
+
+// Copy the runs of a file and its indirect blocks into arrays of
+// num_extents and indirect_blocks_for(num_extents) entries
+void collect_extents(const FileMetadata* file, Extent* extents, int* indirect) {
+    ExtentIter it;
+    int n = 0;
+    start_extents(&it, file);
+    while (next_extent(&it, &extents[n])) {
+        n++;
+    }
+    for (int block = file->indirect_block; block != -1; ) {
+        *indirect++ = block;
+        load_blocks(block, 1, 0, &block, sizeof(int));
+    }
+}
+
+// Record the runs of a file, listing those past the inline ones in the
+// given indirect blocks (indirect_blocks_for(n) of them, already allocated)
+void store_extents(FileMetadata* file, const Extent* extents, int n, const int* indirect) {
+    int block = -1;
+    file->num_extents = n;
+    file->indirect_block = -1;
+    for (int i = 0; i < n; i++) {
+        if (i < INLINE_EXTENTS) {
+            file->extents[i] = extents[i];
+            continue;
+        }
+        int slot = (i - INLINE_EXTENTS) % INDIRECT_EXTENTS;
+        if (slot == 0) {
+            int next = *indirect++;
+            int none = -1;
+            store_blocks(next, 0, &none, sizeof(int));
+            if (block == -1) {
+                file->indirect_block = next;
+            } else {
+                store_blocks(block, 0, &next, sizeof(int));
+            }
+            block = next;
+        }
+        store_blocks(block, INDIRECT_HEADER + slot * sizeof(Extent), &extents[i],
+                     sizeof(Extent));
+    }
+}
+
+// Build the path of an entry into path (MAX_PATH bytes) and return its
+// length. Names are copied once each, from the end of the buffer back; a
+// path too long for MAX_PATH keeps its last components after "...".
+int build_path(int file_index, char* path) {
+    char buffer[MAX_PATH];
+    int start = MAX_PATH - 1;
+    buffer[start] = '\0';
+    for (int current = file_index; current != 0; current = fs.files[current].parent_dir) {
+        int length = (int)strnlen(fs.files[current].filename, MAX_FILENAME);
+        if (start - length - 1 < 3) {
+            start -= 3;
+            memcpy(buffer + start, "...", 3);
+            break;
+        }
+        start -= length;
+        memcpy(buffer + start, fs.files[current].filename, length);
+        buffer[--start] = '/';
+    }
+    if (file_index == 0) {
+        buffer[--start] = '/';
+    }
+    memcpy(path, buffer + start, MAX_PATH - start);
+    return MAX_PATH - 1 - start;
+}
+
+// Path of an entry, from the path cache if it was built since the last
+// removal. The string belongs to the cache: it is valid until the next
+// call and is not taken under path_lock, so this is only for the prompt
+// and pwd; everything else uses get_full_path().
+const char* cached_path(int file_index, int* length) {
+    PathCacheEntry* entry = &fs.path_cache[file_index & (PATH_CACHE_SIZE - 1)];
+    if (entry->length == 0 || entry->file_index != file_index ||
+        entry->generation != fs.path_generation) {
+        entry->file_index = file_index;
+        entry->generation = fs.path_generation;
+        entry->length = build_path(file_index, entry->path);
+    }
+    if (length) *length = entry->length;
+    return entry->path;
+}
+
+// Get the full path of a file
+void get_full_path(int file_index, char* path) {
+    int length;
+    write_lock(&fs.path_lock);
+    const char* cached = cached_path(file_index, &length);
+    memcpy(path, cached, length + 1);
+    write_unlock(&fs.path_lock);
+}
+
+// Find a file by its name in a directory
+int find_file_in_dir(const char* filename, int dir_index) {
+    size_t length = strlen(filename);
+    if (length >= MAX_FILENAME) return -1;
+    unsigned int name_hash = hash_name(filename);
+    unsigned int tag = name_tag(name_hash, length);
+    int bucket = name_bucket(dir_index, name_hash);
+    read_lock(bucket_lock(bucket));
+    int i = fs.name_index[bucket];
+    while (i != -1) {
+        // Only the tags and keys are read until one matches
+        if (fs.name_tags[i] == tag && fs.file_keys[i].parent_dir == dir_index &&
+            memcmp(fs.files[i].filename, filename, length) == 0) {
+            break;
+        }
+        i = fs.file_keys[i].hash_next;
+    }
+    read_unlock(bucket_lock(bucket));
+    return i;
+}
+
+// Check if a directory is empty
+int is_directory_empty(int dir_index) {
+    return fs.files[dir_index].first_child == -1;
+}
+
+int dentry_slot(int dir_index, unsigned int name_hash) {
+    unsigned int slot = name_hash ^ ((unsigned int)dir_index * 2654435761u);
+    return (int)(slot & (DENTRY_CACHE_SIZE - 1));
+}
+
+// Find a name in a directory, through the dentry cache. The caller holds
+// the directory's lock, so no entry of it comes or goes meanwhile.
+int lookup_name(const char* filename, int dir_index) {
+    unsigned int name_hash = hash_name(filename);
+    int slot = dentry_slot(dir_index, name_hash);
+    DentryCacheEntry* entry = &fs.dentry_cache[slot];
+    RwLock* lock = &fs.dentry_locks[slot & (LOCK_STRIPES - 1)];
+    write_lock(lock);
+    if (entry->parent_dir == dir_index && entry->name_hash == name_hash &&
+        entry->filename[0] != '\0' && strcmp(entry->filename, filename) == 0) {
+        int file_index = entry->file_index;
+        write_unlock(lock);
+        add_counter(&fs.dentry_hits, 1);
+        return file_index;
+    }
+    entry->parent_dir = dir_index;
+    entry->name_hash = name_hash;
+    entry->file_index = find_file_in_dir(filename, dir_index);
+    strcpy(entry->filename, filename);
+    int file_index = entry->file_index;
+    write_unlock(lock);
+    add_counter(&fs.dentry_misses, 1);
+    return file_index;
+}
+
+// Drop the cached lookup of a name once it is added or removed
+void forget_name(const FileMetadata* file) {
+    int slot = dentry_slot(file->parent_dir, file->name_hash);
+    DentryCacheEntry* entry = &fs.dentry_cache[slot];
+    RwLock* lock = &fs.dentry_locks[slot & (LOCK_STRIPES - 1)];
+    write_lock(lock);
+    if (entry->parent_dir == file->parent_dir && strcmp(entry->filename, file->filename) == 0) {
+        entry->filename[0] = '\0';
+    }
+    write_unlock(lock);
+}
+
+// Walk a path, absolute or relative to the current directory. With name,
+// the last component is not looked up but copied to name, and the
+// directory that would hold it is returned. Returns -1 if a component is
+// missing or not a directory, or if the path is invalid.
+int walk_path(const char* path, char* name) {
+    int dir_index = (path[0] == '/') ? 0 : fs.current_dir;
+    char component[MAX_FILENAME];
+    while (1) {
+        while (*path == '/') path++;
+        size_t length = strcspn(path, "/");
+        if (length == 0) return name ? -1 : dir_index;  // End of the path
+        if (length >= MAX_FILENAME || !fs.files[dir_index].is_directory) return -1;
+        memcpy(component, path, length);
+        component[length] = '\0';
+        path += length;
+
+        int is_dot = strcmp(component, ".") == 0 || strcmp(component, "..") == 0;
+        if (name && path[strspn(path, "/")] == '\0') {  // Last component
+            if (is_dot) return -1;
+            strcpy(name, component);
+            return dir_index;
+        }
+        if (strcmp(component, "..") == 0) {
+            dir_index = fs.files[dir_index].parent_dir;
+        } else if (!is_dot) {
+            read_lock(inode_lock(dir_index));
+            int next = lookup_name(component, dir_index);
+            read_unlock(inode_lock(dir_index));
+            if (next == -1) return -1;
+            dir_index = next;
+        }
+    }
+}
+
+// Index of the entry at a path, -1 if there is none
+int resolve_path(const char* path) {
+    double start = start_timing(OP_LOOKUP);
+    int file_index = walk_path(path, NULL);
+    count_op(OP_LOOKUP, start, 0, file_index == -1);
+    return file_index;
+}
+
+// Directory that holds (or would hold) the entry at a path, with the
+// entry's name copied to name. Returns -1 if there is no such directory.
+int resolve_parent(const char* path, char* name) {
+    double start = start_timing(OP_LOOKUP);
+    int dir_index = walk_path(path, name);
+    count_op(OP_LOOKUP, start, 0, dir_index == -1);
+    return dir_index;
+}
+
+// Check whether dir_index is file_index or one of its parents
+int is_ancestor(int dir_index, int file_index) {
+    while (file_index != 0 && file_index != dir_index) {
+        file_index = fs.files[file_index].parent_dir;
+    }
+    return file_index == dir_index;
+}
+
+// Fill a free slot of the file table and link it into its directory.
+// The caller holds slot_lock and the directory's lock.
+void add_file(int file_slot, int parent_dir, const char* filename,
+              int is_directory, time_t now) {
+    FileMetadata* file = &fs.files[file_slot];
+    save_entry(file_slot);
+    strncpy(file->filename, filename, MAX_FILENAME - 1);
+    file->size = 0;
+    file->created = now;
+    file->modified = now;
+    file->num_extents = 0;
+    file->indirect_block = -1;
+    file->num_blocks = 0;
+    file->flags = 0;
+    file->is_directory = is_directory;
+    file->parent_dir = parent_dir;
+    file->name_hash = hash_name(file->filename);
+    file->first_child = -1;
+    file->last_child = -1;
+    index_file(file_slot);
+    link_child(file_slot);
+    forget_name(file);
+    fs.num_files++;
+    fs.next_free_slot = (file_slot + 1) % fs.num_slots;
+}
+
+// Free the blocks of a file and clear its slot
+void remove_file(int file_index) {
+    save_entry(file_index);
+    release_file_blocks(&fs.files[file_index]);
+    forget_name(&fs.files[file_index]);
+    unlink_child(file_index);
+    unindex_file(file_index);
+    write_lock(&fs.slot_lock);
+    memset(&fs.files[file_index], 0, sizeof(FileMetadata));
+    fs.num_files--;
+    write_unlock(&fs.slot_lock);
+    write_lock(&fs.path_lock);
+    fs.path_generation++;  // The slot may come back with another path
+    write_unlock(&fs.path_lock);
+}
+
+// Remove a directory and everything below it
+void remove_tree(int dir_index) {
+    // Delete all files and subdirectories first
+    while (fs.files[dir_index].first_child != -1) {
+        int i = fs.files[dir_index].first_child;
+        if (fs.files[i].is_directory) {
+            remove_tree(i);
+        } else {
+            remove_file(i);
+        }
+    }
+
+    // Delete the directory itself
+    remove_file(dir_index);
+}
+
+// Give a file new runs of blocks and a new size
+void set_file_blocks(FileMetadata* file, const Extent* extents, int n,
+                     const int* indirect, size_t size, time_t now) {
+    save_entry((int)(file - fs.files));
+    store_extents(file, extents, n, indirect);
+    file->num_blocks = 0;
+    for (int i = 0; i < n; i++) {
+        file->num_blocks += extents[i].length;
+    }
+    file->size = size;
+    file->modified = now;
+}
+
+// Smallest power of two holding at least two buckets per file
+int name_buckets_for(int num_files) {
+    int buckets = 1;
+    while (buckets < 2 * num_files) buckets *= 2;
+    return buckets;
+}
+
+size_t align_page(size_t offset) {
+    return (offset + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+// Place the tables of a volume one after the other, each on its own pages.
+// Returns the total size of the volume in bytes.
+size_t layout_volume(int block_size, int num_blocks, int max_files, VolumeLayout* layout) {
+    size_t offset = align_page(sizeof(Superblock));
+    layout->files = offset;
+    offset = align_page(offset + (size_t)max_files * sizeof(FileMetadata));
+    layout->file_keys = offset;
+    offset = align_page(offset + (size_t)max_files * sizeof(FileKey));
+    layout->name_tags = offset;
+    offset = align_page(offset + (size_t)max_files * sizeof(unsigned int));
+    layout->name_index = offset;
+    offset = align_page(offset + (size_t)name_buckets_for(max_files) * sizeof(int));
+    layout->block_bitmap = offset;
+    offset = align_page(offset + (size_t)(num_blocks + 63) / 64 * sizeof(unsigned long long));
+    layout->free_extents = offset;
+    offset = align_page(offset + (size_t)(num_blocks / 2 + 1) * sizeof(FreeExtent));
+    layout->blocks = offset;
+    return offset + (size_t)num_blocks * block_size;
+}
+
+// Point the tables at their place in the volume
+void place_tables(char* base) {
+    VolumeLayout layout;
+    fs.volume = base;
+    fs.volume_size = layout_volume(fs.block_size, fs.num_blocks, fs.max_files, &layout);
+    fs.files = (FileMetadata*)(base + layout.files);
+    fs.file_keys = (FileKey*)(base + layout.file_keys);
+    fs.name_tags = (unsigned int*)(base + layout.name_tags);
+    fs.name_index = (int*)(base + layout.name_index);
+    fs.block_bitmap = (unsigned long long*)(base + layout.block_bitmap);
+    fs.free_extents = (FreeExtent*)(base + layout.free_extents);
+    fs.blocks = base + layout.blocks;
+}
+
+// Copy the state kept outside the tables to or from the superblock
+void save_superblock(int clean) {
+    Superblock* sb = (Superblock*)fs.volume;
+    memcpy(sb->magic, VOLUME_MAGIC, sizeof(sb->magic));
+    sb->version = VOLUME_VERSION;
+    sb->metadata_size = sizeof(FileMetadata);
+    sb->block_size = fs.block_size;
+    sb->num_blocks = fs.num_blocks;
+    sb->max_files = fs.max_files;
+    sb->num_slots = fs.num_slots;
+    sb->name_buckets = fs.name_buckets;
+    sb->extent_root[BY_START] = fs.extent_root[BY_START];
+    sb->extent_root[BY_SIZE] = fs.extent_root[BY_SIZE];
+    sb->free_extent_node = fs.free_extent_node;
+    sb->extent_nodes_used = fs.extent_nodes_used;
+    sb->num_free_extents = fs.num_free_extents;
+    sb->free_block_count = fs.free_block_count;
+    sb->num_files = fs.num_files;
+    sb->next_free_slot = fs.next_free_slot;
+    sb->clean = clean;
+    sb->compression = fs.compression;
+    sb->dedup = fs.dedup;
+}
+
+void load_superblock() {
+    const Superblock* sb = (const Superblock*)fs.volume;
+    fs.num_slots = sb->num_slots;
+    fs.name_buckets = sb->name_buckets;
+    fs.extent_root[BY_START] = sb->extent_root[BY_START];
+    fs.extent_root[BY_SIZE] = sb->extent_root[BY_SIZE];
+    fs.free_extent_node = sb->free_extent_node;
+    fs.extent_nodes_used = sb->extent_nodes_used;
+    fs.num_free_extents = sb->num_free_extents;
+    fs.free_block_count = sb->free_block_count;
+    fs.num_files = sb->num_files;
+    fs.next_free_slot = sb->next_free_slot;
+    fs.compression = sb->compression;
+    fs.dedup = sb->dedup;
+}
+
+// Map the first map_size bytes of a volume image file of size bytes,
+// creating the file if asked. The first private_size bytes are mapped
+// copy-on-write, so changes to them stay in memory until written back
+// explicitly (see checkpoint_volume). Returns the mapping, or NULL on failure.
+char* map_image(const char* path, size_t size, size_t map_size, size_t private_size,
+                int create) {
+#ifdef _WIN32
+    fs.image_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                create ? CREATE_NEW : OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fs.image_file == INVALID_HANDLE_VALUE) return NULL;
+    (void)private_size;
+    fs.image_mapping = CreateFileMappingA(fs.image_file, NULL, PAGE_READWRITE,
+                                          (DWORD)((unsigned long long)size >> 32),
+                                          (DWORD)size, NULL);
+    char* base = fs.image_mapping ?
+        MapViewOfFile(fs.image_mapping, FILE_MAP_ALL_ACCESS, 0, 0, map_size) : NULL;
+    if (!base) {
+        if (fs.image_mapping) CloseHandle(fs.image_mapping);
+        CloseHandle(fs.image_file);
+    }
+    return base;
+#else
+    fs.image_fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fs.image_fd < 0) return NULL;
+    if (create && ftruncate(fs.image_fd, (off_t)size) != 0) {
+        close(fs.image_fd);
+        return NULL;
+    }
+    char* base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs.image_fd, 0);
+    if (base != MAP_FAILED && private_size > 0 &&
+        mmap(base, private_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fs.image_fd, 0) == MAP_FAILED) {
+        munmap(base, map_size);
+        base = MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        close(fs.image_fd);
+        return NULL;
+    }
+    return base;
+#endif
+}
+
+// Write-ahead journal of metadata changes, for volume images.
+// With a journal, the superblock and tables of an image are mapped
+// privately, so the kernel never writes them back on its own; only the
+// data blocks are shared with the file. Each change is appended to the
+// journal as a record. Records are written and fsync'ed in groups (one by
+// one in strict mode), after the data blocks they refer to. A checkpoint
+// copies the tables to the image: first as one record of the journal, so
+// that a crash half way through can be finished on open, then in place,
+// after which the journal is emptied. Opening an image replays its journal.
+#ifndef _WIN32
+
+// FNV-1a checksum of a journal record
+unsigned int journal_checksum(const char* data, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) return -1;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Write the pending records to the journal, after the data blocks they
+// refer to. The caller holds journal_lock.
+// Returns 0, or -1 if the journal can't be written.
+int flush_journal() {
+    if (fs.journal_length == 0) return 0;
+    if (fs.journal_data_dirty &&
+        (flush_block_cache() != 0 || fdatasync(fs.image_fd) != 0)) {
+        return -1;
+    }
+    if (write_all(fs.journal_fd, fs.journal_buffer, fs.journal_length) != 0 ||
+        fdatasync(fs.journal_fd) != 0) {
+        return -1;
+    }
+    fs.journal_size += fs.journal_length;
+    fs.journal_length = 0;
+    fs.journal_data_dirty = 0;
+    fs.journal_commits++;
+    if (fs.journal_size >= JOURNAL_CHECKPOINT_BYTES) {
+        __atomic_store_n(&fs.checkpoint_due, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Copy the tables of the volume to its image and empty the journal. No
+// operation may be running, e.g. table_lock is held exclusive.
+// Returns 0, or -1 if the image can't be written.
+int checkpoint_volume(int clean) {
+    drain_alloc_caches();
+    write_lock(&fs.journal_lock);
+    // Blocks written outside any record, e.g. by a replay, go first too
+    if (flush_journal() != 0 ||
+        (fs.cache_frames > 0 && (flush_block_cache() != 0 || fdatasync(fs.image_fd) != 0))) {
+        write_unlock(&fs.journal_lock);
+        return -1;
+    }
+    save_superblock(clean);
+
+    // Only the part of each table in use is copied
+    size_t ranges[][2] = {
+        {0, sizeof(Superblock)},
+        {(char*)fs.files - fs.volume, (size_t)fs.num_slots * sizeof(FileMetadata)},
+        {(char*)fs.file_keys - fs.volume, (size_t)fs.num_slots * sizeof(FileKey)},
+        {(char*)fs.name_tags - fs.volume, (size_t)fs.num_slots * sizeof(unsigned int)},
+        {(char*)fs.name_index - fs.volume, (size_t)fs.name_buckets * sizeof(int)},
+        {(char*)fs.block_bitmap - fs.volume,
+         (size_t)(fs.num_blocks + 63) / 64 * sizeof(unsigned long long)},
+        {(char*)fs.free_extents - fs.volume, (size_t)fs.extent_nodes_used * sizeof(FreeExtent)},
+    };
+    int num_ranges = (int)(sizeof(ranges) / sizeof(ranges[0]));
+    size_t length = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        length += sizeof(ranges[i]) + ranges[i][1];
+    }
+    char* record = malloc(sizeof(JournalRecord) + length);
+    if (!record) {
+        write_unlock(&fs.journal_lock);
+        return -1;
+    }
+    char* payload = record + sizeof(JournalRecord);
+    for (int i = 0; i < num_ranges; i++) {
+        memcpy(payload, ranges[i], sizeof(ranges[i]));
+        memcpy(payload + sizeof(ranges[i]), fs.volume + ranges[i][0], ranges[i][1]);
+        payload += sizeof(ranges[i]) + ranges[i][1];
+    }
+    JournalRecord header = {JOURNAL_TABLES, (unsigned int)length,
+                            journal_checksum(record + sizeof(JournalRecord), length)};
+    memcpy(record, &header, sizeof(header));
+
+    int result = 0;
+    if (write_all(fs.journal_fd, record, sizeof(JournalRecord) + length) != 0 ||
+        fdatasync(fs.journal_fd) != 0) {
+        result = -1;
+    }
+    for (int i = 0; i < num_ranges && result == 0; i++) {
+        if (pwrite(fs.image_fd, fs.volume + ranges[i][0], ranges[i][1],
+                   (off_t)ranges[i][0]) != (ssize_t)ranges[i][1]) {
+            result = -1;
+        }
+    }
+    if (result == 0 && (fdatasync(fs.image_fd) != 0 ||
+                        ftruncate(fs.journal_fd, 0) != 0 ||
+                        lseek(fs.journal_fd, 0, SEEK_SET) != 0 ||
+                        fdatasync(fs.journal_fd) != 0)) {
+        result = -1;
+    }
+    free(record);
+    fs.journal_size = 0;
+    fs.journal_checkpoints++;
+    fs.checkpoint_due = 0;
+    write_unlock(&fs.journal_lock);
+    return result;
+}
+
+// Commit the pending records. Once the journal is large, the operation
+// running makes a checkpoint when it ends (see end_op).
+int journal_commit() {
+    write_lock(&fs.journal_lock);
+    int result = flush_journal();
+    write_unlock(&fs.journal_lock);
+    if (result != 0) {
+        printf("Error: Cannot write the journal\n");
+    }
+    return result;
+}
+
+// Set while the calling thread runs a bulk job (see import_path) whose
+// records are committed in groups, as if batched, even on a strict journal
+_Thread_local int journal_grouping;
+
+// Add a record to the pending group, committing the group when it is due
+void journal_append(unsigned int type, const char* payload, size_t length) {
+    write_lock(&fs.journal_lock);
+    size_t needed = fs.journal_length + sizeof(JournalRecord) + length;
+    if (needed > fs.journal_capacity) {
+        size_t capacity = fs.journal_capacity ? fs.journal_capacity : JOURNAL_GROUP_BYTES;
+        while (capacity < needed) capacity *= 2;
+        char* buffer = realloc(fs.journal_buffer, capacity);
+        if (!buffer) {
+            printf("Error: Out of memory for the journal\n");
+            exit(1);
+        }
+        fs.journal_buffer = buffer;
+        fs.journal_capacity = capacity;
+    }
+    if (fs.journal_length == 0) {
+        fs.journal_oldest_ns = now_ns();
+    }
+
+    JournalRecord header = {type, (unsigned int)length, journal_checksum(payload, length)};
+    memcpy(fs.journal_buffer + fs.journal_length, &header, sizeof(header));
+    memcpy(fs.journal_buffer + fs.journal_length + sizeof(header), payload, length);
+    fs.journal_length = needed;
+    fs.journal_records++;
+    if (type == JOURNAL_WRITE) {
+        fs.journal_data_dirty = 1;  // Its blocks go to the image first
+    }
+
+    int due = (fs.journal_mode == JOURNAL_STRICT && !journal_grouping) ||
+              fs.journal_length >= JOURNAL_GROUP_BYTES ||
+              now_ns() - fs.journal_oldest_ns >= JOURNAL_GROUP_NS;
+    if (due && flush_journal() != 0) {
+        printf("Error: Cannot write the journal\n");
+    }
+    write_unlock(&fs.journal_lock);
+}
+
+void begin_op();
+void end_op();
+
+// Thread that commits the pending group once its oldest record is
+// JOURNAL_GROUP_NS old, so the last records of a burst need not wait for
+// another record or the end of the input
+void* run_journal_flusher(void* arg) {
+    (void)arg;
+    struct timespec pause = {0, (long)(JOURNAL_GROUP_NS / 4)};
+    while (!__atomic_load_n(&fs.journal_flusher_stop, __ATOMIC_RELAXED)) {
+        nanosleep(&pause, NULL);
+        begin_op();
+        write_lock(&fs.journal_lock);
+        if (fs.journal_length > 0 && now_ns() - fs.journal_oldest_ns >= JOURNAL_GROUP_NS &&
+            flush_journal() != 0) {
+            printf("Error: Cannot write the journal\n");
+        }
+        write_unlock(&fs.journal_lock);
+        end_op();
+    }
+    return NULL;
+}
+
+void stop_journal_flusher() {
+    if (!fs.journal_flusher_running) return;
+    __atomic_store_n(&fs.journal_flusher_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(fs.journal_flusher, NULL);
+    fs.journal_flusher_running = 0;
+}
+
+void journal_create(int file_index) {
+    if (fs.journal_mode == JOURNAL_OFF) return;
+    FileMetadata* file = &fs.files[file_index];
+    CreateRecord record;
+    memset(&record, 0, sizeof(record));
+    record.slot = file_index;
+    record.parent_dir = file->parent_dir;
+    record.is_directory = file->is_directory;
+    record.time = file->created;
+    memcpy(record.filename, file->filename, MAX_FILENAME);
+    journal_append(JOURNAL_CREATE, (const char*)&record, sizeof(record));
+}
+
+// Log the blocks, size and time of a file
+void journal_write(int file_index) {
+    if (fs.journal_mode == JOURNAL_OFF) return;
+    FileMetadata* file = &fs.files[file_index];
+    WriteRecord record;
+    memset(&record, 0, sizeof(record));
+    record.slot = file_index;
+    record.num_extents = file->num_extents;
+    record.num_indirect = indirect_blocks_for(file->num_extents);
+    record.size = file->size;
+    record.time = file->modified;
+    record.flags = file->flags;
+
+    size_t extents_length = record.num_extents * sizeof(Extent);
+    size_t length = sizeof(record) + extents_length + record.num_indirect * sizeof(int);
+    if (file->flags & FILE_INLINE) length += file->size;
+    char* payload = malloc(length);
+    if (!payload) {
+        printf("Error: Out of memory for the journal\n");
+        exit(1);
+    }
+    memcpy(payload, &record, sizeof(record));
+    collect_extents(file, (Extent*)(payload + sizeof(record)),
+                    (int*)(payload + sizeof(record) + extents_length));
+    if (file->flags & FILE_INLINE) memcpy(payload + sizeof(record), file->content, file->size);
+    journal_append(JOURNAL_WRITE, payload, length);
+    free(payload);
+}
+
+void journal_delete(int file_index, unsigned int type) {
+    if (fs.journal_mode == JOURNAL_OFF) return;
+    journal_append(type, (const char*)&file_index, sizeof(file_index));
+}
+
+// Redo one journal record on the tables
+void apply_journal_record(unsigned int type, const char* payload) {
+    if (type == JOURNAL_CREATE) {
+        CreateRecord record;
+        memcpy(&record, payload, sizeof(record));
+        while (record.slot >= fs.num_slots && grow_file_table() == 0) {
+        }
+        add_file(record.slot, record.parent_dir, record.filename,
+                 record.is_directory, (time_t)record.time);
+    } else if (type == JOURNAL_WRITE) {
+        WriteRecord record;
+        memcpy(&record, payload, sizeof(record));
+        Extent* extents = malloc(record.num_extents * sizeof(Extent) + 1);
+        int* indirect = malloc(record.num_indirect * sizeof(int) + 1);
+        if (!extents || !indirect) {
+            printf("Error: Out of memory for the journal\n");
+            exit(1);
+        }
+        memcpy(extents, payload + sizeof(record), record.num_extents * sizeof(Extent));
+        memcpy(indirect, payload + sizeof(record) + record.num_extents * sizeof(Extent),
+               record.num_indirect * sizeof(int));
+
+        FileMetadata* file = &fs.files[record.slot];
+        release_file_blocks(file);
+        char* scratch = malloc(fs.block_size);
+        for (int i = 0; i < record.num_extents; i++) {
+            if (!(record.flags & FILE_DEDUP) || !scratch) {
+                claim_blocks(extents[i].start, extents[i].length);
+                continue;
+            }
+            for (int block = extents[i].start; block < extents[i].start + extents[i].length;
+                 block++) {
+                if (index_block(block, scratch)) claim_blocks(block, 1);
+            }
+        }
+        free(scratch);
+        for (int i = 0; i < record.num_indirect; i++) {
+            claim_blocks(indirect[i], 1);
+        }
+        set_file_blocks(file, extents, record.num_extents, indirect,
+                        (size_t)record.size, (time_t)record.time);
+        file->flags = record.flags;
+        if (file->flags & FILE_INLINE) {
+            memcpy(file->content, payload + sizeof(record), (size_t)record.size);
+        }
+        free(extents);
+        free(indirect);
+    } else if (type == JOURNAL_DELETE || type == JOURNAL_DELETE_TREE) {
+        int file_index;
+        memcpy(&file_index, payload, sizeof(file_index));
+        if (type == JOURNAL_DELETE) {
+            remove_file(file_index);
+        } else {
+            remove_tree(file_index);
+        }
+    } else if (type == JOURNAL_TABLES) {
+        JournalRecord header;
+        memcpy(&header, payload - sizeof(header), sizeof(header));
+        const char* end = payload + header.length;
+        while (payload < end) {
+            size_t range[2];
+            memcpy(range, payload, sizeof(range));
+            memcpy(fs.volume + range[0], payload + sizeof(range), range[1]);
+            payload += sizeof(range) + range[1];
+        }
+        load_superblock();
+        build_dedup_index();
+    }
+}
+
+// Open the journal of a volume image and redo the changes it holds.
+// Returns 0, or -1 if the journal can't be used.
+int open_journal(const char* image_path, int mode) {
+    char path[MAX_PATH + 16];
+    if (strlen(image_path) + sizeof(".journal") > sizeof(path)) {
+        printf("Error: Path of the journal of %s is too long\n", image_path);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s.journal", image_path);
+    fs.journal_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fs.journal_fd < 0) return -1;
+
+    off_t size = lseek(fs.journal_fd, 0, SEEK_END);
+    char* journal = malloc(size + 1);
+    if (!journal || pread(fs.journal_fd, journal, size, 0) != size) {
+        free(journal);
+        return -1;
+    }
+
+    // Find the complete records; a torn one ends the journal. Records
+    // before the last copy of the tables are already part of it.
+    off_t end = 0, start = 0;
+    while (end + (off_t)sizeof(JournalRecord) <= size) {
+        JournalRecord header;
+        memcpy(&header, journal + end, sizeof(header));
+        const char* payload = journal + end + sizeof(header);
+        if (header.length > size - end - sizeof(header) ||
+            journal_checksum(payload, header.length) != header.checksum) {
+            break;
+        }
+        if (header.type == JOURNAL_TABLES) start = end;
+        end += sizeof(header) + header.length;
+    }
+
+    int replayed = 0;
+    for (off_t pos = start; pos < end; replayed++) {
+        JournalRecord header;
+        memcpy(&header, journal + pos, sizeof(header));
+        apply_journal_record(header.type, journal + pos + sizeof(header));
+        pos += sizeof(header) + header.length;
+    }
+    free(journal);
+    if (replayed > 0) {
+        printf("Replayed %d journal records\n", replayed);
+    }
+
+    fs.journal_mode = mode;
+    int result = (size > 0) ? checkpoint_volume(0) : 0;
+    if (mode == JOURNAL_OFF) {
+        close(fs.journal_fd);
+        unlink(path);
+    } else if (result == 0) {
+        fs.journal_flusher_stop = 0;
+        fs.journal_flusher_running =
+            pthread_create(&fs.journal_flusher, NULL, run_journal_flusher, NULL) == 0;
+    }
+    return result;
+}
+
+// Commit the pending records before waiting for a user at a terminal;
+// input from a file or pipe keeps filling the group
+void journal_idle() {
+    if (fs.journal_length > 0 && isatty(STDIN_FILENO)) {
+        journal_commit();
+    }
+}
+
+#else  // No journal on Windows
+
+int journal_commit() { return 0; }
+void journal_idle() {}
+void stop_journal_flusher() {}
+int checkpoint_volume(int clean) { (void)clean; return 0; }
+void journal_create(int file_index) { (void)file_index; }
+void journal_write(int file_index) { (void)file_index; }
+void journal_delete(int file_index, unsigned int type) { (void)file_index; (void)type; }
+int open_journal(const char* image_path, int mode) {
+    (void)image_path;
+    if (mode != JOURNAL_OFF) printf("Warning: Journaling is not available on Windows\n");
+    return 0;
+}
+
+#endif
+
+// Print the journal mode and counters
+void print_journal() {
+    const char* modes[] = {"off", "batched", "strict"};
+    printf("Journal: %s, %lld records, %lld commits, %lld checkpoints, %lld bytes\n",
+           modes[fs.journal_mode], fs.journal_records, fs.journal_commits,
+           fs.journal_checkpoints, (long long)(fs.journal_size + fs.journal_length));
+}
+
+// Write the dirty pages of a volume image back to its file
+int sync_volume() {
+    if (!fs.mapped) return 0;
+    write_lock(&fs.table_lock);
+    int result;
+    if (fs.journal_mode != JOURNAL_OFF) {
+        result = checkpoint_volume(0);
+    } else {
+        drain_alloc_caches();
+        save_superblock(0);
+        result = flush_block_cache();
+#ifdef _WIN32
+        if (!FlushViewOfFile(fs.volume, 0) || !FlushFileBuffers(fs.image_file)) result = -1;
+#else
+        if (msync(fs.volume, fs.volume_size, MS_SYNC) != 0 ||
+            (fs.cache_frames > 0 && fdatasync(fs.image_fd) != 0)) {
+            result = -1;
+        }
+#endif
+    }
+    write_unlock(&fs.table_lock);
+    return result;
+}
+
+// Release the memory of the file system, closing its image if it has one.
+// No other thread may be using it.
+void free_filesystem() {
+    stop_journal_flusher();
+    drop_snapshots();
+    if (fs.mapped && fs.journal_mode != JOURNAL_OFF) {
+#ifndef _WIN32
+        checkpoint_volume(1);
+        munmap(fs.volume, fs.volume_size);
+        close(fs.image_fd);
+        close(fs.journal_fd);
+#endif
+    } else if (fs.mapped) {
+        sync_volume();
+        save_superblock(1);
+#ifdef _WIN32
+        FlushViewOfFile(fs.volume, 0);
+        UnmapViewOfFile(fs.volume);
+        CloseHandle(fs.image_mapping);
+        CloseHandle(fs.image_file);
+#else
+        msync(fs.volume, PAGE_SIZE, MS_SYNC);
+        munmap(fs.volume, fs.volume_size);
+        close(fs.image_fd);
+#endif
+    } else {
+        release_memory(fs.volume, fs.volume_size);
+    }
+    free(fs.journal_buffer);
+    free_block_cache();
+    free_dedup_index();
+    destroy_locks();
+    memset(&fs, 0, sizeof(FileSystem));
+}
+
+// Set up the tables of an empty volume with a root directory
+void format_volume(const VolumeGeometry* geometry) {
+    fs.num_slots = geometry->num_files;
+    fs.name_buckets = name_buckets_for(fs.num_slots);
+    fs.extent_root[BY_START] = fs.extent_root[BY_SIZE] = -1;
+    fs.free_extent_node = -1;
+    free_blocks(0, fs.num_blocks);
+    for (int i = 0; i < fs.name_buckets; i++) {
+        fs.name_index[i] = -1;
+    }
+
+    // Create the root directory
+    strcpy(fs.files[0].filename, "/");
+    fs.files[0].is_directory = 1;
+    fs.files[0].created = time(NULL);
+    fs.files[0].modified = time(NULL);
+    fs.files[0].parent_dir = 0;
+    fs.files[0].first_child = -1;
+    fs.files[0].last_child = -1;
+    fs.files[0].indirect_block = -1;
+    fs.files[0].name_hash = hash_name("/");
+    index_file(0);
+    fs.num_files = 1;
+    fs.current_dir = 0;  // Start in the root directory
+    fs.next_free_slot = 1;
+}
+
+int check_geometry(const VolumeGeometry* geometry) {
+    if (geometry->block_size < MIN_BLOCK_SIZE || geometry->num_blocks < 1 ||
+        geometry->num_files < 1 || geometry->max_files < geometry->num_files) {
+        printf("Error: Invalid volume geometry\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Initialize the file system in memory
+int init_filesystem(const VolumeGeometry* geometry) {
+    if (check_geometry(geometry) != 0) return -1;
+
+    free_filesystem();
+    fs.block_size = geometry->block_size;
+    fs.num_blocks = geometry->num_blocks;
+    fs.max_files = geometry->max_files;
+    VolumeLayout layout;
+    size_t size = layout_volume(fs.block_size, fs.num_blocks, fs.max_files, &layout);
+    char* base = reserve_memory(size);
+    if (!base) {
+        printf("Error: Not enough memory for the volume\n");
+        return -1;
+    }
+    place_tables(base);
+    init_locks();
+    if (commit_memory(fs.files, geometry->num_files * sizeof(FileMetadata)) != 0 ||
+        commit_memory(fs.file_keys, geometry->num_files * sizeof(FileKey)) != 0 ||
+        commit_memory(fs.name_tags, geometry->num_files * sizeof(unsigned int)) != 0 ||
+        commit_memory(fs.name_index, name_buckets_for(geometry->num_files) * sizeof(int)) != 0 ||
+        commit_memory(fs.block_bitmap, (fs.num_blocks + 63) / 64 * sizeof(unsigned long long)) != 0) {
+        printf("Error: Not enough memory for the volume\n");
+        free_filesystem();
+        return -1;
+    }
+    format_volume(geometry);
+    return 0;
+}
+
+// Open an existing volume image with the given journal mode, replaying its
+// journal if it has one. Only the superblock is read; the tables and blocks
+// are paged in from the file as they are used. With a cache_size, the
+// blocks are not mapped but go through a block cache of that many bytes.
+int open_volume_image(const char* path, int journal_mode, long long cache_size) {
+    Superblock sb;
+    FILE* image = fopen(path, "rb");
+    if (!image) {
+        printf("Error: Cannot open volume image %s\n", path);
+        return -1;
+    }
+    size_t got = fread(&sb, sizeof(sb), 1, image);
+    fclose(image);
+    if (got != 1 || memcmp(sb.magic, VOLUME_MAGIC, sizeof(sb.magic)) != 0 ||
+        sb.version != VOLUME_VERSION || sb.metadata_size != (int)sizeof(FileMetadata)) {
+        printf("Error: %s is not a volume image\n", path);
+        return -1;
+    }
+
+    free_filesystem();
+    VolumeLayout layout;
+    size_t size = layout_volume(sb.block_size, sb.num_blocks, sb.max_files, &layout);
+    size_t map_size = cache_size > 0 ? layout.blocks : size;
+    char* base = map_image(path, size, map_size,
+                           journal_mode != JOURNAL_OFF ? layout.blocks : 0, 0);
+    if (!base) {
+        printf("Error: Cannot map volume image %s\n", path);
+        return -1;
+    }
+    fs.mapped = 1;
+    fs.block_size = sb.block_size;
+    fs.num_blocks = sb.num_blocks;
+    fs.max_files = sb.max_files;
+    fs.blocks_committed = fs.num_blocks;
+    place_tables(base);
+    init_locks();
+    if (cache_size > 0) {
+        fs.volume_size = map_size;
+        fs.blocks = NULL;
+        fs.blocks_offset = layout.blocks;
+        if (init_block_cache((int)(cache_size / fs.block_size)) != 0) {
+            printf("Error: Not enough memory for the block cache\n");
+            free_filesystem();
+            return -1;
+        }
+    }
+    load_superblock();
+    build_dedup_index();
+    if (!sb.clean) {
+        printf("Warning: Volume image %s was not closed cleanly\n", path);
+    }
+    if (open_journal(path, journal_mode) != 0) {
+        printf("Error: Cannot use the journal of %s\n", path);
+        free_filesystem();
+        return -1;
+    }
+    if (!sb.clean) rebuild_free_space();  // Blocks snapshots held are free again
+    save_superblock(0);
+#ifndef _WIN32
+    if (fs.journal_mode != JOURNAL_OFF &&
+        pwrite(fs.image_fd, fs.volume, sizeof(Superblock), 0) != (ssize_t)sizeof(Superblock)) {
+        printf("Error: Cannot write volume image %s\n", path);
+        free_filesystem();
+        return -1;
+    }
+#endif
+    fs.current_dir = 0;
+    return 0;
+}
+
+// Create a volume image file and open it as open_volume_image() does
+int create_volume_image(const char* path, const VolumeGeometry* geometry, int journal_mode,
+                        long long cache_size) {
+    if (check_geometry(geometry) != 0) return -1;
+
+    free_filesystem();
+    VolumeLayout layout;
+    size_t size = layout_volume(geometry->block_size, geometry->num_blocks,
+                                geometry->max_files, &layout);
+    // Formatting only writes the tables, so the blocks need not be mapped
+    char* base = map_image(path, size, layout.blocks, 0, 1);
+    if (!base) {
+        printf("Error: Cannot create volume image %s\n", path);
+        return -1;
+    }
+    fs.mapped = 1;
+    fs.block_size = geometry->block_size;
+    fs.num_blocks = geometry->num_blocks;
+    fs.max_files = geometry->max_files;
+    fs.blocks_committed = fs.num_blocks;
+    place_tables(base);
+    fs.volume_size = layout.blocks;
+    fs.blocks = NULL;
+    init_locks();
+    format_volume(geometry);
+    if (sync_volume() != 0) {
+        printf("Error: Cannot write volume image %s\n", path);
+        free_filesystem();
+        return -1;
+    }
+    free_filesystem();
+    return open_volume_image(path, journal_mode, cache_size);
+}
+
+// Start an operation on the file system, see FileSystem
+void begin_op() {
+    read_lock(&fs.table_lock);
+}
+
+// End an operation, running the checkpoint it may have made due
+void end_op() {
+    read_unlock(&fs.table_lock);
+    if (__atomic_load_n(&fs.checkpoint_due, __ATOMIC_RELAXED)) {
+        write_lock(&fs.table_lock);
+        if (fs.checkpoint_due && checkpoint_volume(0) != 0) {
+            printf("Error: Cannot write the volume image\n");
+        }
+        write_unlock(&fs.table_lock);
+    }
+}
+
+// Find the entry at a path and lock it for reading or writing, along with
+// its directory. Returns its index, or -1 if there is none.
+int lock_entry(const char* path, int dir_write, int write, int* dir_index) {
+    char filename[MAX_FILENAME];
+    while (1) {
+        int parent_dir = resolve_parent(path, filename);
+        if (parent_dir == -1) return -1;
+        read_lock(inode_lock(parent_dir));
+        int file_index = lookup_name(filename, parent_dir);
+        read_unlock(inode_lock(parent_dir));
+        if (file_index == -1) return -1;
+
+        // Lock the pair in stripe order, then check the name still leads there
+        lock_pair(parent_dir, dir_write, file_index, write);
+        if (lookup_name(filename, parent_dir) == file_index) {
+            *dir_index = parent_dir;
+            return file_index;
+        }
+        unlock_pair(parent_dir, dir_write, file_index, write);
+    }
+}
+
+// Find the file at a path and lock it for reading or writing.
+// Returns its index, or -1 if there is no such file.
+int lock_file(const char* path, int write) {
+    int dir_index;
+    int file_index = lock_entry(path, 0, write, &dir_index);
+    if (file_index == -1) {
+        printf("Error: File not found\n");
+        return -1;
+    }
+    if (inode_lock(dir_index) != inode_lock(file_index)) {
+        unlock_inode(dir_index, 0);
+    }
+    if (fs.files[file_index].is_directory) {
+        unlock_inode(file_index, write);
+        printf(write ? "Error: Cannot write to a directory\n" :
+                       "Error: Cannot read a directory\n");
+        return -1;
+    }
+    return file_index;
+}
+
+// Delete a directory and its contents recursively. This holds off every
+// other operation while it runs.
+int delete_directory_recursive(int dir_index) {
+    double start = start_timing(OP_DELETE);
+    write_lock(&fs.table_lock);
+    if (fs.files[dir_index].filename[0] == '\0' || !fs.files[dir_index].is_directory) {
+        write_unlock(&fs.table_lock);
+        count_op(OP_DELETE, start, 0, 1);
+        printf("Error: This is not a directory\n");
+        return -1;
+    }
+
+    remove_tree(dir_index);
+    journal_delete(dir_index, JOURNAL_DELETE_TREE);
+    write_unlock(&fs.table_lock);
+    count_op(OP_DELETE, start, 0, 0);
+    return 0;
+}
+
+// Create a new file or directory at a path, or if path is NULL, named
+// name in the directory parent_dir. Returns its index, or -1 on error.
+int create_entry(const char* path, int parent_dir, const char* name, int is_directory) {
+    char filename[MAX_FILENAME];
+    double start = start_timing(OP_CREATE);
+    while (1) {
+        begin_op();
+        int dir_index = -1;
+        if (path) {
+            dir_index = resolve_parent(path, filename);
+        } else if (strlen(name) < MAX_FILENAME && fs.file_keys[parent_dir].in_use &&
+                   fs.files[parent_dir].is_directory) {
+            strcpy(filename, name);
+            dir_index = parent_dir;
+        }
+        if (dir_index == -1) {
+            end_op();
+            count_op(OP_CREATE, start, 0, 1);
+            printf("Error: Invalid path or directory not found\n");
+            return -1;
+        }
+        if (filename[0] == '@') {  // Would read as a snapshot's path
+            end_op();
+            count_op(OP_CREATE, start, 0, 1);
+            printf("Error: Names starting with @ are kept for snapshots\n");
+            return -1;
+        }
+
+        // Check if the file already exists in the directory
+        write_lock(inode_lock(dir_index));
+        if (lookup_name(filename, dir_index) != -1) {
+            write_unlock(inode_lock(dir_index));
+            end_op();
+            count_op(OP_CREATE, start, 0, 1);
+            printf("Error: A file or directory with this name already exists\n");
+            return -1;
+        }
+
+        // Find a free slot, starting after the last one handed out
+        int file_slot = -1;
+        write_lock(&fs.slot_lock);
+        for (int n = 0; fs.num_files < fs.num_slots && n < fs.num_slots; n++) {
+            int i = (fs.next_free_slot + n) % fs.num_slots;
+            if (!fs.file_keys[i].in_use) {
+                file_slot = i;
+                break;
+            }
+        }
+        if (file_slot != -1) {
+            add_file(file_slot, dir_index, filename, is_directory, time(NULL));
+        }
+        write_unlock(&fs.slot_lock);
+        if (file_slot != -1) {
+            journal_create(file_slot);
+        }
+        write_unlock(inode_lock(dir_index));
+        end_op();
+        if (file_slot != -1) {
+            count_op(OP_CREATE, start, 0, 0);
+            return file_slot;
+        }
+
+        // The table is full: grow it with other operations held off, then retry
+        write_lock(&fs.table_lock);
+        int grown = (fs.num_files < fs.num_slots) ? 0 : grow_file_table();
+        write_unlock(&fs.table_lock);
+        if (grown != 0) {
+            count_op(OP_CREATE, start, 0, 1);
+            printf("Error: Maximum number of files reached\n");
+            return -1;
+        }
+    }
+}
+
+// Create a new file or directory at a path
+int create_file(const char* path, int is_directory) {
+    return create_entry(path, -1, NULL, is_directory);
+}
+
+// Create a new file or directory in a directory, without walking a path
+int create_in_dir(int parent_dir, const char* name, int is_directory) {
+    return create_entry(NULL, parent_dir, name, is_directory);
+}
+
+// Find the runs and indirect blocks of a file resized to size bytes, into
+// *extents_out and *indirect_out, to be freed by the caller. The blocks it
+// has are kept, so its content up to size stays in place: growth first
+// extends the last run into the free blocks after it, then adds runs, and
+// shrinking frees blocks from the end.
+// Returns the number of runs, or -1 if there is not enough space.
+int fit_blocks(const FileMetadata* file, size_t size, Extent** extents_out, int** indirect_out) {
+    int blocks_needed = (int)((size + fs.block_size - 1) / fs.block_size);
+    int more = blocks_needed - file->num_blocks;
+    int n = file->num_extents;
+    int num_indirect = indirect_blocks_for(n);
+    int max_extents = n + (more > 0 ? more : 0);
+    Extent* extents = malloc((max_extents + 1) * sizeof(Extent));
+    int* indirect = malloc((indirect_blocks_for(max_extents) + num_indirect + 1) * sizeof(int));
+    if (!extents || !indirect) {
+        free(extents);
+        free(indirect);
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    collect_extents(file, extents, indirect);
+
+    int grown = 0;  // Blocks added to the last run
+    int added = n;  // First of the new runs
+    if (more > 0) {
+        if (n > 0) {
+            int end = extents[n - 1].start + extents[n - 1].length;
+            grown = cache_extend(end, more);
+            if (grown == 0) {
+                write_lock(&fs.alloc_lock);
+                grown = free_run_at(end);
+                if (grown > more) grown = more;
+                if (grown > 0 && (grow_blocks(end + grown) != 0 || claim_blocks(end, grown) != 0)) {
+                    grown = 0;
+                }
+                write_unlock(&fs.alloc_lock);
+            }
+            extents[n - 1].length += grown;
+        }
+        if (more > grown) {
+            int start = cache_alloc(more - grown);
+            if (start != -1) {
+                extents[n].start = start;
+                extents[n].length = more - grown;
+                n++;
+            } else {
+                write_lock(&fs.alloc_lock);
+                int k = alloc_extents(more - grown, extents + n);
+                write_unlock(&fs.alloc_lock);
+                n = (k == -1) ? -1 : n + k;
+            }
+        }
+    } else if (more < 0) {
+        write_lock(&fs.alloc_lock);
+        for (int excess = -more; excess > 0; ) {
+            Extent* last = &extents[n - 1];
+            int cut = excess < last->length ? excess : last->length;
+            free_blocks(last->start + last->length - cut, cut);
+            last->length -= cut;
+            if (last->length == 0) n--;
+            excess -= cut;
+        }
+        write_unlock(&fs.alloc_lock);
+    }
+
+    // Fit the chain of indirect blocks to the new number of runs
+    int needed = (n == -1) ? 0 : indirect_blocks_for(n);
+    int got = num_indirect;
+    while (n != -1 && got < needed) {
+        int block = alloc_block();
+        if (block == -1) break;
+        indirect[got++] = block;
+    }
+    if (n == -1 || got < needed) {
+        write_lock(&fs.alloc_lock);
+        for (int i = num_indirect; i < got; i++) {
+            free_blocks(indirect[i], 1);
+        }
+        for (int i = added; i < n; i++) {
+            free_blocks(extents[i].start, extents[i].length);
+        }
+        if (grown > 0) {
+            free_blocks(extents[added - 1].start + extents[added - 1].length - grown, grown);
+        }
+        write_unlock(&fs.alloc_lock);
+        free(extents);
+        free(indirect);
+        return -1;
+    }
+    if (needed < num_indirect) {
+        write_lock(&fs.alloc_lock);
+        for (int i = needed; i < num_indirect; i++) {
+            free_blocks(indirect[i], 1);
+        }
+        write_unlock(&fs.alloc_lock);
+    }
+    *extents_out = extents;
+    *indirect_out = indirect;
+    return n;
+}
+
+// Give a file the blocks for size bytes, as fit_blocks() finds them.
+// Returns 0, or -1 if there is not enough space.
+int resize_file(int file_index, size_t size) {
+    Extent* extents;
+    int* indirect;
+    int n = fit_blocks(&fs.files[file_index], size, &extents, &indirect);
+    if (n == -1) return -1;
+    set_file_blocks(&fs.files[file_index], extents, n, indirect, size, time(NULL));
+    free(extents);
+    free(indirect);
+    return 0;
+}
+
+// Give a file new blocks for size bytes in place of those it has, which
+// are only released once the new ones are allocated, so that a failure
+// leaves the file as it was. For blocks not to be written in place.
+// Returns 0, or -1 if there is not enough space.
+int replace_blocks(int file_index, size_t size) {
+    FileMetadata* file = &fs.files[file_index];
+    FileMetadata empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.indirect_block = -1;
+    Extent* extents;
+    int* indirect;
+    int n = fit_blocks(&empty, size, &extents, &indirect);
+    if (n == -1) return -1;
+    release_file_blocks(file);
+    file->flags &= ~(FILE_DEDUP | FILE_COMPRESSED | FILE_INLINE);
+    set_file_blocks(file, extents, n, indirect, size, time(NULL));
+    free(extents);
+    free(indirect);
+    return 0;
+}
+
+// A byte-oriented LZ codec in the manner of LZ4. The output is a series of
+// sequences, each a token byte (literal count in the high nibble, match
+// length - LZ_MIN_MATCH in the low one; 15 means more length bytes follow,
+// each added until one is below 255), the literals, then a two-byte little
+// endian match offset. The last sequence has literals only and ends where
+// the content does, so the decoder needs the content size, not the
+// compressed one.
+unsigned int lz_hash(const unsigned char* p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+unsigned char* lz_put_length(unsigned char* out, size_t length) {
+    for (; length >= 255; length -= 255) *out++ = 255;
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Write one sequence, without the offset if match is 0. Returns the end of
+// the output, or NULL if it would pass out_end.
+unsigned char* lz_put_sequence(unsigned char* out, unsigned char* out_end,
+                               const unsigned char* literals, size_t count, size_t match) {
+    if ((size_t)(out_end - out) < 1 + count / 255 + 1 + count + 2 + match / 255 + 1) {
+        return NULL;
+    }
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+    *out++ = (unsigned char)(((count < 15 ? count : 15) << 4) | (extra < 15 ? extra : 15));
+    if (count >= 15) out = lz_put_length(out, count - 15);
+    memcpy(out, literals, count);
+    out += count;
+    return out;
+}
+
+// Compress length bytes of data into out. Returns the compressed size, or
+// 0 if it would be more than capacity.
+size_t lz_compress(const char* data, size_t length, char* out, size_t capacity) {
+    const unsigned char* src = (const unsigned char*)data;
+    const unsigned char* end = src + length;
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;  // First byte not encoded yet
+    unsigned char* op = (unsigned char*)out;
+    unsigned char* op_end = op + capacity;
+    unsigned int table[1 << LZ_HASH_BITS];  // Last position of each hash
+    memset(table, 0, sizeof(table));
+
+    unsigned int misses = 0;
+    while (length >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        unsigned int h = lz_hash(ip);
+        const unsigned char* ref = src + table[h];
+        table[h] = (unsigned int)(ip - src);
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip += 1 + (misses++ >> 5);  // Step faster through what does not compress
+            continue;
+        }
+        const unsigned char* p = ip + LZ_MIN_MATCH;
+        const unsigned char* q = ref + LZ_MIN_MATCH;
+        unsigned long long a, b;
+        while (p + sizeof(a) <= end) {
+            memcpy(&a, p, sizeof(a));
+            memcpy(&b, q, sizeof(b));
+            if (a != b) break;
+            p += sizeof(a);
+            q += sizeof(b);
+        }
+        while (p < end && *p == *q) {
+            p++;
+            q++;
+        }
+
+        size_t match = (size_t)(p - ip);
+        op = lz_put_sequence(op, op_end, anchor, (size_t)(ip - anchor), match);
+        if (!op) return 0;
+        size_t offset = (size_t)(ip - ref);
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        if (match - LZ_MIN_MATCH >= 15) op = lz_put_length(op, match - LZ_MIN_MATCH - 15);
+        ip = anchor = p;
+        misses = 0;
+    }
+    op = lz_put_sequence(op, op_end, anchor, (size_t)(end - anchor), 0);
+    return op ? (size_t)(op - (unsigned char*)out) : 0;
+}
+
+// Read a length continued past its nibble. Returns 0, or -1 past in_end.
+int lz_get_length(const unsigned char** in, const unsigned char* in_end, size_t* length) {
+    unsigned char byte;
+    do {
+        if (*in >= in_end) return -1;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Decompress the output of lz_compress() into exactly length bytes of out.
+// Reads at most packed_length bytes. Returns 0, or -1 if they are damaged.
+int lz_decompress(const char* packed, size_t packed_length, char* out, size_t length) {
+    const unsigned char* ip = (const unsigned char*)packed;
+    const unsigned char* ip_end = ip + packed_length;
+    unsigned char* op = (unsigned char*)out;
+    unsigned char* op_end = op + length;
+    while (1) {
+        if (ip >= ip_end) return -1;
+        unsigned int token = *ip++;
+        size_t count = token >> 4;
+        if (count == 15 && lz_get_length(&ip, ip_end, &count) != 0) return -1;
+        if (count > (size_t)(ip_end - ip) || count > (size_t)(op_end - op)) return -1;
+        memcpy(op, ip, count);
+        op += count;
+        ip += count;
+        if (op == op_end) return 0;
+
+        if (ip_end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && lz_get_length(&ip, ip_end, &match) != 0) return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)out) ||
+            match > (size_t)(op_end - op)) {
+            return -1;
+        }
+        const unsigned char* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            // The match repeats its own start, with a period of offset: once
+            // a multiple of it of at least 8 bytes is behind, copy 8 at once
+            size_t period = offset;
+            while (period < 8) period *= 2;
+            for (size_t i = offset; i < period && match > 0; i++, match--) *op++ = *ref++;
+            for (ref = op - period; match >= 8; match -= 8) {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            }
+            while (match-- > 0) *op++ = *ref++;
+        }
+    }
+}
+
+// Copy length bytes into a file at offset, or zeros if data is NULL.
+// The file must already have the blocks for the range.
+void copy_into_file(const FileMetadata* file, const char* data, size_t length, size_t offset) {
+    ExtentIter it;
+    Extent extent;
+    start_extents(&it, file);
+    while (length > 0 && next_extent(&it, &extent)) {
+        size_t run = (size_t)extent.length * fs.block_size;
+        if (offset >= run) {  // Run before the range
+            offset -= run;
+            continue;
+        }
+        run -= offset;
+        if (run > length) run = length;
+        store_blocks(extent.start, offset, data, run);
+        if (data) data += run;
+        length -= run;
+        offset = 0;
+    }
+}
+
+// With a block cache, read in the runs of a file ahead of a copy of its
+// bytes from to to, many runs in one batch (see load_frames()). ahead is
+// at the run starting at byte *ahead_end of the file, and moves past the
+// runs read in. The last one is read on as a miss would.
+void prefetch_runs(ExtentIter* ahead, size_t* ahead_end, size_t from, size_t to) {
+    Extent runs[IO_BATCH];
+    Extent extent;
+    int n = 0;
+    int blocks = 0;
+    while (n < IO_BATCH && blocks < fs.cache_frames / 4 && *ahead_end < to &&
+           next_extent(ahead, &extent)) {
+        size_t start = *ahead_end;
+        *ahead_end += (size_t)extent.length * fs.block_size;
+        if (*ahead_end <= from) continue;
+        int first = start < from ? (int)((from - start) / fs.block_size) : 0;
+        int last = extent.length;
+        if (*ahead_end > to) {
+            last = (int)((to - start + fs.block_size - 1) / fs.block_size) + CACHE_READ_AHEAD - 1;
+            if (last > extent.length) last = extent.length;
+        }
+        runs[n].start = extent.start + first;
+        runs[n].length = last - first;
+        blocks += runs[n].length;
+        n++;
+    }
+    if (n == 0) return;
+    write_lock(&fs.cache_lock);
+    int loaded = load_frames(runs, n);
+    if (loaded > 0) fs.cache_read_ahead += loaded;
+    write_unlock(&fs.cache_lock);
+}
+
+// Decompress the content of a locked, compressed file into a buffer of
+// its size. Returns 0, or -1 on error.
+int unpack_file(const FileMetadata* file, char* content) {
+    size_t stored = (size_t)file->num_blocks * fs.block_size;
+    char* packed = malloc(stored);
+    if (!packed) {
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    size_t loaded = 0;
+    size_t ahead_end = 0;  // Runs read in so far, see prefetch_runs()
+    ExtentIter it;
+    ExtentIter ahead;
+    Extent extent;
+    start_extents(&it, file);
+    ahead = it;
+    while (next_extent(&it, &extent)) {
+        size_t run = (size_t)extent.length * fs.block_size;
+        if (fs.cache_frames > 0 && ahead_end < loaded + run) {
+            prefetch_runs(&ahead, &ahead_end, 0, stored);
+        }
+        if (load_blocks(extent.start, extent.length, 0, packed + loaded, run) != 0) {
+            free(packed);
+            return -1;
+        }
+        loaded += run;
+    }
+    int result = lz_decompress(packed, stored, content, file->size);
+    free(packed);
+    if (result != 0) printf("Error: Compressed content of %s is damaged\n", file->filename);
+    return result;
+}
+
+// Copy up to length bytes of a locked file from offset into a buffer.
+// Returns the number of bytes copied, 0 past the end, or -1 on error.
+long long copy_from_file(const FileMetadata* file, char* buffer, size_t length, size_t offset) {
+    if (offset >= file->size) return 0;
+    if (length > file->size - offset) length = file->size - offset;
+    if (file->flags & FILE_INLINE) {
+        memcpy(buffer, file->content + offset, length);
+        return (long long)length;
+    }
+    if (file->flags & FILE_COMPRESSED) {
+        // The whole content is decompressed, straight into the buffer if it
+        // is all wanted
+        if (offset == 0 && length == file->size) {
+            return unpack_file(file, buffer) == 0 ? (long long)length : -1;
+        }
+        char* content = malloc(file->size);
+        if (!content) {
+            printf("Error: Memory allocation failed\n");
+            return -1;
+        }
+        int result = unpack_file(file, content);
+        if (result == 0) memcpy(buffer, content + offset, length);
+        free(content);
+        return result == 0 ? (long long)length : -1;
+    }
+    size_t copied = 0;
+    size_t from = offset;
+    size_t position = 0;   // Where the run starts in the file
+    size_t ahead_end = 0;  // Runs read in so far, see prefetch_runs()
+    ExtentIter it;
+    ExtentIter ahead;
+    Extent extent;
+    start_extents(&it, file);
+    ahead = it;
+    while (copied < length && next_extent(&it, &extent)) {
+        size_t run = (size_t)extent.length * fs.block_size;
+        if (fs.cache_frames > 0 && ahead_end < position + run) {
+            prefetch_runs(&ahead, &ahead_end, from, from + length);
+        }
+        position += run;
+        if (offset >= run) {  // Run before the range
+            offset -= run;
+            continue;
+        }
+        run -= offset;
+        if (run > length - copied) run = length - copied;
+        if (load_blocks(extent.start, extent.length, offset, buffer + copied, run) != 0) {
+            return -1;
+        }
+        copied += run;
+        offset = 0;
+    }
+    return (long long)copied;
+}
+
+// Drop one reference to each block of a list, freeing those no other
+// file uses
+void release_deduped(const Extent* extents, int n) {
+    write_lock(&fs.dedup_lock);
+    write_lock(&fs.alloc_lock);
+    for (int i = 0; i < n; i++) {
+        release_shared_run(extents[i].start, extents[i].length);
+    }
+    write_unlock(&fs.alloc_lock);
+    write_unlock(&fs.dedup_lock);
+}
+
+// Replace the blocks of a locked file with new ones holding length bytes
+// of data, sharing each block whose content the dedup index already has
+int store_deduped(int file_index, const char* data, size_t length) {
+    FileMetadata* file = &fs.files[file_index];
+    int blocks = (int)((length + fs.block_size - 1) / fs.block_size);
+    Extent* extents = malloc((blocks + 1) * sizeof(Extent));
+    char* scratch = malloc(2 * (size_t)fs.block_size);  // A block to compare,
+                                                       // then the last one
+    if (!extents || !scratch) {
+        free(extents);
+        free(scratch);
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    int n = 0;
+    int i = 0;
+    for (; i < blocks; i++) {
+        const char* chunk = data + (size_t)i * fs.block_size;
+        if ((size_t)(i + 1) * fs.block_size > length) {  // Zero the rest
+            memset(scratch + fs.block_size, 0, fs.block_size);
+            memcpy(scratch + fs.block_size, chunk, length - (size_t)i * fs.block_size);
+            chunk = scratch + fs.block_size;
+        }
+        unsigned long long hash = hash_block(chunk, fs.block_size);
+        write_lock(&fs.dedup_lock);
+        int block = dedup_share(hash, chunk, scratch);
+        write_unlock(&fs.dedup_lock);
+        if (block == -1) {
+            int fresh = alloc_block();
+            if (fresh == -1) break;
+            store_blocks(fresh, 0, chunk, fs.block_size);
+            // Another thread may have added the same content meanwhile
+            write_lock(&fs.dedup_lock);
+            block = dedup_share(hash, chunk, scratch);
+            if (block == -1) {
+                block = fresh;
+                dedup_add(hash, block);
+            }
+            write_unlock(&fs.dedup_lock);
+            if (block != fresh) {
+                write_lock(&fs.alloc_lock);
+                free_blocks(fresh, 1);
+                write_unlock(&fs.alloc_lock);
+            }
+        }
+        if (n > 0 && extents[n - 1].start + extents[n - 1].length == block) {
+            extents[n - 1].length++;
+        } else {
+            extents[n].start = block;
+            extents[n].length = 1;
+            n++;
+        }
+    }
+
+    int needed = indirect_blocks_for(n);
+    int* indirect = malloc((needed + 1) * sizeof(int));
+    int got = 0;
+    while (i == blocks && indirect && got < needed && (indirect[got] = alloc_block()) != -1) {
+        got++;
+    }
+    if (i < blocks || !indirect || got < needed) {
+        release_deduped(extents, n);
+        write_lock(&fs.alloc_lock);
+        for (int k = 0; k < got; k++) {
+            free_blocks(indirect[k], 1);
+        }
+        write_unlock(&fs.alloc_lock);
+        printf("Error: Insufficient space\n");
+        free(extents);
+        free(indirect);
+        free(scratch);
+        return -1;
+    }
+
+    release_file_blocks(file);
+    file->flags = (file->flags & ~FILE_INLINE) | FILE_DEDUP;
+    set_file_blocks(file, extents, n, indirect, length, time(NULL));
+    free(extents);
+    free(indirect);
+    free(scratch);
+    return 0;
+}
+
+// Whether a locked file has blocks allocated before the newest snapshot
+// was taken. Those may be in a snapshot, so they are not written: the
+// file's content is stored anew as a whole instead.
+int file_is_frozen(const FileMetadata* file) {
+    if (fs.num_snapshots == 0) return 0;
+    unsigned int epoch = fs.snapshots[fs.num_snapshots - 1].epoch;
+    ExtentIter it;
+    Extent extent;
+    start_extents(&it, file);
+    while (next_extent(&it, &extent)) {
+        for (int block = extent.start; block < extent.start + extent.length; block++) {
+            if (fs.block_birth[block] <= epoch) return 1;
+        }
+    }
+    for (int block = file->indirect_block; block != -1; ) {
+        if (fs.block_birth[block] <= epoch) return 1;
+        load_blocks(block, 1, 0, &block, sizeof(int));
+    }
+    return 0;
+}
+
+// Replace the content of a locked file with length bytes of data. Up to
+// INLINE_CONTENT bytes are kept in the entry, with no block. If the
+// volume compresses, the data is stored compressed when that saves at
+// least a block. If it deduplicates, blocks are shared with identical
+// ones (see store_deduped); else they are written in place where the file
+// already has the blocks, unless a snapshot has them.
+int store_content(int file_index, const char* data, size_t length) {
+    FileMetadata* file = &fs.files[file_index];
+    save_entry(file_index);
+    if (length <= INLINE_CONTENT) {
+        release_file_blocks(file);
+        set_file_blocks(file, NULL, 0, NULL, length, time(NULL));
+        memcpy(file->content, data, length);
+        file->flags = (file->flags & ~(FILE_DEDUP | FILE_COMPRESSED)) | FILE_INLINE;
+        journal_write(file_index);
+        return 0;
+    }
+    size_t blocks = (length + fs.block_size - 1) / fs.block_size;
+    char* packed = NULL;
+    size_t stored = length;
+    if (fs.compression && blocks > 1 && (packed = malloc(length))) {
+        stored = lz_compress(data, length, packed, (blocks - 1) * fs.block_size);
+        if (stored == 0) {
+            free(packed);
+            packed = NULL;
+            stored = length;
+        }
+    }
+    const char* content = packed ? packed : data;
+    int result;
+    if (fs.dedup && stored > 0) {
+        result = store_deduped(file_index, content, stored);
+    } else {
+        // Shared blocks are left, and an inline file that outgrew its entry
+        // starts from no block
+        if ((file->flags & (FILE_DEDUP | FILE_INLINE)) || file_is_frozen(file)) {
+            result = replace_blocks(file_index, stored);
+        } else {
+            result = resize_file(file_index, stored);
+        }
+        if (result != 0) {
+            printf("Error: Insufficient space\n");
+        } else {
+            copy_into_file(file, content, stored, 0);
+        }
+    }
+    if (result == 0) {
+        file->size = length;
+        file->flags = packed ? file->flags | FILE_COMPRESSED : file->flags & ~FILE_COMPRESSED;
+        journal_write(file_index);
+    }
+    free(packed);
+    return result;
+}
+
+// Write length bytes at offset into a compressed, deduplicated, inline or
+// frozen file: its content is read, changed and stored again as a whole
+int rewrite_content(int file_index, const char* data, size_t length, size_t offset) {
+    FileMetadata* file = &fs.files[file_index];
+    size_t size = offset + length > file->size ? offset + length : file->size;
+    char* content = calloc(size, 1);
+    if (!content) {
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    int result = -1;
+    if (copy_from_file(file, content, file->size, 0) != -1) {
+        memcpy(content + offset, data, length);
+        result = store_content(file_index, content, size);
+    }
+    free(content);
+    return result;
+}
+
+// Write length bytes at offset into a locked file, growing it if they go
+// past its end. A gap between the old end and offset reads as zeros.
+int write_at(int file_index, const char* data, size_t length, size_t offset) {
+    FileMetadata* file = &fs.files[file_index];
+    if ((file->flags & (FILE_COMPRESSED | FILE_DEDUP | FILE_INLINE)) || file_is_frozen(file)) {
+        return rewrite_content(file_index, data, length, offset);
+    }
+    save_entry(file_index);
+    size_t old_size = file->size;
+    if (offset + length > old_size) {
+        if (resize_file(file_index, offset + length) != 0) {
+            printf("Error: Insufficient space\n");
+            return -1;
+        }
+        if (offset > old_size) {
+            copy_into_file(file, NULL, offset - old_size, old_size);
+        }
+    }
+    copy_into_file(file, data, length, offset);
+    file->modified = time(NULL);
+    journal_write(file_index);
+    return 0;
+}
+
+// Replace the content of a file with length bytes of data, in place
+// where the file already has the blocks, compressed if the volume
+// compresses (see store_content)
+int write_file_data(const char* filename, const char* data, size_t length) {
+    double start = start_timing(OP_WRITE);
+    begin_op();
+    int file_index = lock_file(filename, 1);
+    int result = -1;
+    if (file_index != -1) {
+        result = store_content(file_index, data, length);
+        unlock_inode(file_index, 1);
+    }
+    end_op();
+    count_op(OP_WRITE, start, result == 0 ? (long long)length : 0, result != 0);
+    return result;
+}
+
+// Replace the content of a file with a string, its NUL included
+int write_file(const char* filename, const char* content) {
+    return write_file_data(filename, content, strlen(content) + 1);
+}
+
+// Write length bytes of data at offset, growing the file if they go past
+// its end. A gap between the old end and offset reads as zeros.
+int pwrite_file(const char* filename, const char* data, size_t length, size_t offset) {
+    double start = start_timing(OP_WRITE);
+    begin_op();
+    int file_index = lock_file(filename, 1);
+    int result = -1;
+    if (file_index != -1) {
+        result = write_at(file_index, data, length, offset);
+        unlock_inode(file_index, 1);
+    }
+    end_op();
+    count_op(OP_WRITE, start, result == 0 ? (long long)length : 0, result != 0);
+    return result;
+}
+
+// Snapshots. Taking one copies nothing: the volume then saves each entry
+// before its first change (save_entry), holds the blocks it frees that
+// the snapshot still uses (retire_blocks), and stores a file with such
+// blocks in new ones when it is written (file_is_frozen). A snapshot is
+// read through paths starting with @ and its name, e.g. @monday/notes,
+// and lasts while the volume is open.
+
+// Index of the snapshot with a name, -1 if there is none
+int find_snapshot(const char* name) {
+    for (int k = 0; k < fs.num_snapshots; k++) {
+        if (strcmp(fs.snapshots[k].name, name) == 0) return k;
+    }
+    return -1;
+}
+
+// Slot i as snapshot k sees it: the oldest copy saved for k or a later
+// snapshot, else the live entry. snap_lock is held.
+const FileMetadata* snapshot_entry(int k, int i) {
+    const FileMetadata* entry = &fs.files[i];
+    for (int c = fs.saved_head[i] - 1; c != -1 && fs.saved[c].epoch >= fs.snapshots[k].epoch;
+         c = fs.saved[c].next) {
+        entry = &fs.saved[c].entry;
+    }
+    return entry;
+}
+
+// Walk a path into a snapshot, "@name" then a path from its root. Its
+// directories are searched entry by entry, the name index being only the
+// live one. The caller is in an operation and holds snap_lock. Returns
+// the slot found, or -1, with the snapshot's index in snapshot.
+int walk_snapshot(const char* path, int* snapshot) {
+    char component[MAX_FILENAME];
+    size_t length = strcspn(++path, "/");
+    if (length >= MAX_FILENAME) return -1;
+    memcpy(component, path, length);
+    component[length] = '\0';
+    path += length;
+    int k = *snapshot = find_snapshot(component);
+    if (k == -1) return -1;
+
+    int i = 0;
+    while (1) {
+        while (*path == '/') path++;
+        length = strcspn(path, "/");
+        if (length == 0) return i;
+        if (length >= MAX_FILENAME || !snapshot_entry(k, i)->is_directory) return -1;
+        memcpy(component, path, length);
+        component[length] = '\0';
+        path += length;
+        if (strcmp(component, "..") == 0) {
+            i = snapshot_entry(k, i)->parent_dir;
+        } else if (strcmp(component, ".") != 0) {
+            unsigned int name_hash = hash_name(component);
+            int child = snapshot_entry(k, i)->first_child;
+            while (child != -1) {
+                const FileMetadata* file = snapshot_entry(k, child);
+                if (file->name_hash == name_hash && strcmp(file->filename, component) == 0) {
+                    break;
+                }
+                child = file->next_sibling;
+            }
+            if (child == -1) return -1;
+            i = child;
+        }
+    }
+}
+
+// Find the file at a path for reading: a live file, locked, or a file of
+// a snapshot, copied to copy; the blocks of a snapshot are not written,
+// so the copy stays valid. The caller is in an operation. Returns the
+// file, or NULL with an error printed, and sets file_index to the slot to
+// unlock, -1 if none.
+const FileMetadata* lock_readable(const char* path, FileMetadata* copy, int* file_index) {
+    *file_index = -1;
+    if (path[0] != '@') {
+        *file_index = lock_file(path, 0);
+        return *file_index == -1 ? NULL : &fs.files[*file_index];
+    }
+    int k;
+    read_lock(&fs.snap_lock);
+    int i = walk_snapshot(path, &k);
+    if (i != -1) *copy = *snapshot_entry(k, i);
+    read_unlock(&fs.snap_lock);
+    if (i == -1) {
+        printf("Error: File not found\n");
+        return NULL;
+    }
+    if (copy->is_directory) {
+        printf("Error: Cannot read a directory\n");
+        return NULL;
+    }
+    return copy;
+}
+
+// List a directory of a snapshot as list_directory() lists a live one.
+// Returns 0, or -1 if there is no such directory.
+int list_snapshot_directory(const char* path) {
+    int k;
+    begin_op();
+    read_lock(&fs.snap_lock);
+    int dir_index = walk_snapshot(path, &k);
+    if (dir_index == -1 || !snapshot_entry(k, dir_index)->is_directory) {
+        read_unlock(&fs.snap_lock);
+        end_op();
+        printf("Error: Directory not found\n");
+        return -1;
+    }
+    printf("\nContents of directory %s:\n", path);
+    printf("Name | Size | Type | Last Modified\n");
+    printf("----------------------------------------\n");
+    for (int i = snapshot_entry(k, dir_index)->first_child; i != -1; ) {
+        const FileMetadata* file = snapshot_entry(k, i);
+        char date_str[26];
+        strcpy(date_str, ctime(&file->modified));
+        date_str[24] = '\0';  // Remove newline
+        printf("%s | %llu | %s | %s\n", file->filename, (unsigned long long)file->size,
+               file->is_directory ? "DIR" : "FILE", date_str);
+        i = file->next_sibling;
+    }
+    read_unlock(&fs.snap_lock);
+    end_op();
+    return 0;
+}
+
+// Set up what snapshots need, for the first one. Returns 0, or -1 if
+// there is not enough memory.
+int init_snapshots() {
+    fs.saved_head = calloc(fs.max_files, sizeof(int));
+    fs.block_birth = calloc(fs.num_blocks, sizeof(unsigned int));
+    if (!fs.saved_head || !fs.block_birth) {
+        free(fs.saved_head);
+        free(fs.block_birth);
+        fs.saved_head = NULL;
+        fs.block_birth = NULL;
+        printf("Error: Out of memory for the snapshots\n");
+        return -1;
+    }
+    fs.saved_free = -1;
+    return 0;
+}
+
+// Take a snapshot of the volume. Other operations are only held off to
+// drain the allocation caches. Returns 0, or -1 on error.
+int take_snapshot(const char* name) {
+    if (name[0] == '\0' || strlen(name) >= MAX_FILENAME || strchr(name, '/')) {
+        printf("Error: Invalid snapshot name\n");
+        return -1;
+    }
+    write_lock(&fs.table_lock);
+    int result = -1;
+    if (find_snapshot(name) != -1) {
+        printf("Error: A snapshot with this name already exists\n");
+    } else if (fs.num_snapshots == MAX_SNAPSHOTS) {
+        printf("Error: Maximum number of snapshots reached\n");
+    } else if (fs.saved_head || init_snapshots() == 0) {
+        // Cached blocks are handed out after the snapshot: they go back,
+        // to be allocated again in the new epoch
+        drain_alloc_caches();
+        Snapshot* snap = &fs.snapshots[fs.num_snapshots++];
+        memset(snap, 0, sizeof(Snapshot));
+        strcpy(snap->name, name);
+        snap->epoch = fs.epoch++;
+        snap->created = time(NULL);
+        snap->first_saved = -1;
+        result = 0;
+    }
+    write_unlock(&fs.table_lock);
+    return result;
+}
+
+// Unlink a saved copy from the list of its slot and put it back in the pool
+void drop_saved(int copy) {
+    int slot = fs.saved[copy].slot;
+    int c = fs.saved_head[slot] - 1;
+    if (c == copy) {
+        fs.saved_head[slot] = fs.saved[copy].next + 1;
+    } else {
+        while (fs.saved[c].next != copy) c = fs.saved[c].next;
+        fs.saved[c].next = fs.saved[copy].next;
+    }
+    fs.saved[copy].next = fs.saved_free;
+    fs.saved_free = copy;
+}
+
+// Delete a snapshot. The copies and blocks it keeps pass to the snapshot
+// before it where that one sees them too, else they go.
+// Returns 0, or -1 if there is no such snapshot.
+int delete_snapshot(const char* name) {
+    write_lock(&fs.table_lock);
+    int k = find_snapshot(name);
+    if (k == -1) {
+        write_unlock(&fs.table_lock);
+        printf("Error: Snapshot not found\n");
+        return -1;
+    }
+    Snapshot* snap = &fs.snapshots[k];
+    Snapshot* prev = k > 0 ? &fs.snapshots[k - 1] : NULL;
+    for (int c = snap->first_saved; c != -1; ) {
+        int next = fs.saved[c].snap_next;
+        int older = fs.saved[c].next;
+        if (prev && (older == -1 || fs.saved[older].epoch != prev->epoch)) {
+            // The entry did not change between the two: it is prev's too
+            fs.saved[c].epoch = prev->epoch;
+            fs.saved[c].snap_next = prev->first_saved;
+            prev->first_saved = c;
+            prev->num_saved++;
+        } else {
+            drop_saved(c);
+        }
+        c = next;
+    }
+    for (int i = 0; i < snap->num_held; i++) {
+        if (prev) {
+            hold_or_free(prev, snap->held[i].start, snap->held[i].length);
+        } else {
+            free_blocks(snap->held[i].start, snap->held[i].length);
+        }
+    }
+    free(snap->held);
+    memmove(snap, snap + 1, (fs.num_snapshots - k - 1) * sizeof(Snapshot));
+    if (--fs.num_snapshots == 0) {  // No copy is left
+        fs.saved_used = 0;
+        fs.saved_free = -1;
+    }
+    write_unlock(&fs.table_lock);
+    return 0;
+}
+
+// Make the name index, free space and dedup index again from the file
+// table, once it was changed as a whole. No operation may be running.
+void rebuild_tables() {
+    for (int i = 0; i < fs.name_buckets; i++) {
+        fs.name_index[i] = -1;
+    }
+    memset(fs.file_keys, 0, (size_t)fs.num_slots * sizeof(FileKey));
+    memset(fs.name_tags, 0, (size_t)fs.num_slots * sizeof(unsigned int));
+    fs.num_files = 0;
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.files[i].filename[0] == '\0') continue;
+        index_file(i);
+        fs.num_files++;
+    }
+    rebuild_free_space();
+    build_dedup_index();
+    memset(fs.dentry_cache, 0, sizeof(fs.dentry_cache));
+    fs.path_generation++;
+}
+
+// Bring the volume back to a snapshot, which stays, deleting the later
+// ones. Returns 0, or -1 on error.
+int rollback_snapshot(const char* name) {
+    write_lock(&fs.table_lock);
+    int k = find_snapshot(name);
+    if (k == -1) {
+        write_unlock(&fs.table_lock);
+        printf("Error: Snapshot not found\n");
+        return -1;
+    }
+    drain_alloc_caches();
+    // The oldest copy saved for k or later is the entry as k has it
+    unsigned int epoch = fs.snapshots[k].epoch;
+    for (int i = 0; i < fs.num_slots; i++) {
+        int c;
+        while ((c = fs.saved_head[i] - 1) != -1 && fs.saved[c].epoch >= epoch) {
+            fs.files[i] = fs.saved[c].entry;
+            fs.saved_head[i] = fs.saved[c].next + 1;
+            fs.saved[c].next = fs.saved_free;
+            fs.saved_free = c;
+        }
+    }
+    // Blocks held since k are the volume's again or free
+    for (int j = k; j < fs.num_snapshots; j++) {
+        free(fs.snapshots[j].held);
+    }
+    Snapshot* snap = &fs.snapshots[k];
+    snap->first_saved = -1;
+    snap->num_saved = 0;
+    snap->held = NULL;
+    snap->num_held = snap->held_capacity = 0;
+    snap->held_blocks = 0;
+    fs.num_snapshots = k + 1;
+    rebuild_tables();
+    if (fs.files[fs.current_dir].filename[0] == '\0' || !fs.files[fs.current_dir].is_directory) {
+        fs.current_dir = 0;
+    }
+
+    int result = 0;
+    if (fs.mapped && fs.journal_mode != JOURNAL_OFF && checkpoint_volume(0) != 0) {
+        printf("Error: Cannot write the volume image\n");
+        result = -1;
+    }
+    write_unlock(&fs.table_lock);
+    return result;
+}
+
+// Start a view of an entry, whose lock the caller holds.
+// Returns 0, or -1 on error.
+int start_view(const FileMetadata* file, FileView* view) {
+    start_extents(&view->it, file);
+    view->run.length = 0;
+    view->frame = -1;
+    view->unpacked = NULL;
+    view->left = file->size;
+    if ((file->flags & (FILE_COMPRESSED | FILE_INLINE)) && file->size > 0) {
+        // Decompressed, or copied out of the entry, which may change once
+        // the file is unlocked
+        view->unpacked = malloc(file->size);
+        if (!view->unpacked) {
+            printf("Error: Memory allocation failed\n");
+            return -1;
+        }
+        if (file->flags & FILE_INLINE) {
+            memcpy(view->unpacked, file->content, file->size);
+        } else if (unpack_file(file, view->unpacked) != 0) {
+            free(view->unpacked);
+            view->unpacked = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Start a read-only view of a file's content. The runs returned by
+// next_view() point straight into the block store and stay valid until
+// the file is written or deleted; views take no lock, so with several
+// threads they are only for files no other thread writes (else use
+// read_into). With a block cache, each run is one block, pinned in the
+// cache until the next call or end_view(). A compressed file is
+// decompressed into memory of the view's own, returned as one run. Files
+// of snapshots can be viewed too, and their runs stay valid while the
+// snapshot lasts. end_view() must be called once done. Returns 0, or -1
+// on error.
+int view_file(const char* filename, FileView* view) {
+    double start = start_timing(OP_READ);
+    begin_op();
+    int file_index;
+    const FileMetadata* file = lock_readable(filename, &view->entry, &file_index);
+    view->run.length = 0;
+    view->frame = -1;
+    view->unpacked = NULL;
+    int result = -1;
+    if (file) {
+        result = start_view(file, view);
+        if (file_index != -1) unlock_inode(file_index, 0);
+    }
+    end_op();
+    count_op(OP_READ, start, result == 0 ? (long long)view->left : 0, result != 0);
+    return result;
+}
+
+// Release what a view holds
+void end_view(FileView* view) {
+    if (view->frame != -1) {
+        unpin_frame(view->frame);
+        view->frame = -1;
+    }
+    free(view->unpacked);
+    view->unpacked = NULL;
+}
+
+// Get the next run of a view. Returns 1, or 0 once the content is done,
+// or early (with left above 0) if a block could not be read.
+int next_view(FileView* view, const char** data, size_t* length) {
+    if (view->frame != -1) {
+        unpin_frame(view->frame);
+        view->frame = -1;
+    }
+    if (view->left == 0) return 0;
+    if (view->unpacked) {
+        *data = view->unpacked;
+        *length = view->left;
+        view->left = 0;
+        return 1;
+    }
+    if (view->run.length == 0 && !next_extent(&view->it, &view->run)) return 0;
+    if (fs.cache_frames == 0) {
+        *data = block_data(view->run.start);
+        *length = (size_t)view->run.length * fs.block_size;
+        view->run.length = 0;
+    } else {
+        view->frame = pin_block(view->run.start, view->run.length);
+        if (view->frame == -1) return 0;
+        *data = frame_data(view->frame);
+        *length = fs.block_size;
+        view->run.start++;
+        view->run.length--;
+    }
+    if (*length > view->left) *length = view->left;
+    view->left -= *length;
+    return 1;
+}
+
+// Copy up to length bytes of a file from offset into a caller's buffer.
+// Returns the number of bytes copied (0 past the end), or -1 on error.
+long long read_into(const char* filename, char* buffer, size_t length, size_t offset) {
+    double start = start_timing(OP_READ);
+    begin_op();
+    FileMetadata copy;
+    int file_index;
+    const FileMetadata* file = lock_readable(filename, &copy, &file_index);
+    long long copied = -1;
+    if (file) {
+        copied = copy_from_file(file, buffer, length, offset);
+        if (file_index != -1) unlock_inode(file_index, 0);
+    }
+    end_op();
+    count_op(OP_READ, start, copied, copied == -1);
+    return copied;
+}
+
+// Read a file into a new buffer, to be freed by the caller
+char* read_file(const char* filename) {
+    double start = start_timing(OP_READ);
+    begin_op();
+    FileMetadata copy;
+    int file_index;
+    const FileMetadata* file = lock_readable(filename, &copy, &file_index);
+    char* content = NULL;
+    size_t size = 0;
+    if (file) {
+        size = file->size;
+        if (file->size == 0) {
+            printf("Error: Empty file\n");
+        } else if (!(content = malloc(file->size))) {
+            printf("Error: Memory allocation failed\n");
+        } else if (copy_from_file(file, content, file->size, 0) == -1) {
+            free(content);
+            content = NULL;
+        }
+        if (file_index != -1) unlock_inode(file_index, 0);
+    }
+    end_op();
+    count_op(OP_READ, start, content ? (long long)size : 0, content == NULL);
+    return content;
+}
+
+// Append a string to a file, continuing its text over the NUL that
+// write_file() stores rather than after it
+int append_text(const char* filename, const char* text) {
+    double start = start_timing(OP_WRITE);
+    size_t length = strlen(text) + 1;
+    begin_op();
+    int file_index = lock_file(filename, 1);
+    int result = -1;
+    if (file_index != -1) {
+        size_t offset = fs.files[file_index].size;
+        char last = 1;
+        long long got = offset > 0 ? copy_from_file(&fs.files[file_index], &last, 1, offset - 1) : 0;
+        if (got == 1 && last == '\0') offset--;
+        if (got != -1) result = write_at(file_index, text, length, offset);
+        unlock_inode(file_index, 1);
+    }
+    end_op();
+    count_op(OP_WRITE, start, result == 0 ? (long long)length : 0, result != 0);
+    return result;
+}
+
+// Delete a file
+int delete_file(const char* filename) {
+    double start = start_timing(OP_DELETE);
+    begin_op();
+    int dir_index;
+    int file_index = lock_entry(filename, 1, 1, &dir_index);
+    int result = -1;
+    size_t size = 0;
+    if (file_index == -1) {
+        printf("Error: File not found\n");
+    } else if (fs.files[file_index].is_directory) {
+        printf("Error: Use delete_directory_recursive for directories\n");
+    } else {
+        // Free blocks and clear metadata
+        size = fs.files[file_index].size;
+        remove_file(file_index);
+        journal_delete(file_index, JOURNAL_DELETE);
+        result = 0;
+    }
+    if (file_index != -1) {
+        unlock_pair(dir_index, 1, file_index, 1);
+    }
+    end_op();
+    count_op(OP_DELETE, start, (long long)size, result != 0);
+    return result;
+}
+
+// List directory contents
+void list_directory(int dir_index) {
+    char path[MAX_PATH];
+    get_full_path(dir_index, path);
+    printf("\nContents of directory %s:\n", path);
+    printf("Name | Size | Type | Last Modified\n");
+    printf("----------------------------------------\n");
+
+    begin_op();
+    read_lock(inode_lock(dir_index));
+    for (int i = fs.files[dir_index].first_child; i != -1;
+         i = fs.files[i].next_sibling) {
+        char date_str[26];
+        strcpy(date_str, ctime(&fs.files[i].modified));
+        date_str[24] = '\0';  // Remove newline
+
+        printf("%s | %llu | %s | %s\n",
+               fs.files[i].filename,
+               (unsigned long long)fs.files[i].size,
+               fs.files[i].is_directory ? "DIR" : "FILE",
+               date_str);
+    }
+    read_unlock(inode_lock(dir_index));
+    end_op();
+}
+
+// Start of the first place pattern (of length >= 1) is found in data, or
+// NULL if none
+const char* find_pattern_scalar(const char* data, size_t length, const char* pattern,
+                                size_t pattern_length) {
+    if (pattern_length > length) return NULL;
+    const char* end = data + length - pattern_length + 1;  // Past the last start
+    for (const char* p = data; (p = memchr(p, pattern[0], end - p)) != NULL; p++) {
+        if (memcmp(p, pattern, pattern_length) == 0) return p;
+    }
+    return NULL;
+}
+
+// The vector versions test 16 or 32 starts at once by comparing the first
+// and last bytes of the pattern, and compare in full where both match
+#ifdef __SSE2__
+const char* find_pattern_sse2(const char* data, size_t length, const char* pattern,
+                              size_t pattern_length) {
+    if (pattern_length > length) return NULL;
+    __m128i first = _mm_set1_epi8(pattern[0]);
+    __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+    size_t i = 0;
+    for (; i + pattern_length - 1 + 16 <= length; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i*)(data + i)));
+        __m128i b = _mm_cmpeq_epi8(
+            last, _mm_loadu_si128((const __m128i*)(data + i + pattern_length - 1)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(a, b));
+        for (; mask != 0; mask &= mask - 1) {
+            const char* p = data + i + __builtin_ctz(mask);
+            if (memcmp(p, pattern, pattern_length) == 0) return p;
+        }
+    }
+    return find_pattern_scalar(data + i, length - i, pattern, pattern_length);
+}
+#endif
+
+#ifdef HAVE_AVX2_SCAN
+__attribute__((target("avx2")))
+const char* find_pattern_avx2(const char* data, size_t length, const char* pattern,
+                              size_t pattern_length) {
+    if (pattern_length > length) return NULL;
+    __m256i first = _mm256_set1_epi8(pattern[0]);
+    __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+    size_t i = 0;
+    for (; i + pattern_length - 1 + 32 <= length; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)(data + i)));
+        __m256i b = _mm256_cmpeq_epi8(
+            last, _mm256_loadu_si256((const __m256i*)(data + i + pattern_length - 1)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        for (; mask != 0; mask &= mask - 1) {
+            const char* p = data + i + __builtin_ctz(mask);
+            if (memcmp(p, pattern, pattern_length) == 0) return p;
+        }
+    }
+    return find_pattern_scalar(data + i, length - i, pattern, pattern_length);
+}
+#endif
+
+// find_pattern_*() with the widest vectors the CPU has
+const char* find_pattern(const char* data, size_t length, const char* pattern,
+                         size_t pattern_length) {
+#ifdef HAVE_AVX2_SCAN
+    if (__builtin_cpu_supports("avx2")) {
+        return find_pattern_avx2(data, length, pattern, pattern_length);
+    }
+#endif
+#ifdef __SSE2__
+    return find_pattern_sse2(data, length, pattern, pattern_length);
+#else
+    return find_pattern_scalar(data, length, pattern, pattern_length);
+#endif
+}
+
+// Add an entry to a grep. Returns 0, or -1 if the system is out of memory.
+int add_grep_file(GrepJob* job, int file_index) {
+    if (job->num_files == job->capacity) {
+        int capacity = job->capacity ? 2 * job->capacity : 64;
+        GrepFile* files = realloc(job->files, capacity * sizeof(GrepFile));
+        if (!files) return -1;
+        job->files = files;
+        job->capacity = capacity;
+    }
+    memset(&job->files[job->num_files], 0, sizeof(GrepFile));
+    job->files[job->num_files++].file_index = file_index;
+    return 0;
+}
+
+// Add the files at or below an entry to a grep, level by level: the
+// entries are added as found, and each directory among them adds its own
+// and is then dropped. So no directory is locked while another is.
+// Returns 0, or -1 if the system is out of memory.
+int add_grep_files(GrepJob* job, int file_index) {
+    if (add_grep_file(job, file_index) != 0) return -1;
+    int kept = 0;
+    for (int k = 0; k < job->num_files; k++) {
+        int i = job->files[k].file_index;
+        if (!fs.files[i].is_directory) {
+            job->files[kept++] = job->files[k];
+            continue;
+        }
+        int result = 0;
+        read_lock(inode_lock(i));
+        for (int child = fs.files[i].first_child; child != -1 && result == 0;
+             child = fs.files[child].next_sibling) {
+            result = add_grep_file(job, child);
+        }
+        read_unlock(inode_lock(i));
+        if (result != 0) return -1;
+    }
+    job->num_files = kept;
+    return 0;
+}
+
+// Record the matches in data that start before limit, data being at offset
+// in the content. next is the first offset a match may start at, past the
+// last match. Returns 0, or -1 if the system is out of memory.
+int grep_run(const GrepJob* job, GrepFile* file, const char* data, size_t length,
+             size_t limit, size_t offset, size_t* next) {
+    size_t start = *next > offset ? *next - offset : 0;
+    while (start < limit) {
+        const char* found = find_pattern(data + start, length - start, job->pattern,
+                                         job->pattern_length);
+        if (!found || (size_t)(found - data) >= limit) break;
+        if (file->num_offsets == file->capacity) {
+            int capacity = file->capacity ? 2 * file->capacity : 16;
+            size_t* offsets = realloc(file->offsets, capacity * sizeof(size_t));
+            if (!offsets) return -1;
+            file->offsets = offsets;
+            file->capacity = capacity;
+        }
+        start = (size_t)(found - data);
+        file->offsets[file->num_offsets++] = offset + start;
+        start += job->pattern_length;
+        *next = offset + start;
+    }
+    return 0;
+}
+
+// Search one file, straight in its blocks. A match may span two runs of
+// the view, so the last pattern_length - 1 bytes seen are kept in join and
+// searched again with the start of the next run.
+void grep_file(const GrepJob* job, GrepFile* file) {
+    size_t keep = job->pattern_length - 1;
+    char* join = malloc(2 * keep + 1);
+    FileView view;
+    lock_inode(file->file_index, 0);
+    if (!join || start_view(&fs.files[file->file_index], &view) != 0) {
+        unlock_inode(file->file_index, 0);
+        free(join);
+        file->error = 1;
+        return;
+    }
+    size_t offset = 0;  // Of the run in the content
+    size_t kept = 0;    // Bytes in join before the run
+    size_t next = 0;
+    const char* data;
+    size_t length;
+    while (!file->error && next_view(&view, &data, &length)) {
+        size_t head = length < keep ? length : keep;
+        memcpy(join + kept, data, head);
+        if ((kept > 0 && grep_run(job, file, join, kept + head, kept, offset - kept, &next) != 0) ||
+            grep_run(job, file, data, length, length, offset, &next) != 0) {
+            file->error = 1;
+        }
+        if (length >= keep) {
+            memcpy(join, data + length - keep, keep);
+            kept = keep;
+        } else {
+            size_t total = kept + length;
+            kept = total < keep ? total : keep;
+            memmove(join, join + total - kept, kept);
+        }
+        offset += length;
+    }
+    if (view.left > 0) file->error = 1;  // A block could not be read
+    end_view(&view);
+    unlock_inode(file->file_index, 0);
+    free(join);
+}
+
+void* run_grep_thread(void* arg) {
+    GrepJob* job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED)) < job->num_files) {
+        grep_file(job, &job->files[i]);
+    }
+    return NULL;
+}
+
+// Print the path and offset of each place a pattern is found in the files
+// at or below an entry. The files are split among up to threads threads, or
+// as many as their size is worth if threads is 0. Returns the number of
+// matches, or -1 on error.
+long long grep_tree(const char* pattern, int file_index, int threads) {
+    GrepJob job;
+    memset(&job, 0, sizeof(job));
+    job.pattern = pattern;
+    job.pattern_length = strlen(pattern);
+    if (job.pattern_length == 0) {
+        printf("Error: Empty pattern\n");
+        return -1;
+    }
+    begin_op();
+    if (add_grep_files(&job, file_index) != 0) {
+        end_op();
+        free(job.files);
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+
+#ifndef _WIN32
+    if (threads == 0) {
+        long long bytes = 0;
+        for (int i = 0; i < job.num_files; i++) {
+            bytes += (long long)fs.files[job.files[i].file_index].size;
+        }
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (int)(1 + bytes / GREP_THREAD_BYTES);
+        if (threads > cpus) threads = (int)cpus;
+    }
+    if (threads > GREP_THREADS) threads = GREP_THREADS;
+    if (threads > job.num_files) threads = job.num_files;
+    pthread_t ids[GREP_THREADS];
+    int started = 0;
+    while (started < threads - 1 &&
+           pthread_create(&ids[started], NULL, run_grep_thread, &job) == 0) {
+        started++;
+    }
+    run_grep_thread(&job);
+    for (int t = 0; t < started; t++) pthread_join(ids[t], NULL);
+#else
+    (void)threads;
+    run_grep_thread(&job);
+#endif
+
+    long long matches = 0;
+    char path[MAX_PATH];
+    for (int i = 0; i < job.num_files; i++) {
+        GrepFile* file = &job.files[i];
+        if (file->error || file->num_offsets > 0) {
+            get_full_path(file->file_index, path);
+        }
+        if (file->error) {
+            printf("Error: Cannot read %s\n", path);
+            matches = -1;
+        }
+        for (int k = 0; k < file->num_offsets; k++) {
+            printf("%s:%llu\n", path, (unsigned long long)file->offsets[k]);
+        }
+        if (matches != -1) matches += file->num_offsets;
+        free(file->offsets);
+    }
+    end_op();
+    free(job.files);
+    return matches;
+}
+
+// Import and export. A host tree is copied entry by entry, and a tar
+// archive (ustar) is read or written as one stream. A file's content goes
+// to store_content() in one piece, from the transfer buffer or a mapping
+// of the host file, so the file gets all its blocks at once. On the way
+// out, content is written straight from the blocks, with short runs
+// gathered in the transfer buffer. In a strict journal, the importing
+// thread's records are committed in groups, as a batched journal would,
+// and the rest at the end, instead of one by one; other threads' records
+// are still committed one by one.
+#ifndef _WIN32
+
+// Read exactly length bytes. Returns 0, or -1 on error or an early end.
+int read_all(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t got = read(fd, data, length);
+        if (got <= 0) return -1;
+        data += got;
+        length -= got;
+    }
+    return 0;
+}
+
+// Write the data gathered in the transfer buffer. Returns 0, or -1 on error.
+int flush_output(Transfer* transfer) {
+    int result = write_all(transfer->out_fd, transfer->buffer, transfer->buffered);
+    transfer->buffered = 0;
+    return result;
+}
+
+// Write data to the output, gathering it in the transfer buffer unless
+// it fills the buffer by itself. Returns 0, or -1 on error.
+int put_output(Transfer* transfer, const char* data, size_t length) {
+    if (transfer->buffered + length > TRANSFER_BUFFER && flush_output(transfer) != 0) return -1;
+    if (length >= TRANSFER_BUFFER) return write_all(transfer->out_fd, data, length);
+    memcpy(transfer->buffer + transfer->buffered, data, length);
+    transfer->buffered += length;
+    return 0;
+}
+
+// Check that a host name can name an entry
+int check_import_name(const char* name, const char* host_path) {
+    if (strlen(name) >= MAX_FILENAME || name[0] == '@' || strcmp(name, "..") == 0) {
+        printf("Error: Cannot import %s: its name is too long or not allowed\n", host_path);
+        return -1;
+    }
+    return 0;
+}
+
+// The directory named name in parent_dir, made if there is none.
+// Returns its index, or -1 on error.
+int import_directory(Transfer* transfer, int parent_dir, const char* name) {
+    begin_op();
+    int i = find_file_in_dir(name, parent_dir);
+    int is_directory = i != -1 && fs.files[i].is_directory;
+    end_op();
+    if (i == -1) {
+        i = create_in_dir(parent_dir, name, 1);
+        if (i != -1) transfer->directories++;
+    } else if (!is_directory) {
+        printf("Error: %s is a file, not a directory\n", name);
+        i = -1;
+    }
+    return i;
+}
+
+// Replace the content of the file named name in parent_dir, made if there
+// is none. Returns 0, or -1 on error.
+int import_content(Transfer* transfer, int parent_dir, const char* name, const char* data,
+                   size_t length) {
+    begin_op();
+    int i = find_file_in_dir(name, parent_dir);
+    end_op();
+    if (i == -1 && (i = create_in_dir(parent_dir, name, 0)) == -1) return -1;
+    double start = start_timing(OP_WRITE);
+    begin_op();
+    lock_inode(i, 1);
+    int result = -1;
+    if (fs.files[i].is_directory) {
+        printf("Error: Cannot write to a directory\n");
+    } else {
+        result = store_content(i, data, length);
+    }
+    unlock_inode(i, 1);
+    end_op();
+    count_op(OP_WRITE, start, result == 0 ? (long long)length : 0, result != 0);
+    if (result == 0) {
+        transfer->files++;
+        transfer->bytes += length;
+    }
+    return result;
+}
+
+// Import a host file of size bytes, read into the transfer buffer if it
+// fits, else mapped. Returns 0, or -1 on error.
+int import_host_file(Transfer* transfer, int parent_dir, const char* name,
+                     const char* host_path, size_t size) {
+    int fd = open(host_path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open %s\n", host_path);
+        return -1;
+    }
+    int result = -1;
+    if (size <= TRANSFER_BUFFER) {
+        if (read_all(fd, transfer->buffer, size) != 0) {
+            printf("Error: Cannot read %s\n", host_path);
+        } else {
+            result = import_content(transfer, parent_dir, name, transfer->buffer, size);
+        }
+    } else {
+        char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Error: Cannot read %s\n", host_path);
+        } else {
+            madvise(data, size, MADV_SEQUENTIAL);
+            result = import_content(transfer, parent_dir, name, data, size);
+            munmap(data, size);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+// Import the entries of the host directory host_path into dir_index.
+// host_path has room for HOST_PATH bytes, and entries' names are added
+// after its first length bytes.
+void import_host_tree(Transfer* transfer, int dir_index, char* host_path, size_t length) {
+    DIR* dir = opendir(host_path);
+    if (!dir) {
+        printf("Error: Cannot open %s\n", host_path);
+        transfer->errors++;
+        return;
+    }
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        const char* name = item->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        size_t end = length + 1 + strlen(name);
+        struct stat info;
+        if (end >= HOST_PATH) {
+            printf("Error: Cannot import %s/%s: its path is too long\n", host_path, name);
+            transfer->errors++;
+            continue;
+        }
+        host_path[length] = '/';
+        strcpy(host_path + length + 1, name);
+        if (lstat(host_path, &info) != 0) {
+            printf("Error: Cannot read %s\n", host_path);
+            transfer->errors++;
+        } else if (!S_ISDIR(info.st_mode) && !S_ISREG(info.st_mode)) {
+            printf("Warning: Skipped %s: not a file or directory\n", host_path);
+        } else if (check_import_name(name, host_path) != 0) {
+            transfer->errors++;
+        } else if (S_ISREG(info.st_mode)) {
+            if (import_host_file(transfer, dir_index, name, host_path, (size_t)info.st_size) != 0) {
+                transfer->errors++;
+            }
+        } else {
+            int sub_dir = import_directory(transfer, dir_index, name);
+            if (sub_dir == -1) {
+                transfer->errors++;
+            } else {
+                import_host_tree(transfer, sub_dir, host_path, end);
+            }
+        }
+        host_path[length] = '\0';
+    }
+    closedir(dir);
+}
+
+// Sum of the bytes of a header, with its checksum field read as spaces
+unsigned int tar_checksum(const TarHeader* header) {
+    const unsigned char* bytes = (const unsigned char*)header;
+    size_t field = offsetof(TarHeader, checksum);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        sum += (i >= field && i < field + sizeof(header->checksum)) ? ' ' : bytes[i];
+    }
+    return sum;
+}
+
+// Value of an octal field of a header, or -1 if it is not one
+long long tar_number(const char* field, size_t size) {
+    size_t i = 0;
+    while (i < size && field[i] == ' ') i++;
+    if (i == size || field[i] < '0' || field[i] > '7') return -1;
+    long long value = 0;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+void set_tar_number(char* field, size_t size, long long value) {
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+// Directory that the last component of a path from an archive goes in,
+// made along with the ones before it as needed. The path is cut at its
+// last '/', and *name set to the last component, "" if there is none.
+// Returns -1 on error.
+int import_parents(Transfer* transfer, int dir_index, char* path, char** name) {
+    size_t length = strlen(path);
+    while (length > 0 && path[length - 1] == '/') path[--length] = '\0';
+    char* cursor = path;
+    while (1) {
+        while (*cursor == '/') cursor++;
+        char* slash = strchr(cursor, '/');
+        if (!slash) break;
+        *slash = '\0';
+        if (strcmp(cursor, ".") != 0) {
+            if (check_import_name(cursor, cursor) != 0) return -1;
+            dir_index = import_directory(transfer, dir_index, cursor);
+            if (dir_index == -1) return -1;
+        }
+        cursor = slash + 1;
+    }
+    *name = strcmp(cursor, ".") == 0 ? cursor + 1 : cursor;
+    return dir_index;
+}
+
+// Import the entries of a tar archive into dir_index, to which its paths
+// are relative. Files are read into the transfer buffer, or memory of
+// their own if larger. Paths too long for a header are taken from the
+// GNU long name entry before it.
+void import_archive(Transfer* transfer, int dir_index, const char* host_path) {
+    FILE* archive = fopen(host_path, "rb");
+    if (!archive) {
+        printf("Error: Cannot open %s\n", host_path);
+        transfer->errors++;
+        return;
+    }
+    setvbuf(archive, NULL, _IOFBF, TRANSFER_BUFFER);
+    char* large = NULL;
+    TarHeader header;
+    char path[HOST_PATH];
+    int long_name = 0;  // path holds the name of the next entry
+    while (fread(&header, sizeof(header), 1, archive) == 1 && header.name[0] != '\0') {
+        long long size = tar_number(header.size, sizeof(header.size));
+        if (size < 0 || tar_number(header.checksum, sizeof(header.checksum)) !=
+                            (long long)tar_checksum(&header)) {
+            printf("Error: %s is not a tar archive or is damaged\n", host_path);
+            transfer->errors++;
+            break;
+        }
+        if (long_name) {
+            long_name = 0;
+        } else if (header.prefix[0] != '\0' && memcmp(header.magic, "ustar", 6) == 0) {
+            // GNU headers ("ustar " magic) keep other fields where the prefix is
+            snprintf(path, sizeof(path), "%.155s/%.100s", header.prefix, header.name);
+        } else {
+            snprintf(path, sizeof(path), "%.100s", header.name);
+        }
+        size_t padded = (size_t)(size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        int is_file = header.type == '0' || header.type == '\0' || header.type == '7';
+        if (!is_file && header.type != '5' && header.type != 'L') {
+            printf("Warning: Skipped %s: not a file or directory\n", path);
+            if (fseeko(archive, (off_t)padded, SEEK_CUR) != 0) break;
+            continue;
+        }
+        char* data = transfer->buffer;
+        if (padded > TRANSFER_BUFFER) {
+            free(large);
+            data = large = malloc(padded);
+            if (!large) {
+                printf("Error: Memory allocation failed\n");
+                transfer->errors++;
+                break;
+            }
+        }
+        if (fread(data, 1, padded, archive) != padded) {
+            printf("Error: %s ends in the middle of %s\n", host_path, path);
+            transfer->errors++;
+            break;
+        }
+        if (header.type == 'L') {
+            size_t length = (size_t)size < sizeof(path) ? (size_t)size : sizeof(path) - 1;
+            memcpy(path, data, length);
+            path[length] = '\0';
+            long_name = 1;
+            continue;
+        }
+        char* name;
+        int parent_dir = import_parents(transfer, dir_index, path, &name);
+        if (parent_dir == -1) {
+            transfer->errors++;
+        } else if (name[0] == '\0') {
+            continue;  // The archive's top directory
+        } else if (check_import_name(name, name) != 0) {
+            transfer->errors++;
+        } else if (is_file) {
+            if (import_content(transfer, parent_dir, name, data, (size_t)size) != 0) {
+                transfer->errors++;
+            }
+        } else if (import_directory(transfer, parent_dir, name) == -1) {
+            transfer->errors++;
+        }
+    }
+    free(large);
+    fclose(archive);
+}
+
+int has_tar_suffix(const char* path) {
+    size_t length = strlen(path);
+    return length > 4 && strcmp(path + length - 4, ".tar") == 0;
+}
+
+// Import a host directory's entries, or a tar archive's (a name ending in
+// .tar), into the directory at path, made if there is none. Any other
+// host file is imported as the file at path.
+// What was imported is counted in transfer.
+// Returns 0, or -1 if something could not be imported.
+int import_path(const char* host_path, const char* path, Transfer* transfer) {
+    memset(transfer, 0, sizeof(Transfer));
+    struct stat info;
+    if (stat(host_path, &info) != 0) {
+        printf("Error: Cannot open %s\n", host_path);
+        return -1;
+    }
+    transfer->buffer = malloc(TRANSFER_BUFFER);
+    char* host = malloc(HOST_PATH);
+    if (!transfer->buffer || !host) {
+        free(transfer->buffer);
+        free(host);
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    journal_grouping = 1;
+
+    if (S_ISREG(info.st_mode) && !has_tar_suffix(host_path)) {
+        char name[MAX_FILENAME];
+        begin_op();
+        int parent_dir = resolve_parent(path, name);
+        end_op();
+        if (parent_dir == -1) {
+            printf("Error: Invalid path or directory not found\n");
+            transfer->errors++;
+        } else if (import_host_file(transfer, parent_dir, name, host_path,
+                                    (size_t)info.st_size) != 0) {
+            transfer->errors++;
+        }
+    } else {
+        int dir_index = resolve_path(path);
+        if (dir_index == -1) dir_index = create_file(path, 1);
+        if (dir_index != -1 && !fs.files[dir_index].is_directory) {
+            printf("Error: This is not a directory\n");
+            dir_index = -1;
+        }
+        if (dir_index == -1) {
+            transfer->errors++;
+        } else if (S_ISREG(info.st_mode)) {
+            import_archive(transfer, dir_index, host_path);
+        } else {
+            snprintf(host, HOST_PATH, "%s", host_path);
+            import_host_tree(transfer, dir_index, host, strlen(host));
+        }
+    }
+
+    journal_grouping = 0;
+    journal_commit();
+    free(transfer->buffer);
+    transfer->buffer = NULL;
+    free(host);
+    if (transfer->errors > 0) {
+        printf("Error: %d entries could not be imported\n", transfer->errors);
+        return -1;
+    }
+    return 0;
+}
+
+// Write the content of a file to the output. The caller is in an
+// operation. Returns 0, or -1 on error.
+int export_content(Transfer* transfer, int file_index) {
+    FileView view;
+    lock_inode(file_index, 0);
+    int result = start_view(&fs.files[file_index], &view);
+    const char* data;
+    size_t length;
+    while (result == 0 && next_view(&view, &data, &length)) {
+        result = put_output(transfer, data, length);
+    }
+    if (result == 0 && view.left > 0) result = -1;  // A block could not be read
+    if (result == 0) {
+        transfer->files++;
+        transfer->bytes += (long long)fs.files[file_index].size;
+    }
+    end_view(&view);
+    unlock_inode(file_index, 0);
+    return result;
+}
+
+// Entries of a directory, to be freed by the caller, or NULL if the system
+// is out of memory. They are copied so that the directory need not stay
+// locked while they are exported.
+int* list_children(int dir_index, int* count) {
+    read_lock(inode_lock(dir_index));
+    *count = 0;
+    for (int i = fs.files[dir_index].first_child; i != -1; i = fs.files[i].next_sibling) {
+        (*count)++;
+    }
+    int* children = malloc((*count + 1) * sizeof(int));
+    int n = 0;
+    for (int i = fs.files[dir_index].first_child; children && i != -1;
+         i = fs.files[i].next_sibling) {
+        children[n++] = i;
+    }
+    read_unlock(inode_lock(dir_index));
+    if (!children) printf("Error: Memory allocation failed\n");
+    return children;
+}
+
+// Export an entry to host_path: a directory as a host directory of its
+// entries, a file as a host file. host_path has room for HOST_PATH
+// bytes, and entries' names are added after its first length bytes.
+void export_host_tree(Transfer* transfer, int file_index, char* host_path, size_t length) {
+    if (!fs.files[file_index].is_directory) {
+        transfer->out_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (transfer->out_fd < 0 || export_content(transfer, file_index) != 0 ||
+            flush_output(transfer) != 0) {
+            printf("Error: Cannot export %s\n", host_path);
+            transfer->errors++;
+        }
+        if (transfer->out_fd >= 0) close(transfer->out_fd);
+        transfer->buffered = 0;
+        return;
+    }
+    if (mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+        printf("Error: Cannot create %s\n", host_path);
+        transfer->errors++;
+        return;
+    }
+    int count;
+    int* children = list_children(file_index, &count);
+    if (!children) {
+        transfer->errors++;
+        return;
+    }
+    for (int k = 0; k < count; k++) {
+        const char* name = fs.files[children[k]].filename;
+        size_t end = length + 1 + strlen(name);
+        if (end >= HOST_PATH) {
+            printf("Error: Cannot export %s/%s: its path is too long\n", host_path, name);
+            transfer->errors++;
+            continue;
+        }
+        host_path[length] = '/';
+        strcpy(host_path + length + 1, name);
+        // As in archives, the directories below the exported one are counted
+        if (fs.files[children[k]].is_directory) transfer->directories++;
+        export_host_tree(transfer, children[k], host_path, end);
+        host_path[length] = '\0';
+    }
+    free(children);
+}
+
+// Add an entry to the archive as name, a path of length bytes relative to
+// the exported directory, then the entries of a directory. name has room
+// for HOST_PATH bytes. The exported directory itself, of length 0, has
+// no header.
+void export_archive(Transfer* transfer, int file_index, char* name, size_t length) {
+    const FileMetadata* file = &fs.files[file_index];
+    if (length > 0) {
+        TarHeader header;
+        memset(&header, 0, sizeof(header));
+        if (file->is_directory) name[length++] = '/';
+        name[length] = '\0';
+        // A long path is split at a '/' into the prefix and name fields
+        size_t split = 0;  // Length of the prefix
+        if (length > sizeof(header.name)) {
+            split = length - sizeof(header.name) - 1;
+            while (split < length - 1 && name[split] != '/') split++;
+        }
+        if (split > sizeof(header.prefix) || (split > 0 && split >= length - 1) ||
+            file->size >= (1ull << 33)) {
+            printf("Error: Cannot export %s: it is too long or too large for the archive\n",
+                   name);
+            transfer->errors++;
+            return;
+        }
+        memcpy(header.prefix, name, split);
+        if (split > 0) split++;  // The '/' is in neither field
+        memcpy(header.name, name + split, length - split);
+        set_tar_number(header.mode, sizeof(header.mode), file->is_directory ? 0755 : 0644);
+        set_tar_number(header.uid, sizeof(header.uid), 0);
+        set_tar_number(header.gid, sizeof(header.gid), 0);
+        set_tar_number(header.size, sizeof(header.size),
+                       file->is_directory ? 0 : (long long)file->size);
+        set_tar_number(header.mtime, sizeof(header.mtime), (long long)file->modified);
+        header.type = file->is_directory ? '5' : '0';
+        memcpy(header.magic, "ustar", 6);
+        memcpy(header.version, "00", 2);
+        snprintf(header.checksum, sizeof(header.checksum), "%06o", tar_checksum(&header));
+        header.checksum[7] = ' ';
+        if (put_output(transfer, (const char*)&header, sizeof(header)) != 0) {
+            transfer->errors++;
+            return;
+        }
+        if (!file->is_directory) {
+            static const char zeros[TAR_BLOCK];
+            size_t pad = (TAR_BLOCK - file->size % TAR_BLOCK) % TAR_BLOCK;
+            if (export_content(transfer, file_index) != 0 ||
+                put_output(transfer, zeros, pad) != 0) {
+                printf("Error: Cannot export %s\n", name);
+                transfer->errors++;
+            }
+            return;
+        }
+        transfer->directories++;
+    }
+    int count;
+    int* children = list_children(file_index, &count);
+    if (!children) {
+        transfer->errors++;
+        return;
+    }
+    for (int k = 0; k < count; k++) {
+        const char* child = fs.files[children[k]].filename;
+        size_t end = length + strlen(child);
+        if (end + 1 >= HOST_PATH) {
+            printf("Error: Cannot export %s%s: its path is too long\n", name, child);
+            transfer->errors++;
+            continue;
+        }
+        strcpy(name + length, child);
+        export_archive(transfer, children[k], name, end);
+        name[length] = '\0';
+    }
+    free(children);
+}
+
+// Export the entry at path to host_path: as a tar archive if host_path
+// ends in .tar (a directory's entries, or a file alone), else as a host
+// directory or file. What was exported is counted in transfer.
+// Returns 0, or -1 if something could not be exported.
+int export_path(const char* path, const char* host_path, Transfer* transfer) {
+    memset(transfer, 0, sizeof(Transfer));
+    int file_index = resolve_path(path);
+    if (file_index == -1) {
+        printf("Error: File not found\n");
+        return -1;
+    }
+    transfer->buffer = malloc(TRANSFER_BUFFER);
+    char* name = malloc(HOST_PATH);
+    if (!transfer->buffer || !name) {
+        free(transfer->buffer);
+        free(name);
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    begin_op();
+    if (!has_tar_suffix(host_path)) {
+        snprintf(name, HOST_PATH, "%s", host_path);
+        export_host_tree(transfer, file_index, name, strlen(name));
+    } else if ((transfer->out_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("Error: Cannot create %s\n", host_path);
+        transfer->errors++;
+    } else {
+        static const char end[2 * TAR_BLOCK];  // An archive ends with two zero blocks
+        size_t length = 0;
+        if (!fs.files[file_index].is_directory) {
+            strcpy(name, fs.files[file_index].filename);
+            length = strlen(name);
+        }
+        name[length] = '\0';
+        export_archive(transfer, file_index, name, length);
+        if (put_output(transfer, end, sizeof(end)) != 0 || flush_output(transfer) != 0) {
+            printf("Error: Cannot write %s\n", host_path);
+            transfer->errors++;
+        }
+        close(transfer->out_fd);
+    }
+    end_op();
+
+    free(transfer->buffer);
+    transfer->buffer = NULL;
+    free(name);
+    if (transfer->errors > 0) {
+        printf("Error: %d entries could not be exported\n", transfer->errors);
+        return -1;
+    }
+    return 0;
+}
+
+#else  // No host directories on Windows
+
+int import_path(const char* host_path, const char* path, Transfer* transfer) {
+    (void)host_path; (void)path;
+    memset(transfer, 0, sizeof(Transfer));
+    printf("Error: Import is not available on Windows\n");
+    return -1;
+}
+
+int export_path(const char* path, const char* host_path, Transfer* transfer) {
+    (void)path; (void)host_path;
+    memset(transfer, 0, sizeof(Transfer));
+    printf("Error: Export is not available on Windows\n");
+    return -1;
+}
+#endif
 
-FileSystem fs;
+// Print whether writes are compressed and what the compressed files hold
+void print_compression() {
+    int files = 0;
+    long long size = 0;
+    long long blocks = 0;
+    begin_op();
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.files[i].flags & FILE_COMPRESSED) {
+            files++;
+            size += (long long)fs.files[i].size;
+            blocks += fs.files[i].num_blocks;
+        }
+    }
+    end_op();
+    printf("Compression: %s, %d files compressed, %lld bytes in %lld blocks (%.2fx)\n",
+           fs.compression ? "on" : "off", files, size, blocks,
+           blocks ? (double)size / ((double)blocks * fs.block_size) : 1.0);
+}
 
-// Initialize the file system
-void init_filesystem() {
-    memset(&fs, 0, sizeof(FileSystem));
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        fs.free_blocks[i] = 1;
+// Print how many files keep their content in their entry
+void print_inline() {
+    int files = 0;
+    long long size = 0;
+    begin_op();
+    for (int i = 0; i < fs.num_slots; i++) {
+        if (fs.file_keys[i].in_use && (fs.files[i].flags & FILE_INLINE)) {
+            files++;
+            size += (long long)fs.files[i].size;
+        }
     }
+    end_op();
+    printf("Inline files: %d, %lld bytes kept in their entries (up to %d each)\n", files, size,
+           INLINE_CONTENT);
+}
 
-    // Create the root directory
-    strcpy(fs.files[0].filename, "/");
-    fs.files[0].is_directory = 1;
-    fs.files[0].created = time(NULL);
-    fs.files[0].modified = time(NULL);
-    fs.files[0].parent_dir = 0;
-    fs.num_files = 1;
-    fs.current_dir = 0;  // Start in the root directory
+// Print whether writes are deduplicated and how many blocks it saves
+void print_dedup() {
+    read_lock(&fs.dedup_lock);
+    printf("Deduplication: %s, %d blocks indexed, %lld references, %lld blocks saved\n",
+           fs.dedup ? "on" : "off", fs.dedup_blocks, fs.dedup_refs,
+           fs.dedup_refs - fs.dedup_blocks);
+    read_unlock(&fs.dedup_lock);
 }
 
-// Get the full path of a file
-void get_full_path(int file_index, char* path) {
-    if (file_index == 0) {
-        strcpy(path, "/");
-        return;
+// Print how many snapshots there are and the blocks they hold, then with
+// list each of them
+void print_snapshots(int list) {
+    begin_op();
+    read_lock(&fs.alloc_lock);
+    read_lock(&fs.snap_lock);
+    long long held = 0;
+    int saved = 0;
+    for (int k = 0; k < fs.num_snapshots; k++) {
+        held += fs.snapshots[k].held_blocks;
+        saved += fs.snapshots[k].num_saved;
+    }
+    printf("Snapshots: %d, %lld blocks held, %d entries saved\n", fs.num_snapshots, held,
+           saved);
+    if (list && fs.num_snapshots > 0) {
+        printf("Name | Entries Saved | Blocks Held | Taken\n");
+        printf("----------------------------------------\n");
+        for (int k = 0; k < fs.num_snapshots; k++) {
+            char date_str[26];
+            strcpy(date_str, ctime(&fs.snapshots[k].created));
+            date_str[24] = '\0';  // Remove newline
+            printf("@%s | %d | %lld | %s\n", fs.snapshots[k].name, fs.snapshots[k].num_saved,
+                   fs.snapshots[k].held_blocks, date_str);
+        }
     }
+    read_unlock(&fs.snap_lock);
+    read_unlock(&fs.alloc_lock);
+    end_op();
+}
 
-    char temp_path[MAX_PATH] = "";
-    int current = file_index;
+const char* op_names[NUM_OPS] = {
+    "create", "write", "read", "delete", "lookup", "alloc", "alloc (cached)"
+};
 
-    while (current != 0) {
-        char temp[MAX_PATH];
-        snprintf(temp, sizeof(temp), "/%s%s",
-                fs.files[current].filename,
-                temp_path);
-        strcpy(temp_path, temp);
-        current = fs.files[current].parent_dir;
+// Print the operation statistics
+void print_stats(FILE* out) {
+    fprintf(out, "\nOperation      | Calls | Failed | Bytes | Avg ns | p50 ns | p99 ns | Max ns\n");
+    fprintf(out, "--------------------------------------------------------------------------\n");
+    long long allocs = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+        OpStats stats;
+        sum_op_stats(op, &stats);
+        if (op == OP_ALLOC) allocs = stats.count;
+        fprintf(out, "%-14s | %lld | %lld | %lld | %.0f | %lld | %lld | %lld\n",
+                op_names[op], stats.count, stats.failures, stats.bytes,
+                stats.timed ? (double)stats.time_ns / stats.timed : 0.0,
+                latency_percentile(&stats, 0.5), latency_percentile(&stats, 0.99),
+                stats.max_ns);
     }
 
-    strcpy(path, temp_path);
+    write_lock(&fs.alloc_lock);
+    long long steps = fs.alloc_scan_steps;
+    long long max_steps = fs.alloc_scan_max;
+    write_unlock(&fs.alloc_lock);
+    fprintf(out, "Allocator: %.1f free extents visited per allocation, %lld at most\n",
+            allocs ? (double)steps / allocs : 0.0, max_steps);
+    if (fs.cache_frames > 0) {
+        write_lock(&fs.cache_lock);
+        long long lookups = fs.cache_hits + fs.cache_misses;
+        fprintf(out, "Block cache: %lld hits, %lld misses (%.1f%% hits), %lld read ahead, "
+                "%lld evictions, %lld blocks written back\n",
+                fs.cache_hits, fs.cache_misses,
+                lookups ? 100.0 * fs.cache_hits / lookups : 0.0, fs.cache_read_ahead,
+                fs.cache_evictions, fs.cache_writebacks);
+        write_unlock(&fs.cache_lock);
+        long long batches = __atomic_load_n(&fs.io_batches, __ATOMIC_RELAXED);
+        long long requests = __atomic_load_n(&fs.io_requests, __ATOMIC_RELAXED);
+        fprintf(out, "I/O engine: %s, %lld batches of %.1f requests on average\n",
+                io_engine_name(fs.io_engine), batches,
+                batches ? (double)requests / batches : 0.0);
+    }
+    fprintf(out, "Dentry cache: %lld hits, %lld misses\n",
+            __atomic_load_n(&fs.dentry_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&fs.dentry_misses, __ATOMIC_RELAXED));
+    fprintf(out, "Times are taken on 1 call in %d; p50 and p99 are rounded up to a power of two\n",
+            STATS_SAMPLING);
 }
 
-// Find a file by its name in the current directory
-int find_file_in_dir(const char* filename, int dir_index) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index &&
-            strcmp(fs.files[i].filename, filename) == 0) {
-            return i;
-        }
+// Clear the operation statistics. Calls ending meanwhile may go uncounted.
+void reset_stats() {
+    long long* counters = (long long*)fs.op_stats;
+    for (size_t i = 0; i < sizeof(fs.op_stats) / sizeof(long long); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
     }
-    return -1;
+    write_lock(&fs.alloc_lock);
+    fs.alloc_scan_steps = 0;
+    fs.alloc_scan_max = 0;
+    write_unlock(&fs.alloc_lock);
+    write_lock(&fs.cache_lock);
+    fs.cache_hits = fs.cache_misses = fs.cache_read_ahead = 0;
+    fs.cache_evictions = fs.cache_writebacks = 0;
+    write_unlock(&fs.cache_lock);
+    __atomic_store_n(&fs.io_batches, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs.io_requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs.dentry_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs.dentry_misses, 0, __ATOMIC_RELAXED);
 }
 
-// Check if a directory is empty
-int is_directory_empty(int dir_index) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index) {
-            return 0; // Directory is not empty
+// Append the statistics to a file, after the time they were taken at.
+// Returns 0, or -1 if the file cannot be written.
+int dump_stats(const char* path) {
+    FILE* out = fopen(path, "a");
+    if (!out) return -1;
+    fprintf(out, "\nStatistics at %lld\n", (long long)time(NULL));
+    print_stats(out);
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+// Thread that dumps the statistics to a file every interval seconds
+typedef struct {
+    const char* path;
+    int interval;
+    int stop;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} StatsDumper;
+
+#ifdef _WIN32
+DWORD WINAPI run_stats_dumper(LPVOID arg) {
+#else
+void* run_stats_dumper(void* arg) {
+#endif
+    StatsDumper* dumper = arg;
+    for (int ticks = 1; !__atomic_load_n(&dumper->stop, __ATOMIC_RELAXED); ticks++) {
+#ifdef _WIN32
+        Sleep(100);
+#else
+        struct timespec pause = {0, 100000000};
+        nanosleep(&pause, NULL);
+#endif
+        if (ticks >= dumper->interval * 10) {
+            dump_stats(dumper->path);
+            ticks = 0;
         }
     }
-    return 1; // Directory is empty
+    return 0;
 }
 
-// Delete a directory and its contents recursively
-int delete_directory_recursive(int dir_index) {
-    if (!fs.files[dir_index].is_directory) {
-        printf("Error: This is not a directory\n");
+// Start dumping the statistics. Returns 0, or -1 if the file cannot be written.
+int start_stats_dumper(StatsDumper* dumper, const char* path, int interval) {
+    dumper->path = path;
+    dumper->interval = interval;
+    dumper->stop = 0;
+    if (dump_stats(path) != 0) {
+        printf("Error: Cannot write the statistics to %s\n", path);
         return -1;
     }
+#ifdef _WIN32
+    dumper->thread = CreateThread(NULL, 0, run_stats_dumper, dumper, 0, NULL);
+    return dumper->thread ? 0 : -1;
+#else
+    return pthread_create(&dumper->thread, NULL, run_stats_dumper, dumper) == 0 ? 0 : -1;
+#endif
+}
 
-    // Delete all files and subdirectories first
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index) {
-            if (fs.files[i].is_directory) {
-                delete_directory_recursive(i);
-            } else {
-                // Free the blocks of the file
-                for (int j = 0; j < fs.files[i].num_blocks; j++) {
-                    fs.free_blocks[fs.files[i].start_block + j] = 1;
-                }
-                memset(&fs.files[i], 0, sizeof(FileMetadata));
-                fs.num_files--;
-            }
-        }
-    }
+// Stop the dumping thread, then dump the final statistics
+void stop_stats_dumper(StatsDumper* dumper) {
+    __atomic_store_n(&dumper->stop, 1, __ATOMIC_RELAXED);
+#ifdef _WIN32
+    WaitForSingleObject(dumper->thread, INFINITE);
+    CloseHandle(dumper->thread);
+#else
+    pthread_join(dumper->thread, NULL);
+#endif
+    dump_stats(dumper->path);
+}
 
-    // Delete the directory itself
-    memset(&fs.files[dir_index], 0, sizeof(FileMetadata));
-    fs.num_files--;
+// Improved user interface
+void print_prompt() {
+    int length;
+    const char* path = cached_path(fs.current_dir, &length);
+    printf("\n%.*s $ ", length, path);
+}
+
+int shell_quiet = 0;  // Batch mode: only errors and requested output are printed
+
+// Print a success message, unless in batch mode
+void report(const char* message) {
+    if (!shell_quiet) printf("%s\n", message);
+}
+
+// Shell commands. Each returns 0, -1 if it failed, or 1 to leave the shell.
+int cmd_exit(char* arg1, char* arg2) {
+    (void)arg1; (void)arg2;
+    return 1;
+}
+
+void print_help();
+
+int cmd_help(char* arg1, char* arg2) {
+    (void)arg1; (void)arg2;
+    print_help();
+    return 0;
+}
+
+int cmd_pwd(char* arg1, char* arg2) {
+    (void)arg1; (void)arg2;
+    printf("%s\n", cached_path(fs.current_dir, NULL));
     return 0;
 }
 
-// Create a new file or directory
-int create_file(const char* filename, int is_directory) {
-    if (fs.num_files >= MAX_FILES) {
-        printf("Error: Maximum number of files reached\n");
+// Index of the directory at path, the current one if path is empty
+int find_directory(const char* path) {
+    int dir_index = path[0] ? resolve_path(path) : fs.current_dir;
+    if (dir_index == -1) {
+        printf("Error: Directory not found\n");
         return -1;
     }
-
-    // Check if the file already exists in the current directory
-    if (find_file_in_dir(filename, fs.current_dir) != -1) {
-        printf("Error: A file or directory with this name already exists\n");
+    if (!fs.files[dir_index].is_directory) {
+        printf("Error: This is not a directory\n");
         return -1;
     }
+    return dir_index;
+}
 
-    // Find a free slot
-    int file_slot = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] == '\0') {
-            file_slot = i;
-            break;
-        }
-    }
+int cmd_ls(char* arg1, char* arg2) {
+    (void)arg2;
+    if (arg1[0] == '@') return list_snapshot_directory(arg1);
+    int dir_index = find_directory(arg1);
+    if (dir_index == -1) return -1;
+    list_directory(dir_index);
+    return 0;
+}
 
-    if (file_slot == -1) {
-        printf("Error: No free slot available\n");
+int cmd_grep(char* arg1, char* arg2) {
+    int file_index = arg2[0] ? resolve_path(arg2) : fs.current_dir;
+    if (file_index == -1) {
+        printf("Error: File not found\n");
         return -1;
     }
+    long long matches = grep_tree(arg1, file_index, 0);
+    if (matches == -1) return -1;
+    printf("%lld found\n", matches);
+    return 0;
+}
 
-    FileMetadata* file = &fs.files[file_slot];
-    strncpy(file->filename, filename, MAX_FILENAME - 1);
-    file->size = 0;
-    file->created = time(NULL);
-    file->modified = time(NULL);
-    file->start_block = -1;
-    file->num_blocks = 0;
-    file->is_directory = is_directory;
-    file->parent_dir = fs.current_dir;
-    fs.num_files++;
+// Report what an import or export moved, unless it failed with nothing moved
+void report_transfer(const char* verb, int result, const Transfer* transfer, double start) {
+    if (result != 0 && transfer->files == 0 && transfer->directories == 0) return;
+    char message[128];
+    snprintf(message, sizeof(message), "%s %d files and %d directories, %lld bytes in %.2f s",
+             verb, transfer->files, transfer->directories, transfer->bytes,
+             (now_ns() - start) / 1e9);
+    report(message);
+}
 
-    return file_slot;
+int cmd_import(char* arg1, char* arg2) {
+    Transfer transfer;
+    double start = now_ns();
+    int result = import_path(arg1, arg2, &transfer);
+    report_transfer("Imported", result, &transfer, start);
+    return result;
 }
 
-// Write to a file
-int write_file(const char* filename, const char* content) {
-    int file_index = find_file_in_dir(filename, fs.current_dir);
-    if (file_index == -1) {
-        printf("Error: File not found\n");
+int cmd_export(char* arg1, char* arg2) {
+    Transfer transfer;
+    double start = now_ns();
+    int result = export_path(arg1, arg2, &transfer);
+    report_transfer("Exported", result, &transfer, start);
+    return result;
+}
+
+int cmd_df(char* arg1, char* arg2) {
+    (void)arg1; (void)arg2;
+    print_free_space();
+    print_compression();
+    print_inline();
+    print_dedup();
+    print_snapshots(0);
+    return 0;
+}
+
+int cmd_sync(char* arg1, char* arg2) {
+    (void)arg1; (void)arg2;
+    if (!fs.mapped) {
+        report("Nothing to sync: the volume has no image file");
+        return 0;
+    }
+    if (sync_volume() != 0) {
+        printf("Error: Cannot write the volume image\n");
         return -1;
     }
+    report("Volume image synced");
+    return 0;
+}
 
-    if (fs.files[file_index].is_directory) {
-        printf("Error: Cannot write to a directory\n");
+int cmd_journal(char* arg1, char* arg2) {
+    (void)arg2;
+    if (fs.journal_mode == JOURNAL_OFF) {
+        printf("The volume has no journal\n");
+        return 0;
+    }
+    if (strcmp(arg1, "strict") == 0) {
+        journal_commit();
+        fs.journal_mode = JOURNAL_STRICT;
+    } else if (strcmp(arg1, "batched") == 0) {
+        fs.journal_mode = JOURNAL_BATCHED;
+    } else if (arg1[0] != '\0') {
+        printf("Usage: journal [strict|batched]\n");
         return -1;
     }
+    print_journal();
+    return 0;
+}
 
-    size_t content_length = strlen(content) + 1;
-    int blocks_needed = (content_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+// 1 for "on", 0 for "off", else -1
+int parse_switch(const char* text) {
+    if (strcmp(text, "on") == 0) return 1;
+    if (strcmp(text, "off") == 0) return 0;
+    return -1;
+}
 
-    // Free old blocks if the file existed already
-    if (fs.files[file_index].start_block != -1) {
-        for (int i = 0; i < fs.files[file_index].num_blocks; i++) {
-            fs.free_blocks[fs.files[file_index].start_block + i] = 1;
+int cmd_compress(char* arg1, char* arg2) {
+    (void)arg2;
+    if (arg1[0] != '\0') {
+        int on = parse_switch(arg1);
+        if (on == -1) {
+            printf("Usage: compress [on|off]\n");
+            return -1;
         }
+        fs.compression = on;
     }
+    print_compression();
+    return 0;
+}
 
-    // Find contiguous blocks
-    int start_block = -1;
-    int consecutive_blocks = 0;
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (fs.free_blocks[i]) {
-            if (consecutive_blocks == 0) start_block = i;
-            consecutive_blocks++;
-            if (consecutive_blocks == blocks_needed) break;
-        } else {
-            consecutive_blocks = 0;
+int cmd_dedup(char* arg1, char* arg2) {
+    (void)arg2;
+    if (arg1[0] != '\0') {
+        int on = parse_switch(arg1);
+        if (on == -1) {
+            printf("Usage: dedup [on|off]\n");
+            return -1;
         }
+        fs.dedup = on;
     }
+    print_dedup();
+    return 0;
+}
 
-    if (consecutive_blocks < blocks_needed) {
-        printf("Error: Insufficient space\n");
-        return -1;
+int cmd_snapshot(char* arg1, char* arg2) {
+    (void)arg2;
+    if (arg1[0] == '\0') {
+        print_snapshots(1);
+        return 0;
     }
+    if (take_snapshot(arg1) != 0) return -1;
+    report("Snapshot taken");
+    return 0;
+}
 
-    // Allocate blocks and write the content
-    for (int i = 0; i < blocks_needed; i++) {
-        fs.free_blocks[start_block + i] = 0;
-        size_t to_write = (i == blocks_needed - 1) ?
-            content_length - (i * BLOCK_SIZE) : BLOCK_SIZE;
-        memcpy(fs.blocks[start_block + i], content + (i * BLOCK_SIZE), to_write);
-    }
+int cmd_rollback(char* arg1, char* arg2) {
+    (void)arg2;
+    if (rollback_snapshot(arg1) != 0) return -1;
+    report("Volume rolled back to the snapshot");
+    return 0;
+}
 
-    fs.files[file_index].start_block = start_block;
-    fs.files[file_index].num_blocks = blocks_needed;
-    fs.files[file_index].size = content_length;
-    fs.files[file_index].modified = time(NULL);
+int cmd_unsnapshot(char* arg1, char* arg2) {
+    (void)arg2;
+    if (delete_snapshot(arg1) != 0) return -1;
+    report("Snapshot deleted");
+    return 0;
+}
 
+int cmd_mkdir(char* arg1, char* arg2) {
+    (void)arg2;
+    if (create_file(arg1, 1) < 0) return -1;
+    report("Directory created successfully");
     return 0;
 }
 
-// Read a file
-char* read_file(const char* filename) {
-    int file_index = find_file_in_dir(filename, fs.current_dir);
-    if (file_index == -1) {
-        printf("Error: File not found\n");
-        return NULL;
-    }
+int cmd_cd(char* arg1, char* arg2) {
+    (void)arg2;
+    int dir_index = find_directory(arg1);  // ".." goes up, staying at root
+    if (dir_index == -1) return -1;
+    fs.current_dir = dir_index;
+    return 0;
+}
 
-    if (fs.files[file_index].is_directory) {
-        printf("Error: Cannot read a directory\n");
-        return NULL;
-    }
+int cmd_create(char* arg1, char* arg2) {
+    (void)arg2;
+    if (create_file(arg1, 0) < 0) return -1;
+    report("File created successfully");
+    return 0;
+}
+
+int cmd_write(char* arg1, char* arg2) {
+    if (write_file(arg1, arg2) != 0) return -1;
+    report("Content written successfully");
+    return 0;
+}
+
+int cmd_append(char* arg1, char* arg2) {
+    if (append_text(arg1, arg2) != 0) return -1;
+    report("Content appended successfully");
+    return 0;
+}
 
-    if (fs.files[file_index].start_block == -1) {
+int cmd_read(char* arg1, char* arg2) {
+    (void)arg2;
+    FileView view;
+    if (view_file(arg1, &view) != 0) return -1;
+    if (view.left == 0) {
+        end_view(&view);
         printf("Error: Empty file\n");
-        return NULL;
+        return -1;
     }
-
-    char* content = malloc(fs.files[file_index].size);
-    if (!content) {
-        printf("Error: Memory allocation failed\n");
-        return NULL;
+    // Print straight from the blocks, up to the first NUL as before
+    const char* data;
+    size_t length;
+    int result = 0;
+    printf("Content: ");
+    while (1) {
+        if (!next_view(&view, &data, &length)) {
+            if (view.left > 0) result = -1;  // A block could not be read
+            break;
+        }
+        size_t text = strnlen(data, length);
+        fwrite(data, 1, text, stdout);
+        if (text < length) break;
     }
+    end_view(&view);
+    printf("\n");
+    if (result != 0) printf("Error: Cannot read %s\n", arg1);
+    return result;
+}
 
-    size_t total_read = 0;
-    for (int i = 0; i < fs.files[file_index].num_blocks; i++) {
-        size_t to_read = (i == fs.files[file_index].num_blocks - 1) ?
-            fs.files[file_index].size - (i * BLOCK_SIZE) : BLOCK_SIZE;
-        memcpy(content + total_read,
-               fs.blocks[fs.files[file_index].start_block + i],
-               to_read);
-        total_read += to_read;
+int cmd_delete(char* arg1, char* arg2) {
+    (void)arg2;
+    int index = resolve_path(arg1);
+    if (index == -1) {
+        printf("Error: File or directory not found\n");
+        return -1;
+    }
+    if (index == 0) {
+        printf("Error: Cannot delete the root directory\n");
+        return -1;
+    }
+    if (is_ancestor(index, fs.current_dir)) {
+        printf("Error: Cannot delete the current directory or its parents\n");
+        return -1;
     }
 
-    return content;
+    if (fs.files[index].is_directory) {
+        if (delete_directory_recursive(index) != 0) return -1;
+        report("Directory and its contents deleted successfully");
+    } else {
+        if (delete_file(arg1) != 0) return -1;
+        report("File deleted successfully");
+    }
+    return 0;
 }
 
-// Delete a file
-int delete_file(const char* filename) {
-    int file_index = find_file_in_dir(filename, fs.current_dir);
-    if (file_index == -1) {
-        printf("Error: File not found\n");
+int cmd_stats(char* arg1, char* arg2) {
+    (void)arg2;
+    if (strcmp(arg1, "reset") == 0) {
+        reset_stats();
+        report("Statistics cleared");
+    } else if (arg1[0] != '\0') {
+        printf("Usage: stats [reset]\n");
         return -1;
+    } else {
+        print_stats(stdout);
     }
+    return 0;
+}
 
-    if (fs.files[file_index].is_directory) {
-        printf("Error: Use delete_directory_recursive for directories\n");
-        return -1;
+typedef struct {
+    const char* name;
+    const char* arguments;    // As shown by help and usage messages
+    const char* description;
+    int required;             // Arguments that must be given
+    int (*run)(char* arg1, char* arg2);
+} Command;
+
+const Command commands[] = {
+    {"mkdir", "<path>", "Create a directory", 1, cmd_mkdir},
+    {"cd", "<path>", "Change directory, .. goes up one level", 1, cmd_cd},
+    {"create", "<path>", "Create a file", 1, cmd_create},
+    {"write", "<path> <content>", "Write to a file", 2, cmd_write},
+    {"append", "<path> <content>", "Append to a file", 2, cmd_append},
+    {"read", "<path>", "Read a file", 1, cmd_read},
+    {"delete", "<path>", "Delete a file or directory", 1, cmd_delete},
+    {"ls", "[path]", "List directory contents", 0, cmd_ls},
+    {"grep", "<pattern> [path]", "Find where the files below a path hold a pattern", 1,
+     cmd_grep},
+    {"import", "<host path> <path>", "Copy a host directory, .tar archive or file in", 2,
+     cmd_import},
+    {"export", "<path> <host path>", "Copy a directory or file out, to a .tar archive if so named",
+     2, cmd_export},
+    {"pwd", "", "Display current path", 0, cmd_pwd},
+    {"df", "", "Display free space and fragmentation", 0, cmd_df},
+    {"sync", "", "Write the volume image to disk", 0, cmd_sync},
+    {"journal", "[strict|batched]", "Display or change the journal mode", 0, cmd_journal},
+    {"compress", "[on|off]", "Display or change whether writes are compressed", 0, cmd_compress},
+    {"dedup", "[on|off]", "Display or change whether writes share identical blocks", 0,
+     cmd_dedup},
+    {"snapshot", "[name]", "Take a snapshot, read as @name/path, or list them", 0,
+     cmd_snapshot},
+    {"rollback", "<name>", "Bring the volume back to a snapshot, deleting later ones", 1,
+     cmd_rollback},
+    {"unsnapshot", "<name>", "Delete a snapshot", 1, cmd_unsnapshot},
+    {"stats", "[reset]", "Display or clear the operation statistics", 0, cmd_stats},
+    {"help", "", "Display help", 0, cmd_help},
+    {"exit", "", "Quit", 0, cmd_exit},
+};
+
+#define NUM_COMMANDS ((int)(sizeof(commands) / sizeof(commands[0])))
+
+const Command* find_command(const char* name) {
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        if (commands[i].name[0] == name[0] && strcmp(commands[i].name, name) == 0) {
+            return &commands[i];
+        }
     }
+    return NULL;
+}
 
-    // Free blocks
-    for (int i = 0; i < fs.files[file_index].num_blocks; i++) {
-        fs.free_blocks[fs.files[file_index].start_block + i] = 1;
+void print_help() {
+    printf("\nAvailable commands:\n");
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        printf("%s%s%s : %s\n", commands[i].name, commands[i].arguments[0] ? " " : "",
+               commands[i].arguments, commands[i].description);
     }
+}
 
-    // Clear metadata
-    memset(&fs.files[file_index], 0, sizeof(FileMetadata));
-    fs.num_files--;
+// Cut the next space-separated word out of the line, in place
+char* next_word(char** cursor) {
+    char* p = *cursor;
+    while (*p == ' ' || *p == '\t') p++;
+    char* word = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t') p++;
+    if (*p != '\0') *p++ = '\0';
+    *cursor = p;
+    return word;
+}
 
-    return 0;
+// Split a command line in place without copying: the command and first
+// argument are single words, the second argument is the rest of the line.
+// Missing parts are left empty.
+void split_line(char* line, char** command, char** arg1, char** arg2) {
+    char* cursor = line;
+    *command = next_word(&cursor);
+    *arg1 = next_word(&cursor);
+    while (*cursor == ' ' || *cursor == '\t') cursor++;
+    *arg2 = cursor;
 }
 
-// List directory contents
-void list_directory(int dir_index) {
-    char path[MAX_PATH];
-    get_full_path(dir_index, path);
-    printf("\nContents of directory %s:\n", path);
-    printf("Name | Size | Type | Last Modified\n");
-    printf("----------------------------------------\n");
+// Read the next line of input without its line ending. Returns 1, 0 at
+// the end of the input, or -1 if the line does not fit (it is skipped).
+int read_line(FILE* input, char* line, int size) {
+    if (fgets(line, size, input) == NULL) return 0;
+    size_t length = strlen(line);
+    if (length > 0 && line[length - 1] == '\n') {
+        line[--length] = '\0';
+        if (length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+        return 1;
+    }
+    if (feof(input)) return 1;
+    int c;
+    while ((c = fgetc(input)) != EOF && c != '\n') {}
+    return -1;
+}
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.files[i].filename[0] != '\0' &&
-            fs.files[i].parent_dir == dir_index) {
-            char date_str[26];
-            strcpy(date_str, ctime(&fs.files[i].modified));
-            date_str[24] = '\0';  // Remove newline
+// Run one command line. Returns 0, -1 if it failed, or 1 to leave the shell.
+int run_line(char* line) {
+    char* command;
+    char* arg1;
+    char* arg2;
+    split_line(line, &command, &arg1, &arg2);
+    if (command[0] == '\0' || command[0] == '#') return 0;  // Blank or comment
 
-            printf("%s | %llu | %s | %s\n",
-                   fs.files[i].filename,
-                   (unsigned long long)fs.files[i].size,
-                   fs.files[i].is_directory ? "DIR" : "FILE",
-                   date_str);
-        }
+    const Command* entry = find_command(command);
+    if (entry == NULL) {
+        printf("Unrecognized command. Type 'help' for the list of commands.\n");
+        return -1;
+    }
+    if ((entry->required >= 1 && arg1[0] == '\0') ||
+        (entry->required >= 2 && arg2[0] == '\0')) {
+        printf("Usage: %s %s\n", entry->name, entry->arguments);
+        return -1;
     }
+    return entry->run(arg1, arg2);
 }
 
-// Improved user interface
-void print_prompt() {
-    char current_path[MAX_PATH];
-    get_full_path(fs.current_dir, current_path);
-    printf("\n%s $ ", current_path);
+int input_is_terminal(FILE* input) {
+#ifdef _WIN32
+    return _isatty(_fileno(input));
+#else
+    return isatty(fileno(input));
+#endif
 }
 
-void print_help() {
-    printf("\nAvailable commands:\n");
-    printf("mkdir <name> : Create a directory\n");
-    printf("cd <name> : Change directory\n");
-    printf("cd .. : Go up one level\n");
-    printf("create <name> : Create a file\n");
-    printf("write <name> <content> : Write to a file\n");
-    printf("read <name> : Read a file\n");
-    printf("delete <name> : Delete a file or directory\n");
-    printf("ls : List directory contents\n");
-    printf("pwd : Display current path\n");
-    printf("help : Display help\n");
-    printf("exit : Quit\n");
-}
-
-int main() {
-    init_filesystem();
-    char command[MAX_PATH];
-    char arg1[MAX_PATH];
-    char arg2[MAX_PATH];
-
-    printf("File system initialized. Type 'help' for the list of commands.\n");
+// Parse a size in bytes with an optional K, M or G suffix, -1 if invalid
+long long parse_size(const char* text) {
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    if (end == text || size < 0) return -1;
+    switch (*end) {
+        case 'K': case 'k': size <<= 10; end++; break;
+        case 'M': case 'm': size <<= 20; end++; break;
+        case 'G': case 'g': size <<= 30; end++; break;
+    }
+    return *end == '\0' ? size : -1;
+}
 
-    while (1) {
-        print_prompt();
+void print_usage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("--block-size <bytes> : Block size (default %d)\n", DEFAULT_BLOCK_SIZE);
+    printf("--volume-size <bytes>[K|M|G] : Volume size (default %d blocks)\n",
+           DEFAULT_NUM_BLOCKS);
+    printf("--files <count> : Initial entries of the file table (default %d)\n",
+           DEFAULT_NUM_FILES);
+    printf("--max-files <count> : Entries the file table may grow to "
+           "(default: one per block)\n");
+    printf("--image <path> : Keep the volume in an image file, created with\n"
+           "                 the options above if it does not exist\n");
+    printf("--journal off|batched|strict : Journal of the image (default batched)\n");
+    printf("--block-cache <bytes>[K|M|G] : Reach the blocks of the image through a\n"
+           "                               cache of this size instead of mapping them\n");
+    printf("--io uring|threads|sync : How the block cache reads and writes the image:\n"
+           "                          io_uring, a pool of threads or plain system calls\n"
+           "                          (default uring, falling back as it can)\n");
+    printf("--compression on|off : Compress what write stores (default: off, or\n"
+           "                       as last set for the image)\n");
+    printf("--dedup on|off : Share the blocks of identical content among files\n"
+           "                 (default: off, or as last set for the image)\n");
+    printf("--batch <script> : Run the commands of a file, - for standard input,\n"
+           "                   printing only errors and requested output\n");
+    printf("--stats-file <path> : Append the operation statistics to a file\n");
+    printf("--stats-interval <seconds> : How often they are appended (default %d)\n",
+           DEFAULT_STATS_INTERVAL);
+}
 
-        char line[1024];
-        if (fgets(line, sizeof(line), stdin) == NULL) break;
+// Settings of the shell taken from the command line
+typedef struct {
+    VolumeGeometry geometry;
+    const char* image_path;   // NULL for a volume in memory
+    int journal_mode;
+    long long cache_size;     // Bytes of block cache, 0 to map the blocks
+    int io_engine;            // I/O engine of the block cache
+    int compression;          // 1 or 0, -1 to keep the volume's setting
+    int dedup;                // Likewise
+    const char* script_path;  // Batch mode script, NULL if interactive
+    const char* stats_path;   // Where statistics are dumped, NULL if nowhere
+    int stats_interval;       // Seconds between two dumps
+} Options;
 
-        command[0] = arg1[0] = arg2[0] = '\0';
-        sscanf(line, "%s %s %[^\n]", command, arg1, arg2);
+// Read the options of the command line. Returns 0, or -1 if one is invalid.
+int parse_options(int argc, char* argv[], Options* options) {
+    VolumeGeometry* geometry = &options->geometry;
+    long long volume_size = -1;
+    long long max_files = -1;
+    geometry->block_size = DEFAULT_BLOCK_SIZE;
+    geometry->num_files = DEFAULT_NUM_FILES;
+    options->image_path = NULL;
+    options->journal_mode = JOURNAL_BATCHED;
+    options->cache_size = 0;
+    options->io_engine = IO_URING;
+    options->compression = -1;
+    options->dedup = -1;
+    options->script_path = NULL;
+    options->stats_path = NULL;
+    options->stats_interval = DEFAULT_STATS_INTERVAL;
 
-        if (strcmp(command, "exit") == 0) {
-            break;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            options->image_path = argv[++i];
+            continue;
         }
-        else if (strcmp(command, "help") == 0) {
-            print_help();
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            options->script_path = argv[++i];
+            continue;
         }
-        else if (strcmp(command, "pwd") == 0) {
-            char path[MAX_PATH];
-            get_full_path(fs.current_dir, path);
-            printf("%s\n", path);
+        if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            options->stats_path = argv[++i];
+            continue;
         }
-        else if (strcmp(command, "ls") == 0) {
-            list_directory(fs.current_dir);
-        }
-        else if (strcmp(command, "mkdir") == 0) {
-            if (arg1[0] == '\0') {
-                printf("Usage: mkdir <name>\n");
-                continue;
-            }
-            int result = create_file(arg1, 1);
-            if (result >= 0) {
-                printf("Directory created successfully\n");
+        if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "off") == 0) {
+                options->journal_mode = JOURNAL_OFF;
+            } else if (strcmp(mode, "batched") == 0) {
+                options->journal_mode = JOURNAL_BATCHED;
+            } else if (strcmp(mode, "strict") == 0) {
+                options->journal_mode = JOURNAL_STRICT;
+            } else {
+                return -1;
             }
+            continue;
         }
-        else if (strcmp(command, "cd") == 0) {
-            if (arg1[0] == '\0') {
-                printf("Usage: cd <name> or cd ..\n");
-                continue;
-            }
-
-            if (strcmp(arg1, "..") == 0) {
-                if (fs.current_dir != 0) {  // If not already at root
-                    fs.current_dir = fs.files[fs.current_dir].parent_dir;
-                }
+        if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            const char* engine = argv[++i];
+            if (strcmp(engine, "uring") == 0) {
+                options->io_engine = IO_URING;
+            } else if (strcmp(engine, "threads") == 0) {
+                options->io_engine = IO_THREADS;
+            } else if (strcmp(engine, "sync") == 0) {
+                options->io_engine = IO_SYNC;
             } else {
-                int dir_index = find_file_in_dir(arg1, fs.current_dir);
-                if (dir_index == -1) {
-                    printf("Error: Directory not found\n");
-                } else if (!fs.files[dir_index].is_directory) {
-                    printf("Error: This is not a directory\n");
-                } else {
-                    fs.current_dir = dir_index;
-                }
+                return -1;
             }
+            continue;
         }
-        else if (strcmp(command, "create") == 0) {
-            if (arg1[0] == '\0') {
-                printf("Usage: create <name>\n");
-                continue;
-            }
-            int result = create_file(arg1, 0);
-            if (result >= 0) {
-                printf("File created successfully\n");
-            }
+        if (strcmp(argv[i], "--compression") == 0 && i + 1 < argc) {
+            options->compression = parse_switch(argv[++i]);
+            if (options->compression == -1) return -1;
+            continue;
         }
-        else if (strcmp(command, "write") == 0) {
-            if (arg1[0] == '\0' || arg2[0] == '\0') {
-                printf("Usage: write <name> <content>\n");
-                continue;
-            }
-            if (write_file(arg1, arg2) == 0) {
-                printf("Content written successfully\n");
-            }
+        if (strcmp(argv[i], "--dedup") == 0 && i + 1 < argc) {
+            options->dedup = parse_switch(argv[++i]);
+            if (options->dedup == -1) return -1;
+            continue;
         }
-        else if (strcmp(command, "read") == 0) {
-            if (arg1[0] == '\0') {
-                printf("Usage: read <name>\n");
-                continue;
-            }
-            char* content = read_file(arg1);
-            if (content) {
-                printf("Content: %s\n", content);
-                free(content);
-            }
+        long long value = (i + 1 < argc) ? parse_size(argv[i + 1]) : -1;
+        if (value < 0 ||
+            (value > 0x7fffffff && strcmp(argv[i], "--volume-size") != 0 &&
+         strcmp(argv[i], "--block-cache") != 0)) {
+            return -1;
         }
-        else if (strcmp(command, "delete") == 0) {
-            if (arg1[0] == '\0') {
-                printf("Usage: delete <name>\n");
-                continue;
-            }
-            if (strcmp(arg1, "/") == 0) {
-                printf("Error: Cannot delete the root directory\n");
-                continue;
-            }
+        if (strcmp(argv[i], "--block-size") == 0) {
+            geometry->block_size = (int)value;
+        } else if (strcmp(argv[i], "--volume-size") == 0) {
+            volume_size = value;
+        } else if (strcmp(argv[i], "--files") == 0) {
+            geometry->num_files = (int)value;
+        } else if (strcmp(argv[i], "--max-files") == 0) {
+            max_files = value;
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && value > 0) {
+            options->stats_interval = (int)value;
+        } else if (strcmp(argv[i], "--block-cache") == 0 && value > 0) {
+            options->cache_size = value;
+        } else {
+            return -1;
+        }
+        i++;
+    }
 
-            int index = find_file_in_dir(arg1, fs.current_dir);
-            if (index == -1) {
-                printf("Error: File or directory not found\n");
-                continue;
-            }
+    if (geometry->block_size <= 0 ||
+        volume_size / geometry->block_size > 0x7fffffff ||
+        (options->cache_size > 0 && !options->image_path)) {
+        return -1;
+    }
+    geometry->num_blocks = (volume_size < 0) ? DEFAULT_NUM_BLOCKS :
+        (int)(volume_size / geometry->block_size);
+    if (max_files < 0) {
+        max_files = geometry->num_blocks;
+        if (max_files < geometry->num_files) max_files = geometry->num_files;
+    }
+    geometry->max_files = (int)max_files;
+    return 0;
+}
 
-            if (fs.files[index].is_directory) {
-                if (delete_directory_recursive(index) == 0) {
-                    printf("Directory and its contents deleted successfully\n");
-                }
-            } else {
-                if (delete_file(arg1) == 0) {
-                    printf("File deleted successfully\n");
-                }
-            }
+#ifndef VAN_NO_MAIN
+int main(int argc, char* argv[]) {
+    Options options;
+    if (parse_options(argc, argv, &options) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    FILE* input = stdin;
+    if (options.script_path && strcmp(options.script_path, "-") != 0) {
+        input = fopen(options.script_path, "r");
+        if (!input) {
+            printf("Error: Cannot open script %s\n", options.script_path);
+            return 1;
+        }
+    }
+    io_engine_choice = options.io_engine;
+    FILE* image = options.image_path ? fopen(options.image_path, "rb") : NULL;
+    if (image) {
+        fclose(image);
+        if (open_volume_image(options.image_path, options.journal_mode,
+                              options.cache_size) != 0) {
+            return 1;
+        }
+    } else if (options.image_path) {
+        if (create_volume_image(options.image_path, &options.geometry,
+                                options.journal_mode, options.cache_size) != 0) {
+            return 1;
+        }
+    } else if (init_filesystem(&options.geometry) != 0) {
+        return 1;
+    }
+    if (options.compression != -1) fs.compression = options.compression;
+    if (options.dedup != -1) fs.dedup = options.dedup;
+    StatsDumper dumper;
+    if (options.stats_path &&
+        start_stats_dumper(&dumper, options.stats_path, options.stats_interval) != 0) {
+        free_filesystem();
+        return 1;
+    }
+
+    // Prompts are only shown to someone typing at a terminal
+    shell_quiet = options.script_path != NULL;
+    int interactive = !shell_quiet && input_is_terminal(input);
+    if (!shell_quiet) {
+        printf("File system initialized. Type 'help' for the list of commands.\n");
+    }
+
+    static char line[MAX_LINE];
+    long long lines = 0;
+    long long failed = 0;
+    while (1) {
+        if (interactive) {
+            journal_idle();
+            print_prompt();
         }
-        else {
-            printf("Unrecognized command. Type 'help' for the list of commands.\n");
+
+        int status = read_line(input, line, sizeof(line));
+        if (status == 0) break;
+        lines++;
+        if (status < 0) {
+            printf("Error: Line %lld is longer than %d characters\n", lines, MAX_LINE - 1);
+            failed++;
+            continue;
         }
+        status = run_line(line);
+        if (status > 0) break;
+        if (status < 0) failed++;
     }
 
+    if (input != stdin) fclose(input);
+    if (options.stats_path) stop_stats_dumper(&dumper);
+    free_filesystem();
+    if (shell_quiet && failed > 0) {
+        printf("Error: %lld of %lld lines failed\n", failed, lines);
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+#endif